@@ -0,0 +1,632 @@
+/*
+ * LVBENCH :: headless benchmark for the lvnanomsg wrapper
+ * Links nanomsg_labview.c against the LabVIEW memory-manager stand-in in
+ * lvstub.c and measures the exported calls against raw nn_send/nn_recv,
+ * so that the overhead the wrapper adds (handle copies, lookups, locks)
+ * is visible and can be tracked from one change to the next.
+ *
+ * For every transport and message size it reports
+ *   - round-trip latency percentiles against a raw echo peer, and
+ *   - one-way receive throughput from a raw peer sending flat out,
+ * together with the bytes the wrapper copied per message, and the round
+ * trip of a 1M-sample DBL waveform flattened in G against the typed
+ * array calls.
+ *
+ * usage: lvbench [-n iterations] [-t transport-prefix] [-s size]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <nanomsg/nn.h>
+#include <nanomsg/pair.h>
+#include <extcode.h>
+
+#include "sync.h"
+#include "objtable.h"
+#include "bonzai.h"
+
+/* the exports under test */
+int lvnanomsg_ctx_create_reserve(bonzai **pinstdata);
+int lvnanomsg_ctx_create(bonzai **pinstdata, objref *ctxptr);
+int lvnanomsg_ctx_create_unreserve(bonzai **pinstdata);
+int lvnanomsg_socket(objref ctxref, objref *sockptr, int type, int linger);
+int lvnanomsg_close(objref sockref, int flags);
+int lvnanomsg_bind(objref sockref, const char *addr);
+int lvnanomsg_setsockopt(objref sockref, int level, int opt,
+			 const void *val, size_t len);
+int lvnanomsg_send(objref sockref, const UHandle h, int *flags);
+int lvnanomsg_recv(objref *pinstdata, objref sockref, UHandle h, int *flags);
+int lvnanomsg_recv_multi(objref *pinstdata, objref sockref, char **h, int *flags);
+int lvnanomsg_sendmsg(objref sockref, char **h, int *flags);
+int lvnanomsg_recvmsg(objref *pinstdata, objref sockref, char **h,
+		      const int lenvec[], const int size, int *flags);
+int lvnanomsg_poll(bonzai **pinstdata, const objref *sockrefs, int *events,
+		   int n, long timeout, unsigned int *nevents);
+int lvnanomsg_send_array(objref sockref, int type, int ndims,
+			 const UHandle arr, int bigendian, int *flags);
+int lvnanomsg_recv_array(objref *pinstdata, objref sockref, int type,
+			 int ndims, UHandle arr, int *flags);
+int lvnanomsg_receiver_register(LVUserEventRef *evt, objref sockref);
+uint64_t lvnanomsg_get_statistic(objref sockref, int statistic, uint64_t *result);
+
+#define LVSTAT_RECV_COPIED	1000
+
+#define MAX_ITERS	1000000
+#define WAIT_MS		5000	/* give up on a stuck case after this long */
+
+static const char *transports[] = {
+	"inproc://lvbench",
+	"ipc:///tmp/lvbench.ipc",
+	"tcp://127.0.0.1:15591",
+};
+#define NTRANSPORTS	(sizeof(transports) / sizeof(transports[0]))
+
+static const int sizes[] = { 16, 256, 4096, 65536 };
+#define NSIZES		(sizeof(sizes) / sizeof(sizes[0]))
+
+static int iters = 5000;
+static bonzai *inst = NULL;
+static objref ctx = 0;
+
+/*
+ * RECEIVER HOOK
+ * stands in for the LabVIEW event queue: counts what the receiver posts
+ */
+static atomic_t posted = 0;
+
+static void post_hook(LVUserEventRef ref, void *data)
+{
+	atomic_inc(&posted);
+}
+
+static int wait_posted(int n)
+{
+	uint64_t t0 = clock_ns();
+
+	while (atomic_get(&posted) < n) {
+		if (clock_ns() - t0 > (uint64_t)WAIT_MS * 1000000)
+			return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+/*
+ * PEER
+ * a raw nanomsg socket in its own thread that either echoes everything
+ * back or, once told to go, sends count messages as fast as it can
+ */
+#define PEER_ECHO	0
+#define PEER_BLAST	1
+
+typedef struct {
+	int sock;
+	int mode;
+	int size, count;
+	volatile int stop;
+	thread_t thread;
+} peer;
+
+static THREAD_PROC(peer_thread, arg)
+{
+	peer *p = arg;
+	void *msg;
+	char *buf;
+	int i, ret;
+
+	if (p->mode == PEER_ECHO) {
+		while (!p->stop) {
+			if ((ret = nn_recv(p->sock, &msg, NN_MSG, 0)) < 0)
+				continue;	/* timed out; check for stop */
+			/* hand the chunk straight back, no copy */
+			if (nn_send(p->sock, &msg, NN_MSG, 0) < 0)
+				nn_freemsg(msg);
+		}
+		THREAD_RETURN;
+	}
+	/* wait for the go byte, which also proves the pipe is connected */
+	while (!p->stop && (nn_recv(p->sock, &msg, NN_MSG, 0) < 0))
+		;
+	if (p->stop)
+		THREAD_RETURN;
+	nn_freemsg(msg);
+	buf = calloc(p->size ? p->size : 1, 1);
+	for (i = 0; (i < p->count) && !p->stop; ) {
+		if (nn_send(p->sock, buf, p->size, 0) >= 0)
+			++i;
+	}
+	free(buf);
+	THREAD_RETURN;
+}
+
+static int peer_start(peer *p, const char *addr, int mode, int size, int count)
+{
+	int tmo = 100;
+
+	memset(p, 0, sizeof(peer));
+	p->mode = mode;
+	p->size = size;
+	p->count = count;
+	if ((p->sock = nn_socket(AF_SP, NN_PAIR)) < 0)
+		return -1;
+	nn_setsockopt(p->sock, NN_SOL_SOCKET, NN_RCVTIMEO, &tmo, sizeof(tmo));
+	nn_setsockopt(p->sock, NN_SOL_SOCKET, NN_SNDTIMEO, &tmo, sizeof(tmo));
+	if ((nn_connect(p->sock, addr) < 0)
+	    || (thread_create(&p->thread, peer_thread, p) != 0)) {
+		nn_close(p->sock);
+		return -1;
+	}
+	return 0;
+}
+
+static void peer_stop(peer *p)
+{
+	p->stop = 1;
+	thread_join(p->thread);
+	nn_close(p->sock);
+}
+
+/*
+ * SIDES
+ * the measured end is either a raw socket or a wrapper socket, both bound
+ * to the address the peer connects to
+ */
+typedef struct {
+	int raw;		/* raw nanomsg socket, or -1 */
+	objref ref;		/* wrapper socket, or 0 */
+	UHandle tx, rx;		/* LabVIEW-side buffers */
+	UHandle parts;		/* array of handles for sendmsg/recvmsg */
+	char *buf;
+	int size;
+} side;
+
+static int side_open(side *s, const char *addr, int size, int raw)
+{
+	int tmo = WAIT_MS, linger = 0;
+
+	memset(s, 0, sizeof(side));
+	s->raw = -1;
+	s->size = size;
+	s->buf = calloc(size ? size : 1, 1);
+	s->tx = DSNewHClr(size + 4);
+	s->rx = DSNewHClr(4);
+	s->parts = DSNewHClr(4 + sizeof(UHandle));
+	*(uint32_t*)*s->tx = size;
+	/* one part, pointing at the send buffer */
+	*(uint32_t*)*s->parts = 1;
+	memcpy(*s->parts + 4, &s->tx, sizeof(UHandle));
+	if (raw) {
+		if ((s->raw = nn_socket(AF_SP, NN_PAIR)) < 0)
+			return -1;
+		nn_setsockopt(s->raw, NN_SOL_SOCKET, NN_RCVTIMEO, &tmo, sizeof(tmo));
+		return (nn_bind(s->raw, addr) < 0) ? -1 : 0;
+	}
+	if (lvnanomsg_socket(ctx, &s->ref, NN_PAIR, linger) < 0)
+		return -1;
+	lvnanomsg_setsockopt(s->ref, NN_SOL_SOCKET, NN_RCVTIMEO, &tmo, sizeof(tmo));
+	return (lvnanomsg_bind(s->ref, addr) < 0) ? -1 : 0;
+}
+
+static uint64_t side_stat(side *s, int stat)
+{
+	uint64_t v = 0;
+
+	if (s->ref)
+		lvnanomsg_get_statistic(s->ref, stat, &v);
+	return v;
+}
+
+static void side_close(side *s)
+{
+	if (s->raw >= 0)
+		nn_close(s->raw);
+	if (s->ref)
+		lvnanomsg_close(s->ref, 1);
+	DSDisposeHandle(s->tx);
+	DSDisposeHandle(s->rx);
+	DSDisposeHandle(s->parts);
+	free(s->buf);
+}
+
+/* dispose of the handles in an array of handles and empty it */
+static int drop_parts(UHandle h)
+{
+	uint32_t i, n = *(uint32_t*)*h;
+	UHandle part;
+
+	for (i = 0; i < n; ++i) {
+		memcpy(&part, *h + 4 + i * sizeof(UHandle), sizeof(UHandle));
+		DSDisposeHandle(part);
+	}
+	*(uint32_t*)*h = 0;
+	return n;
+}
+
+/*
+ * METHODS
+ * a round trip sends one message and receives its echo; a drain receives
+ * whatever is queued and returns how many messages it got, or -errno
+ */
+typedef struct {
+	const char *name;
+	int raw;
+	int (*roundtrip)(side *s);
+	int (*drain)(side *s);
+	int receiver;		/* messages arrive through the receiver thread */
+} method;
+
+static int raw_roundtrip(side *s)
+{
+	void *msg;
+
+	if (nn_send(s->raw, s->buf, s->size, 0) < 0)
+		return -nn_errno();
+	if (nn_recv(s->raw, &msg, NN_MSG, 0) < 0)
+		return -nn_errno();
+	nn_freemsg(msg);
+	return 0;
+}
+
+static int raw_drain(side *s)
+{
+	void *msg;
+
+	if (nn_recv(s->raw, &msg, NN_MSG, 0) < 0)
+		return -nn_errno();
+	nn_freemsg(msg);
+	return 1;
+}
+
+static int recv_roundtrip(side *s)
+{
+	int ret, flags = 0;
+
+	if ((ret = lvnanomsg_send(s->ref, s->tx, &flags)) < 0)
+		return ret;
+	return lvnanomsg_recv(NULL, s->ref, s->rx, &flags);
+}
+
+static int recv_drain(side *s)
+{
+	int ret, flags = 0;
+
+	ret = lvnanomsg_recv(NULL, s->ref, s->rx, &flags);
+	return (ret < 0) ? ret : 1;
+}
+
+static int poll_roundtrip(side *s)
+{
+	int ret, flags = 0, evt = NN_POLLIN;
+
+	if ((ret = lvnanomsg_send(s->ref, s->tx, &flags)) < 0)
+		return ret;
+	if ((ret = lvnanomsg_poll(NULL, &s->ref, &evt, 1, WAIT_MS, NULL)) <= 0)
+		return ret ? ret : -ETIMEDOUT;
+	return lvnanomsg_recv(NULL, s->ref, s->rx, &flags);
+}
+
+static int poll_drain(side *s)
+{
+	int ret, evt = NN_POLLIN;
+
+	if ((ret = lvnanomsg_poll(NULL, &s->ref, &evt, 1, WAIT_MS, NULL)) <= 0)
+		return ret ? ret : -ETIMEDOUT;
+	return recv_drain(s);
+}
+
+static int multi_drain(side *s)
+{
+	int ret, flags = NN_DONTWAIT, evt = NN_POLLIN;
+
+	if ((ret = lvnanomsg_poll(NULL, &s->ref, &evt, 1, WAIT_MS, NULL)) <= 0)
+		return ret ? ret : -ETIMEDOUT;
+	ret = lvnanomsg_recv_multi(NULL, s->ref, s->rx, &flags);
+	if ((ret < 0) && (ret != -EAGAIN))
+		return ret;
+	return drop_parts(s->rx);
+}
+
+static int msg_roundtrip(side *s)
+{
+	int ret, flags = 0;
+
+	if ((ret = lvnanomsg_sendmsg(s->ref, s->parts, &flags)) < 0)
+		return ret;
+	ret = lvnanomsg_recvmsg(NULL, s->ref, s->rx, &s->size, 1, &flags);
+	drop_parts(s->rx);
+	return ret;
+}
+
+static int msg_drain(side *s)
+{
+	int ret, flags = 0;
+
+	ret = lvnanomsg_recvmsg(NULL, s->ref, s->rx, &s->size, 1, &flags);
+	drop_parts(s->rx);
+	return (ret < 0) ? ret : 1;
+}
+
+static int receiver_roundtrip(side *s)
+{
+	int ret, flags = 0, n = atomic_get(&posted);
+
+	if ((ret = lvnanomsg_send(s->ref, s->tx, &flags)) < 0)
+		return ret;
+	return wait_posted(n + 1);
+}
+
+static const method methods[] = {
+	{ "raw nn_send/recv",	1, raw_roundtrip,	raw_drain,	0 },
+	{ "send/recv",		0, recv_roundtrip,	recv_drain,	0 },
+	{ "send/poll+recv",	0, poll_roundtrip,	poll_drain,	0 },
+	{ "recv_multi",		0, NULL,		multi_drain,	0 },
+	{ "sendmsg/recvmsg",	0, msg_roundtrip,	msg_drain,	0 },
+	{ "receiver thread",	0, receiver_roundtrip,	NULL,		1 },
+};
+#define NMETHODS	(sizeof(methods) / sizeof(methods[0]))
+
+/*
+ * TYPED ARRAYS
+ * a waveform sent the way G does it today, flattened to a big-endian
+ * string and unflattened on the way back in, against the typed array
+ * calls in both byte orders
+ */
+#define WAVE_SAMPLES	(1 << 20)
+#define WAVE_ITERS	50
+#define WAVE_FLATSIZE	(4 + 8 * WAVE_SAMPLES)
+
+static UHandle wave_tx, wave_rx;	/* 1D DBL arrays */
+
+/* the per-element work Flatten To String and Unflatten From String do */
+static void wave_swap(char *dst, const char *src, int n)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		memcpy(&v, src + 8 * i, 8);
+		v = __builtin_bswap64(v);
+		memcpy(dst + 8 * i, &v, 8);
+	}
+}
+
+static int flat_roundtrip(side *s)
+{
+	int ret, flags = 0;
+	int32_t n = *(int32_t*)*wave_tx;
+	char *flat;
+
+	/* flatten: length-prefixed string, big-endian throughout */
+	flat = *s->tx + 4;
+	*(int32_t*)flat = (int32_t)__builtin_bswap32(n);
+	wave_swap(flat + 4, *wave_tx + 8, n);
+	if ((ret = lvnanomsg_send(s->ref, s->tx, &flags)) < 0)
+		return ret;
+	if ((ret = lvnanomsg_recv(NULL, s->ref, s->rx, &flags)) < 0)
+		return ret;
+	/* unflatten */
+	flat = *s->rx + 4;
+	n = (int32_t)__builtin_bswap32(*(uint32_t*)flat);
+	if (NumericArrayResize(fD, 1, &wave_rx, n) != mgNoErr)
+		return -ENOMEM;
+	*(int32_t*)*wave_rx = n;
+	wave_swap(*wave_rx + 8, flat + 4, n);
+	return 0;
+}
+
+static int array_roundtrip(side *s, int bigendian)
+{
+	int ret, flags = 0;
+
+	if ((ret = lvnanomsg_send_array(s->ref, fD, 1, wave_tx, bigendian, &flags)) < 0)
+		return ret;
+	return lvnanomsg_recv_array(NULL, s->ref, fD, 1, wave_rx, &flags);
+}
+
+static int array_be_roundtrip(side *s)
+{
+	return array_roundtrip(s, 1);
+}
+
+static int array_native_roundtrip(side *s)
+{
+	const uint16_t one = 1;
+	return array_roundtrip(s, *(const uint8_t*)&one == 0);
+}
+
+static const method wave_methods[] = {
+	{ "flatten+send/recv",	0, flat_roundtrip,		NULL,	0 },
+	{ "array, big-endian",	0, array_be_roundtrip,		NULL,	0 },
+	{ "array, native",	0, array_native_roundtrip,	NULL,	0 },
+};
+#define NWAVE_METHODS	(sizeof(wave_methods) / sizeof(wave_methods[0]))
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct_us(const uint64_t *v, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.5);
+	return v[i] / 1000.0;
+}
+
+static void bench_latency(const char *addr, int size, const method *m,
+			  uint64_t *samples)
+{
+	side s;
+	peer p;
+	int i, ret = 0;
+	LVUserEventRef evt = 1;
+
+	if (side_open(&s, addr, size, m->raw) < 0) {
+		printf("  %-18s %s\n", m->name, "setup failed");
+		side_close(&s);
+		return;
+	}
+	if (m->receiver)
+		lvnanomsg_receiver_register(&evt, s.ref);
+	if (peer_start(&p, addr, PEER_ECHO, size, 0) < 0) {
+		printf("  %-18s %s\n", m->name, "peer failed");
+		side_close(&s);
+		return;
+	}
+	/* warm up the connection and the caches */
+	for (i = 0; (i < iters / 10 + 1) && (ret >= 0); ++i)
+		ret = m->roundtrip(&s);
+	for (i = 0; (i < iters) && (ret >= 0); ++i) {
+		uint64_t t0 = clock_ns();
+		ret = m->roundtrip(&s);
+		samples[i] = clock_ns() - t0;
+	}
+	peer_stop(&p);
+	if (ret < 0)
+		printf("  %-18s failed after %i: %s\n", m->name, i, nn_strerror(-ret));
+	else {
+		qsort(samples, iters, sizeof(uint64_t), cmp_u64);
+		printf("  %-18s %10.2f %10.2f %10.2f %10.2f\n", m->name,
+		       pct_us(samples, iters, 0.5), pct_us(samples, iters, 0.99),
+		       pct_us(samples, iters, 0.999), pct_us(samples, iters, 1.0));
+	}
+	side_close(&s);
+}
+
+static void bench_throughput(const char *addr, int size, const method *m)
+{
+	side s;
+	peer p;
+	int n = 0, ret = 0, count, flags = 0;
+	LVUserEventRef evt = 1;
+	uint64_t t0, dt;
+	double secs;
+
+	/* keep the big sizes to a sensible amount of data */
+	count = iters * 4;
+	if ((uint64_t)count * size > (64 << 20))
+		count = (64 << 20) / size;
+	if (side_open(&s, addr, size, m->raw) < 0) {
+		printf("  %-18s %s\n", m->name, "setup failed");
+		side_close(&s);
+		return;
+	}
+	if (m->receiver) {
+		lvnanomsg_receiver_register(&evt, s.ref);
+		atomic_set(&posted, 0);
+	}
+	if (peer_start(&p, addr, PEER_BLAST, size, count) < 0) {
+		printf("  %-18s %s\n", m->name, "peer failed");
+		side_close(&s);
+		return;
+	}
+	t0 = clock_ns();
+	/* the go byte */
+	if (m->raw)
+		nn_send(s.raw, "", 0, 0);
+	else {
+		*(uint32_t*)*s.tx = 0;
+		lvnanomsg_send(s.ref, s.tx, &flags);
+	}
+	if (m->receiver) {
+		ret = wait_posted(count);
+		n = atomic_get(&posted);
+	} else {
+		while ((n < count) && ((ret = m->drain(&s)) >= 0))
+			n += ret;
+	}
+	dt = clock_ns() - t0;
+	peer_stop(&p);
+	secs = dt / 1e9;
+	if (ret < 0)
+		printf("  %-18s failed after %i: %s\n", m->name, n, nn_strerror(-ret));
+	else
+		printf("  %-18s %12.0f %10.1f %12.1f\n", m->name, n / secs,
+		       (double)n * size / secs / (1 << 20),
+		       (double)side_stat(&s, LVSTAT_RECV_COPIED) / n);
+	side_close(&s);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int onlysize = -1;
+	unsigned int t, z, k;
+	int i;
+	uint64_t *samples;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-n") && (i + 1 < argc))
+			iters = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t") && (i + 1 < argc))
+			only = argv[++i];
+		else if (!strcmp(argv[i], "-s") && (i + 1 < argc))
+			onlysize = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [-n iterations] [-t transport] [-s size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((iters <= 0) || (iters > MAX_ITERS))
+		iters = 5000;
+	if (!(samples = malloc(iters * sizeof(uint64_t))))
+		return 1;
+
+	lvstub_post_hook = post_hook;
+	lvnanomsg_ctx_create_reserve(&inst);
+	if (lvnanomsg_ctx_create(&inst, &ctx) < 0) {
+		fprintf(stderr, "cannot create a context\n");
+		return 1;
+	}
+
+	/* a ramp, so the swapped bytes are not all the same */
+	wave_tx = DSNewHandle(8 + 8 * WAVE_SAMPLES);
+	wave_rx = DSNewHClr(8);
+	*(int32_t*)*wave_tx = WAVE_SAMPLES;
+	for (i = 0; i < WAVE_SAMPLES; ++i)
+		((double*)(*wave_tx + 8))[i] = i * 0.001;
+
+	for (t = 0; t < NTRANSPORTS; ++t) {
+		if (only && strncmp(transports[t], only, strlen(only)))
+			continue;
+		if (onlysize < 0) {
+			int saved = iters;
+
+			iters = (iters < WAVE_ITERS) ? iters : WAVE_ITERS;
+			printf("\n%s, %i-sample DBL waveform, %i iterations\n",
+			       transports[t], WAVE_SAMPLES, iters);
+			printf("  %-18s %10s %10s %10s %10s\n", "round trip (us)",
+			       "p50", "p99", "p99.9", "max");
+			for (k = 0; k < NWAVE_METHODS; ++k)
+				bench_latency(transports[t], WAVE_FLATSIZE,
+					      &wave_methods[k], samples);
+			iters = saved;
+		}
+		for (z = 0; z < NSIZES; ++z) {
+			if ((onlysize >= 0) && (sizes[z] != onlysize))
+				continue;
+			printf("\n%s, %i bytes, %i iterations\n", transports[t], sizes[z], iters);
+			printf("  %-18s %10s %10s %10s %10s\n", "round trip (us)",
+			       "p50", "p99", "p99.9", "max");
+			for (k = 0; k < NMETHODS; ++k) {
+				if (methods[k].roundtrip)
+					bench_latency(transports[t], sizes[z], &methods[k], samples);
+			}
+			printf("  %-18s %12s %10s %12s\n", "receive",
+			       "msg/s", "MB/s", "copied B/msg");
+			for (k = 0; k < NMETHODS; ++k) {
+				if (methods[k].drain || methods[k].receiver)
+					bench_throughput(transports[t], sizes[z], &methods[k]);
+			}
+		}
+	}
+
+	lvnanomsg_ctx_create_unreserve(&inst);
+	DSDisposeHandle(wave_tx);
+	DSDisposeHandle(wave_rx);
+	free(samples);
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * LVCHECK :: headless regression checks for the lvnanomsg wrapper
+ * Links nanomsg_labview.c against the LabVIEW memory-manager stand-in in
+ * lvstub.c, like lvbench, and runs the lifetime cases that have gone
+ * wrong before; each prints ok or FAIL, and the exit status is the
+ * number that failed. Most of these only show a use-after-free under a
+ * checker, so run it under valgrind or build it with -fsanitize=address.
+ *
+ * usage: lvcheck
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <nanomsg/nn.h>
+#include <nanomsg/pair.h>
+#include <extcode.h>
+
+#include "sync.h"
+#include "objtable.h"
+#include "bonzai.h"
+
+/* the exports under test */
+int lvnanomsg_ctx_create_reserve(bonzai **pinstdata);
+int lvnanomsg_ctx_create(bonzai **pinstdata, objref *ctxptr);
+int lvnanomsg_ctx_create_unreserve(bonzai **pinstdata);
+int lvnanomsg_ctx_destroy(objref *pinstdata, objref ctxref, int flags);
+int lvnanomsg_socket(objref ctxref, objref *sockptr, int type, int linger);
+int lvnanomsg_close(objref sockref, int flags);
+int lvnanomsg_bind(objref sockref, const char *addr);
+int lvnanomsg_recv(objref *pinstdata, objref sockref, UHandle h, int *flags);
+
+#define WAIT_MS		5000	/* give up on a stuck case after this long */
+
+static bonzai *inst = NULL;
+static int failed = 0;
+
+static void check(const char *name, int ok)
+{
+	printf("  %-48s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok)
+		++failed;
+}
+
+typedef struct {
+	objref sock;
+	int ret;
+	thread_t thread;
+} blocked;
+
+static THREAD_PROC(blocked_thread, arg)
+{
+	blocked *b = arg;
+	UHandle h = DSNewHClr(4);
+	int flags = 0;
+
+	b->ret = lvnanomsg_recv(NULL, b->sock, h, &flags);
+	DSDisposeHandle(h);
+	THREAD_RETURN;
+}
+
+/* wait until the receive in the thread holds the socket's blocking claim */
+static int wait_blocked(objref sock)
+{
+	UHandle h = DSNewHClr(4);
+	int i, ret = 0, flags;
+
+	for (i = 0; i < WAIT_MS; ++i) {
+		flags = NN_DONTWAIT;
+		if ((ret = lvnanomsg_recv(NULL, sock, h, &flags)) == -EINPROGRESS)
+			break;
+		thread_sleep(1);
+	}
+	DSDisposeHandle(h);
+	return ret == -EINPROGRESS;
+}
+
+/*
+ * a forced ctx_destroy leaves a socket blocked in another call open; it
+ * and its context must stay valid until that socket is closed as well
+ */
+static void check_destroy_blocked(void)
+{
+	objref ctx = 0;
+	blocked b;
+
+	printf("context destroyed under a blocked socket\n");
+	memset(&b, 0, sizeof(b));
+	if ((lvnanomsg_ctx_create(&inst, &ctx) < 0)
+	    || (lvnanomsg_socket(ctx, &b.sock, NN_PAIR, 0) < 0)
+	    || (lvnanomsg_bind(b.sock, "inproc://lvcheck-destroy") < 0)) {
+		check("set up", 0);
+		return;
+	}
+	if (thread_create(&b.thread, blocked_thread, &b) != 0) {
+		check("start the receiving thread", 0);
+		lvnanomsg_ctx_destroy(NULL, ctx, 1);
+		return;
+	}
+	check("receive blocks", wait_blocked(b.sock));
+	check("ctx_destroy(flags=1) succeeds", lvnanomsg_ctx_destroy(NULL, ctx, 1) == 0);
+	check("blocked socket closes after it", lvnanomsg_close(b.sock, 1) == 0);
+	thread_join(b.thread);
+	check("blocked receive fails once closed", b.ret < 0);
+	check("socket reference is stale", lvnanomsg_close(b.sock, 1) < 0);
+}
+
+int main(int argc, char **argv)
+{
+	lvnanomsg_ctx_create_reserve(&inst);
+
+	check_destroy_blocked();
+
+	lvnanomsg_ctx_create_unreserve(&inst);
+	printf("%i failed\n", failed);
+
+	return failed;
+}
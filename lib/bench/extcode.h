@@ -0,0 +1,43 @@
+/*
+----------------------------------------------------------------------
+EXTCODE :: stand-in for the cintools header, for headless builds
+Declares the handful of LabVIEW memory-manager and event functions the
+wrapper uses, so that it can be linked against lvstub.c and exercised
+outside LabVIEW. Only the benchmark build puts this directory on the
+include path; the real library is always built against cintools.
+----------------------------------------------------------------------
+*/
+
+#ifndef _extcode_H
+#define _extcode_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int32_t int32;
+typedef uint32_t uInt32;
+typedef char *UPtr;
+typedef char **UHandle;
+typedef int32 MgErr;
+typedef uInt32 LVUserEventRef;
+
+enum { mgNoErr = 0, mFullErr = 2 };
+
+/* numeric type codes, for NumericArrayResize */
+enum { iB = 1, iW, iL, iQ, uB, uW, uL, uQ, fS, fD, fX, cS, cD, cX };
+
+UHandle DSNewHandle(size_t size);
+UHandle DSNewHClr(size_t size);
+MgErr DSSetHandleSize(void *h, size_t size);
+MgErr DSSetHSzClr(void *h, size_t size);
+int32 DSGetHandleSize(void *h);
+MgErr DSDisposeHandle(void *h);
+MgErr NumericArrayResize(int32 typeCode, int32 numDims, UHandle *dataHP,
+			 size_t totalNewSize);
+void MoveBlock(const void *src, void *dst, size_t len);
+MgErr PostLVUserEvent(LVUserEventRef ref, void *data);
+
+/* benchmark hook: called for every PostLVUserEvent, may be NULL */
+extern void (*lvstub_post_hook)(LVUserEventRef ref, void *data);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+----------------------------------------------------------------------
+LVSTUB :: LabVIEW memory manager stand-in
+A handle is a pointer to a master pointer, as in LabVIEW; the master
+record also keeps the block size so that handles can be resized and
+queried. Posted user events are handed to an optional hook instead of
+an event queue.
+----------------------------------------------------------------------
+*/
+
+#include "extcode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	char *ptr;		/* must come first: a handle points here */
+	size_t size;
+} lvmaster;
+
+void (*lvstub_post_hook)(LVUserEventRef ref, void *data) = NULL;
+
+static UHandle lvstub_new(size_t size, int clear)
+{
+	lvmaster *m = malloc(sizeof(lvmaster));
+
+	if (!m)
+		return NULL;
+	m->ptr = clear ? calloc(size ? size : 1, 1) : malloc(size ? size : 1);
+	if (!m->ptr) {
+		free(m);
+		return NULL;
+	}
+	m->size = size;
+	return &m->ptr;
+}
+
+static MgErr lvstub_resize(void *h, size_t size, int clear)
+{
+	lvmaster *m = h;
+	char *p;
+
+	if (!m)
+		return mFullErr;
+	if (!(p = realloc(m->ptr, size ? size : 1)))
+		return mFullErr;
+	if (clear && (size > m->size))
+		memset(p + m->size, 0, size - m->size);
+	m->ptr = p;
+	m->size = size;
+	return mgNoErr;
+}
+
+UHandle DSNewHandle(size_t size)
+{
+	return lvstub_new(size, 0);
+}
+
+UHandle DSNewHClr(size_t size)
+{
+	return lvstub_new(size, 1);
+}
+
+MgErr DSSetHandleSize(void *h, size_t size)
+{
+	return lvstub_resize(h, size, 0);
+}
+
+MgErr DSSetHSzClr(void *h, size_t size)
+{
+	return lvstub_resize(h, size, 1);
+}
+
+int32 DSGetHandleSize(void *h)
+{
+	return h ? (int32)((lvmaster*)h)->size : 0;
+}
+
+MgErr DSDisposeHandle(void *h)
+{
+	lvmaster *m = h;
+
+	if (m) {
+		free(m->ptr);
+		free(m);
+	}
+	return mgNoErr;
+}
+
+MgErr NumericArrayResize(int32 typeCode, int32 numDims, UHandle *dataHP,
+			 size_t totalNewSize)
+{
+	static const size_t esize[] = { 0, 1, 2, 4, 8, 1, 2, 4, 8, 4, 8, 16, 8, 16, 32 };
+	size_t size;
+
+	if ((typeCode < iB) || (typeCode > cX) || (numDims < 1))
+		return mFullErr;
+	/* room for the dimensions, then the elements on an 8-byte boundary */
+	size = ((numDims * sizeof(int32) + 7) & ~(size_t)7)
+		+ totalNewSize * esize[typeCode];
+	if (!*dataHP) {
+		*dataHP = lvstub_new(size, 0);
+		return *dataHP ? mgNoErr : mFullErr;
+	}
+	return lvstub_resize(*dataHP, size, 0);
+}
+
+void MoveBlock(const void *src, void *dst, size_t len)
+{
+	memmove(dst, src, len);
+}
+
+MgErr PostLVUserEvent(LVUserEventRef ref, void *data)
+{
+	/* LabVIEW copies the data, so the hook must not keep it */
+	if (lvstub_post_hook)
+		lvstub_post_hook(ref, data);
+	return mgNoErr;
+}
@@ -0,0 +1,66 @@
+/*
+----------------------------------------------------------------------
+BSWAP :: byte-order conversion fused with a copy
+Typed arrays go out in whichever byte order the LabVIEW side asked for
+(flattened LabVIEW data is big-endian), so the one copy between an
+array and a chunk swaps the elements as it goes. The loops are plain
+enough for the compiler to vectorize on every target, and tolerate
+unaligned buffers on either side.
+----------------------------------------------------------------------
+*/
+
+#include "bswap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define BSWAP16(x)	_byteswap_ushort(x)
+#define BSWAP32(x)	_byteswap_ulong(x)
+#define BSWAP64(x)	_byteswap_uint64(x)
+#else
+#define BSWAP16(x)	__builtin_bswap16(x)
+#define BSWAP32(x)	__builtin_bswap32(x)
+#define BSWAP64(x)	__builtin_bswap64(x)
+#endif
+
+int bswap_bigendian(void)
+{
+	const uint16_t one = 1;
+	return *(const uint8_t*)&one == 0;
+}
+
+/* memcpy in and out is how to say "unaligned" in a way every compiler folds */
+#define BSWAP_LOOP(bits)						\
+static void bswap_copy##bits(char *d, const char *s, size_t n)		\
+{									\
+	size_t i;							\
+	uint##bits##_t v;						\
+	for (i = 0; i < n; ++i) {					\
+		memcpy(&v, s + i * sizeof(v), sizeof(v));		\
+		v = BSWAP##bits(v);					\
+		memcpy(d + i * sizeof(v), &v, sizeof(v));		\
+	}								\
+}
+BSWAP_LOOP(16)
+BSWAP_LOOP(32)
+BSWAP_LOOP(64)
+
+/* copy n elements of size bytes, reversing the byte order of each */
+void bswap_copy(void *dst, const void *src, size_t n, int size)
+{
+	switch (size) {
+	case 2:
+		bswap_copy16(dst, src, n);
+		break;
+	case 4:
+		bswap_copy32(dst, src, n);
+		break;
+	case 8:
+		bswap_copy64(dst, src, n);
+		break;
+	default:
+		memcpy(dst, src, n * size);	/* bytes have no order */
+		break;
+	}
+}
@@ -0,0 +1,25 @@
+/*
+----------------------------------------------------------------------
+BSWAP :: byte-order conversion fused with a copy
+Typed arrays go out in whichever byte order the LabVIEW side asked for
+(flattened LabVIEW data is big-endian), so the one copy between an
+array and a chunk swaps the elements as it goes. The loops are plain
+enough for the compiler to vectorize on every target, and tolerate
+unaligned buffers on either side.
+----------------------------------------------------------------------
+*/
+
+#ifndef BSWAP__H
+#define BSWAP__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int bswap_bigendian(void);
+void bswap_copy(void *dst, const void *src, size_t n, int size);
+
+#ifdef BSWAP_INLINE
+#include "bswap.c"
+#endif
+
+#endif
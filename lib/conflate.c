@@ -0,0 +1,116 @@
+/*
+----------------------------------------------------------------------
+CONFLATE :: latest-value staging map, per topic
+Messages are keyed by a fixed-length prefix (the topic) and only the
+newest one per topic is kept until it is taken out to be sent; a new
+message for a topic whose previous one is still waiting replaces it.
+Topics are taken out round-robin, so a flush that has to stop early
+does not always starve the same ones. The map only holds the message
+pointers; whoever puts or takes them owns them.
+----------------------------------------------------------------------
+*/
+
+#include "conflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* the slot for the topic msg starts with, created if missing */
+static conflate_slot* conflate_find(conflate_map *m, const uint8_t *msg)
+{
+	int i;
+	conflate_slot *s;
+
+	/* producers tend to cycle through few topics, so try the last one */
+	if ((m->hint < m->n) && !memcmp(m->slots[m->hint].topic, msg, m->topiclen))
+		return &m->slots[m->hint];
+	for (i = 0; i < m->n; ++i) {
+		if (!memcmp(m->slots[i].topic, msg, m->topiclen)) {
+			m->hint = i;
+			return &m->slots[i];
+		}
+	}
+	if (m->n >= m->nalloc) {
+		s = realloc(m->slots, (m->nalloc + 16) * sizeof(conflate_slot));
+		if (!s)
+			return NULL;
+		m->slots = s;
+		m->nalloc += 16;
+	}
+	s = &m->slots[m->n];
+	memset(s, 0, sizeof(conflate_slot));
+	if (!(s->topic = malloc(m->topiclen ? m->topiclen : 1)))
+		return NULL;
+	memcpy(s->topic, msg, m->topiclen);
+	m->hint = m->n++;
+	return s;
+}
+
+conflate_map* conflate_init(int topiclen)
+{
+	conflate_map *m;
+
+	if (topiclen < 0)
+		return NULL;
+	m = calloc(sizeof(conflate_map), 1);
+	if (!m)
+		return NULL;
+	m->topiclen = topiclen;
+	return m;
+}
+
+/* messages still waiting must have been taken out first */
+void conflate_free(conflate_map *m)
+{
+	if (!m)
+		return;
+	while (m->n > 0)
+		free(m->slots[--m->n].topic);
+	free(m->slots);
+	free(m);
+}
+
+/*
+ * stage msg as the latest of its topic; returns 1 and hands back in
+ * old the message it replaced, 0 if nothing was waiting, or -1 if msg
+ * is shorter than a topic or the map cannot grow (msg is not kept)
+ */
+int conflate_put(conflate_map *m, void *msg, size_t len,
+		 void **old, size_t *oldlen)
+{
+	conflate_slot *s;
+
+	*old = NULL;
+	*oldlen = 0;
+	if ((len < (size_t)m->topiclen) || !(s = conflate_find(m, msg)))
+		return -1;
+	*old = s->msg;
+	*oldlen = s->len;
+	s->msg = msg;
+	s->len = len;
+	if (*old)
+		return 1;
+	++m->pending;
+	return 0;
+}
+
+/* take out the next waiting message; returns 0 if there is none */
+int conflate_take(conflate_map *m, void **msg, size_t *len)
+{
+	int i, j;
+
+	if (m->pending <= 0)
+		return 0;
+	for (i = 0; i < m->n; ++i) {
+		j = (m->next + i) % m->n;
+		if (m->slots[j].msg) {
+			*msg = m->slots[j].msg;
+			*len = m->slots[j].len;
+			m->slots[j].msg = NULL;
+			m->next = j + 1;
+			--m->pending;
+			return 1;
+		}
+	}
+	return 0;
+}
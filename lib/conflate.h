@@ -0,0 +1,44 @@
+/*
+----------------------------------------------------------------------
+CONFLATE :: latest-value staging map, per topic
+Messages are keyed by a fixed-length prefix (the topic) and only the
+newest one per topic is kept until it is taken out to be sent; a new
+message for a topic whose previous one is still waiting replaces it.
+Topics are taken out round-robin, so a flush that has to stop early
+does not always starve the same ones. The map only holds the message
+pointers; whoever puts or takes them owns them.
+----------------------------------------------------------------------
+*/
+
+#ifndef CONFLATE__H
+#define CONFLATE__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint8_t *topic;
+	void *msg;		/* waiting message, NULL if none */
+	size_t len;
+} conflate_slot;
+
+typedef struct {
+	int topiclen;
+	conflate_slot *slots;
+	int n, nalloc;
+	int hint;		/* the slot found last time */
+	int next;		/* where the next take starts looking */
+	int pending;		/* slots with a message waiting */
+} conflate_map;
+
+conflate_map* conflate_init(int topiclen);
+void conflate_free(conflate_map *m);
+int conflate_put(conflate_map *m, void *msg, size_t len,
+		 void **old, size_t *oldlen);
+int conflate_take(conflate_map *m, void **msg, size_t *len);
+
+#ifdef CONFLATE_INLINE
+#include "conflate.c"
+#endif
+
+#endif
@@ -1,6 +1,5 @@
 #include "debug.h"
 
-#ifdef DEBUG
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
 #ifndef WIN32_LEAN_AND_MEAN
@@ -10,20 +9,182 @@
 #endif
 
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdio.h>
 
+volatile int trace_level = TRACE_OFF;
+
+static tracebuf *tracebufs[TRACE_THREADS];
+static atomic_t ntracebufs = 0;
+static lock_t tracelock;		/* registration and dumping */
+#ifdef DEBUG
+static lock_t debuglock;		/* one DEBUGMSG line at a time */
+#endif
+static THREAD_LOCAL tracebuf *trace_mine = NULL;
+static THREAD_LOCAL int trace_full = 0;
+
+static const char *trace_names[TR_COUNT] = {
+	"msg", "socket", "close", "bind", "connect", "send", "recv",
+	"sendmsg", "recvmsg", "send_batch", "recv_batch", "poll", "rxloop"
+};
+
+void trace_init(void)
+{
+	lock_init(&tracelock);
+#ifdef DEBUG
+	lock_init(&debuglock);
+#endif
+}
+
+void trace_free(void)
+{
+	int i;
+
+	trace_level = TRACE_OFF;
+	for (i = 0; i < ntracebufs; ++i) {
+		free(tracebufs[i]);
+		tracebufs[i] = NULL;
+	}
+	ntracebufs = 0;
+	lock_destroy(&tracelock);
+}
+
+/* the calling thread's ring, made on its first event */
+static tracebuf* trace_thread(void)
+{
+	tracebuf *buf;
+
+	if (trace_mine || trace_full)
+		return trace_mine;
+	buf = calloc(sizeof(tracebuf), 1);
+	lock_enter(&tracelock);
+	if (buf && (ntracebufs < TRACE_THREADS)) {
+		buf->id = ntracebufs;
+		tracebufs[ntracebufs] = buf;
+		atomic_inc(&ntracebufs);
+		trace_mine = buf;
+	} else {
+		free(buf);
+		trace_full = 1;	/* don't try again */
+	}
+	lock_leave(&tracelock);
+	return trace_mine;
+}
+
+void trace_event(int call, int sock, int ret, uint32_t bytes, uintptr_t arg)
+{
+	tracebuf *buf;
+	traceevt *e;
+	uint32_t head;
+
+	if (!(buf = trace_thread()))
+		return;
+	head = (uint32_t)buf->head;
+	e = &buf->evts[head & (TRACE_EVENTS - 1)];
+	e->ts = clock_ns();
+	e->arg = arg;
+	e->sock = sock;
+	e->ret = ret;
+	e->bytes = bytes;
+	e->call = (uint16_t)call;
+	e->thread = (uint16_t)buf->id;
+	/* publish; the dumper never reads past head */
+	atomic_set(&buf->head, head + 1);
+}
+
+static int trace_sort(const void *p1, const void *p2)
+{
+	const traceevt *e1 = p1, *e2 = p2;
+	return (e1->ts > e2->ts) - (e1->ts < e2->ts);
+}
+
+/* copy out whatever a ring holds that was not dumped yet */
+static int trace_collect(tracebuf *buf, traceevt *out)
+{
+	uint32_t head, start, p, drop, n = 0;
+
+	head = (uint32_t)atomic_get(&buf->head);
+	start = buf->tail;
+	if (head - start > TRACE_EVENTS) {
+		buf->lost += head - start - TRACE_EVENTS;
+		start = head - TRACE_EVENTS;
+	}
+	for (p = start; p != head; ++p)
+		out[n++] = buf->evts[p & (TRACE_EVENTS - 1)];
+	/* slots the thread may have reused while we copied them are suspect */
+	p = (uint32_t)atomic_get(&buf->head) - TRACE_EVENTS + 1;
+	if ((int32_t)(p - start) > 0) {
+		drop = ((p - start) < n) ? (p - start) : n;
+		buf->lost += drop;
+		memmove(out, out + drop, (n - drop) * sizeof(traceevt));
+		n -= drop;
+	}
+	buf->tail = head;
+	return n;
+}
+
+/* append every pending event to path, oldest first; returns how many */
+int trace_dump(const char *path)
+{
+	int i, nbufs, n = 0, k;
+	uint32_t lost = 0;
+	traceevt *all;
+	FILE *fp;
+	const char *name;
+
+	lock_enter(&tracelock);
+	nbufs = ntracebufs;
+	all = malloc((size_t)nbufs * TRACE_EVENTS * sizeof(traceevt) + 1);
+	if (!all) {
+		lock_leave(&tracelock);
+		return -1;
+	}
+	for (i = 0; i < nbufs; ++i) {
+		n += trace_collect(tracebufs[i], all + n);
+		lost += tracebufs[i]->lost;
+		tracebufs[i]->lost = 0;
+	}
+	lock_leave(&tracelock);
+
+	qsort(all, n, sizeof(traceevt), trace_sort);
+	if (!(fp = fopen(path, "a"))) {
+		free(all);
+		return -1;
+	}
+	if (lost)
+		fprintf(fp, "# %u events lost\n", lost);
+	for (k = 0; k < n; ++k) {
+		name = (all[k].call < TR_COUNT) ? trace_names[all[k].call] : "?";
+		if (all[k].call == TR_MSG)
+			fprintf(fp, "%llu %u %s %s\n", (unsigned long long)all[k].ts,
+				all[k].thread, name, (const char*)all[k].arg);
+		else
+			fprintf(fp, "%llu %u %s sock=%d ret=%d bytes=%u\n",
+				(unsigned long long)all[k].ts, all[k].thread, name,
+				all[k].sock, all[k].ret, all[k].bytes);
+	}
+	fclose(fp);
+	free(all);
+	return n;
+}
+
+#ifdef DEBUG
 void DEBUGMSG(const char* fmt, ...)
 {
-	char buffer[256];
+	char buffer[1024];
 	static FILE *fp = NULL;
+
+	/* string literals live forever, so the trace can keep the pointer */
+	if (trace_level)
+		trace_event(TR_MSG, -1, 0, 0, (uintptr_t)fmt);
+	lock_enter(&debuglock);
 	if (fp == NULL) {
 #ifdef _WIN32
 		static int tried = 0;
-		if (tried)
-			return;
-		else {
-			// try to get the temp directory
+		if (!tried) {
+			/* try to get the temp directory */
 			char path[MAX_PATH];
 
 			DWORD ret = GetTempPath(MAX_PATH - 20, path);
@@ -33,6 +194,10 @@ void DEBUGMSG(const char* fmt, ...)
 			fp = fopen(path, "w");
 			tried = 1;
 		}
+		if (!fp) {
+			lock_leave(&debuglock);
+			return;
+		}
 #else
 		fp = stderr;
 #endif
@@ -40,18 +205,18 @@ void DEBUGMSG(const char* fmt, ...)
 
 	if (fmt && *fmt) {
 		va_list va; size_t len;
-		// prepend date and time information
+		/* prepend date and time information */
 		time_t t = time(NULL);
 
 		len = strftime(buffer, sizeof(buffer), "%x-%X ", localtime(&t));
-		// process the argument list
+		/* process the argument list */
 		va_start(va, fmt);
 		vsnprintf(buffer + len, sizeof(buffer) - len, fmt, va);
 		va_end(va);
 		fputs(buffer, fp);
-		// flush!
 	}
 	fputc('\n', fp);
 	fflush(fp);
+	lock_leave(&debuglock);
 }
 #endif
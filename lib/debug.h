@@ -1,6 +1,70 @@
 #ifndef DEBUG__H
 #define DEBUG__H
 
+#include "sync.h"
+
+/*
+ * TRACE
+ * compact binary events, one fixed-size record per call, written to a
+ * ring owned by the calling thread so that recording takes no lock and
+ * no formatting; trace_dump formats and sorts them afterwards. Always
+ * compiled in, and a single load and branch while switched off.
+ */
+#define TRACE_OFF	0
+#define TRACE_ERRORS	1	/* failed calls only */
+#define TRACE_ALL	2	/* every call */
+
+#define TRACE_EVENTS	4096	/* per thread, a power of two */
+#define TRACE_THREADS	64	/* threads beyond this are not traced */
+
+/* call ids */
+#define TR_MSG		0	/* a DEBUGMSG, arg is its format string */
+#define TR_SOCKET	1
+#define TR_CLOSE	2
+#define TR_BIND		3
+#define TR_CONNECT	4
+#define TR_SEND		5
+#define TR_RECV		6
+#define TR_SENDMSG	7
+#define TR_RECVMSG	8
+#define TR_SEND_BATCH	9
+#define TR_RECV_BATCH	10
+#define TR_POLL		11
+#define TR_RXLOOP	12
+#define TR_COUNT	13
+
+typedef struct {
+	uint64_t ts;		/* clock_ns */
+	uintptr_t arg;
+	int32_t sock;
+	int32_t ret;
+	uint32_t bytes;
+	uint16_t call;
+	uint16_t thread;
+} traceevt;
+
+typedef struct {
+	traceevt evts[TRACE_EVENTS];
+	atomic_t head;		/* events ever written, owned by the thread */
+	uint32_t tail;		/* events already dumped, owned by the dumper */
+	uint32_t lost;		/* overwritten before they were dumped */
+	int id;
+} tracebuf;
+
+extern volatile int trace_level;
+
+#define TRACE(call, sock, ret, bytes)					\
+do {									\
+	if (trace_level && (((ret) < 0) || (trace_level >= TRACE_ALL)))\
+		trace_event(call, sock, ret, bytes, 0);			\
+} while (0)
+
+void trace_init(void);
+void trace_free(void);
+void trace_event(int call, int sock, int ret, uint32_t bytes, uintptr_t arg);
+int trace_dump(const char *path);
+
+/* free-text messages, only in DEBUG builds; they go to the trace as well */
 #ifdef DEBUG
 void DEBUGMSG(const char* fmt, ...);
 #else
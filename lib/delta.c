@@ -0,0 +1,290 @@
+/*
+----------------------------------------------------------------------
+DELTA :: keyframe + XOR encoding of repeated messages, per topic
+A publisher that sends nearly the same state every cycle can send a
+full keyframe now and then and, in between, only the XOR against the
+previous message of the same topic with its runs of zero bytes
+counted instead of sent. The topic (a fixed-length prefix) stays in
+front so subscriptions still match; a receiver that has lost track of
+a topic drops its deltas until the next keyframe.
+----------------------------------------------------------------------
+*/
+
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * a frame is the topic, then magic 0xC7 'D', the kind ('K' or 'X'), a
+ * zero byte, the topic's sequence number and the length of the message
+ * after the topic (both little-endian); a keyframe carries the message
+ * as it is, a delta a run of (zero count, literal count, literals)
+ * varints and bytes covering the XOR against the previous message
+ */
+#define DELTA_KEY	'K'
+#define DELTA_XOR	'X'
+
+static void delta_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t delta_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t* delta_putvar(uint8_t *op, size_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*op++ = (uint8_t)(v | 0x80);
+	*op++ = (uint8_t)v;
+	return op;
+}
+
+static const uint8_t* delta_getvar(const uint8_t *ip, const uint8_t *iend, size_t *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0; (ip < iend) && (shift < 35); shift += 7) {
+		*v |= (size_t)(*ip & 0x7F) << shift;
+		if (!(*ip++ & 0x80))
+			return ip;
+	}
+	return NULL;	/* truncated or absurd */
+}
+
+/* the stream for the topic msg starts with, created if create is set */
+static delta_stream* delta_find(delta_table *t, const uint8_t *msg, int create)
+{
+	int i;
+	delta_stream *s;
+
+	/* publishers tend to cycle through few topics, so try the last one */
+	if ((t->hint < t->n) && !memcmp(t->streams[t->hint].last, msg, t->topiclen))
+		return &t->streams[t->hint];
+	for (i = 0; i < t->n; ++i) {
+		if (!memcmp(t->streams[i].last, msg, t->topiclen)) {
+			t->hint = i;
+			return &t->streams[i];
+		}
+	}
+	if (!create)
+		return NULL;
+	if (t->n >= t->nalloc) {
+		s = realloc(t->streams, (t->nalloc + 16) * sizeof(delta_stream));
+		if (!s)
+			return NULL;
+		t->streams = s;
+		t->nalloc += 16;
+	}
+	s = &t->streams[t->n];
+	memset(s, 0, sizeof(delta_stream));
+	if (!(s->last = malloc(t->topiclen ? t->topiclen : 1)))
+		return NULL;
+	memcpy(s->last, msg, t->topiclen);
+	s->len = s->cap = t->topiclen;
+	t->hint = t->n++;
+	return s;
+}
+
+/* remember msg as the base for the next frame of its stream */
+static int delta_keep(delta_stream *s, const uint8_t *msg, size_t len)
+{
+	uint8_t *p;
+
+	if (len > s->cap) {
+		if (!(p = realloc(s->last, len)))
+			return -1;
+		s->last = p;
+		s->cap = len;
+	}
+	memcpy(s->last, msg, len);
+	s->len = len;
+	return 0;
+}
+
+delta_table* delta_init(int topiclen, int keyevery)
+{
+	delta_table *t;
+
+	if ((topiclen < 0) || (keyevery <= 0))
+		return NULL;
+	t = calloc(sizeof(delta_table), 1);
+	if (!t)
+		return NULL;
+	t->topiclen = topiclen;
+	t->keyevery = keyevery;
+	return t;
+}
+
+void delta_free(delta_table *t)
+{
+	if (!t)
+		return;
+	while (t->n > 0)
+		free(t->streams[--t->n].last);
+	free(t->streams);
+	free(t);
+}
+
+size_t delta_bound(const delta_table *t, size_t len)
+{
+	/* a keyframe; deltas are only sent when they are smaller */
+	return len + DELTA_HDRSIZE;
+}
+
+/*
+ * encode msg into out, which must hold delta_bound bytes; returns the
+ * frame size, or -1 if msg should go out as it is (too short to carry
+ * a topic, or out of memory)
+ */
+int delta_encode(delta_table *t, const void *msg, size_t len,
+		 void *out, size_t cap, int *keyframe)
+{
+	const uint8_t *cur = msg, *prev;
+	uint8_t *op = out, *hdr, *oend;
+	size_t i, j, n, body = len - t->topiclen;
+	uint64_t a, b;
+	delta_stream *s;
+
+	*keyframe = 0;
+	if ((len < (size_t)t->topiclen) || (body > UINT32_MAX)
+	    || (cap < delta_bound(t, len)))
+		return -1;
+	if (!(s = delta_find(t, cur, 1)))
+		return -1;
+	memcpy(op, cur, t->topiclen);
+	hdr = op + t->topiclen;
+	op = hdr + DELTA_HDRSIZE;
+	oend = op + body;	/* a delta has to beat the keyframe */
+
+	if (s->valid && (s->sincekey + 1 < t->keyevery) && (s->len == len)) {
+		prev = s->last;
+		for (i = t->topiclen; (i < len) && op; ) {
+			/* equal bytes, eight at a time while we can */
+			for (j = i; (j + 8 <= len)
+			     && (memcpy(&a, cur + j, 8), memcpy(&b, prev + j, 8), a == b); j += 8)
+				;
+			while ((j < len) && (cur[j] == prev[j]))
+				++j;
+			n = j - i;
+			/* then differing bytes, up to two equal ones in a row */
+			for (i = j; (j < len) && ((cur[j] != prev[j])
+			     || ((j + 1 < len) && (cur[j + 1] != prev[j + 1]))); ++j)
+				;
+			if (oend - op < 20 + (ptrdiff_t)(j - i)) {
+				op = NULL;
+				break;
+			}
+			op = delta_putvar(op, n);
+			op = delta_putvar(op, j - i);
+			for (; i < j; ++i)
+				*op++ = cur[i] ^ prev[i];
+		}
+		if (op) {
+			hdr[2] = DELTA_XOR;
+			++s->sincekey;
+		}
+	} else
+		op = NULL;
+
+	if (!op) {
+		/* first of its topic, due, resized or not worth a delta */
+		op = hdr + DELTA_HDRSIZE;
+		memcpy(op, cur + t->topiclen, body);
+		op += body;
+		hdr[2] = DELTA_KEY;
+		s->sincekey = 0;
+		*keyframe = 1;
+	}
+	hdr[0] = 0xC7;
+	hdr[1] = 'D';
+	hdr[3] = 0;
+	delta_put32(hdr + 4, ++s->seq);
+	delta_put32(hdr + 8, (uint32_t)body);
+	s->valid = (delta_keep(s, cur, len) == 0);
+	return (int)(op - (uint8_t*)out);
+}
+
+/*
+ * the size frame decodes to, DELTA_SKIP for a delta whose base we do
+ * not have, or DELTA_RAW if it is not a frame; a delta is held against
+ * its base here, so nothing gets allocated for one that cannot decode
+ */
+int delta_size(delta_table *t, const void *frame, size_t len)
+{
+	const uint8_t *hdr = (const uint8_t*)frame + t->topiclen;
+	uint32_t body;
+	delta_stream *s;
+
+	if ((len < t->topiclen + (size_t)DELTA_HDRSIZE) || (hdr[0] != 0xC7)
+	    || (hdr[1] != 'D') || ((hdr[2] != DELTA_KEY) && (hdr[2] != DELTA_XOR))
+	    || hdr[3])
+		return DELTA_RAW;
+	body = delta_get32(hdr + 8);
+	if (body > INT32_MAX - (uint32_t)t->topiclen)
+		return DELTA_RAW;
+	if ((hdr[2] == DELTA_KEY) && (len != t->topiclen + DELTA_HDRSIZE + body))
+		return DELTA_RAW;
+	if (hdr[2] == DELTA_XOR) {
+		/* a gap in the sequence means a missed frame: resync on a key */
+		s = delta_find(t, frame, 0);
+		if (!s || !s->valid || (s->seq + 1 != delta_get32(hdr + 4))
+		    || (s->len != t->topiclen + body)) {
+			if (s)
+				s->valid = 0;
+			return DELTA_SKIP;
+		}
+	}
+	return t->topiclen + body;
+}
+
+/*
+ * rebuild the message of frame into out, of delta_size bytes; returns
+ * its size, DELTA_SKIP for a delta whose base we do not have, or
+ * DELTA_RAW if the frame does not decode
+ */
+int delta_decode(delta_table *t, const void *frame, size_t len,
+		 void *out, size_t size)
+{
+	const uint8_t *in = frame, *hdr = in + t->topiclen;
+	const uint8_t *ip = hdr + DELTA_HDRSIZE, *iend = in + len;
+	uint8_t *op = out;
+	uint32_t seq = delta_get32(hdr + 4);
+	size_t pos, zeros, nlit;
+	int n;
+	delta_stream *s;
+
+	if ((n = delta_size(t, frame, len)) < 0)
+		return n;
+	if (n != (int)size)
+		return DELTA_RAW;
+	s = delta_find(t, in, hdr[2] == DELTA_KEY);
+	if (hdr[2] == DELTA_KEY) {
+		memcpy(op, in, t->topiclen);
+		memcpy(op + t->topiclen, ip, size - t->topiclen);
+	} else {
+		/* delta_size found the base, in step and of this size */
+		memcpy(op, s->last, size);
+		for (pos = t->topiclen; ip < iend; ) {
+			if (!(ip = delta_getvar(ip, iend, &zeros))
+			    || !(ip = delta_getvar(ip, iend, &nlit))
+			    || (zeros > size - pos) || (nlit > size - pos - zeros)
+			    || (nlit > (size_t)(iend - ip)))
+				return DELTA_RAW;
+			for (pos += zeros; nlit; --nlit)
+				op[pos++] ^= *ip++;
+		}
+	}
+	if (s) {
+		s->seq = seq;
+		s->valid = (delta_keep(s, op, size) == 0);
+	}
+	return (int)size;
+}
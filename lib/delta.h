@@ -0,0 +1,52 @@
+/*
+----------------------------------------------------------------------
+DELTA :: keyframe + XOR encoding of repeated messages, per topic
+A publisher that sends nearly the same state every cycle can send a
+full keyframe now and then and, in between, only the XOR against the
+previous message of the same topic with its runs of zero bytes
+counted instead of sent. The topic (a fixed-length prefix) stays in
+front so subscriptions still match; a receiver that has lost track of
+a topic drops its deltas until the next keyframe.
+----------------------------------------------------------------------
+*/
+
+#ifndef DELTA__H
+#define DELTA__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_HDRSIZE	12	/* after the topic */
+#define DELTA_SKIP	(-2)	/* a delta without its base; drop it */
+#define DELTA_RAW	(-1)	/* not a delta frame; pass it on as it is */
+
+typedef struct {
+	uint8_t *last;		/* previous message, topic included */
+	size_t len, cap;
+	uint32_t seq;
+	int sincekey;		/* frames since the last keyframe */
+	int valid;		/* receiver: last is a usable base */
+} delta_stream;
+
+typedef struct {
+	int topiclen;
+	int keyevery;		/* sender: a keyframe at least this often */
+	delta_stream *streams;
+	int n, nalloc;
+	int hint;		/* the stream found last time */
+} delta_table;
+
+delta_table* delta_init(int topiclen, int keyevery);
+void delta_free(delta_table *t);
+size_t delta_bound(const delta_table *t, size_t len);
+int delta_encode(delta_table *t, const void *msg, size_t len,
+		 void *out, size_t cap, int *keyframe);
+int delta_size(delta_table *t, const void *frame, size_t len);
+int delta_decode(delta_table *t, const void *frame, size_t len,
+		 void *out, size_t size);
+
+#ifdef DELTA_INLINE
+#include "delta.c"
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+/*
+----------------------------------------------------------------------
+HISTO :: log2-bucketed duration histogram
+Bucket b counts durations of [2^b, 2^(b+1)) nanoseconds, with the
+first bucket also taking zero and the last everything beyond it.
+Adding a sample is a handful of shifts and relaxed atomic adds, so
+several threads can record into one histogram without a lock.
+----------------------------------------------------------------------
+*/
+
+#include "histo.h"
+
+#include <string.h>
+
+int histo_bucket(uint64_t ns)
+{
+	int b = 0;
+
+	/* floor(log2(ns)) by halving the width each step */
+	if (ns >> 32) { ns >>= 32; b += 32; }
+	if (ns >> 16) { ns >>= 16; b += 16; }
+	if (ns >> 8) { ns >>= 8; b += 8; }
+	if (ns >> 4) { ns >>= 4; b += 4; }
+	if (ns >> 2) { ns >>= 2; b += 2; }
+	if (ns >> 1) b += 1;
+	return (b < HISTO_BUCKETS) ? b : HISTO_BUCKETS - 1;
+}
+
+void histo_add(histo *h, uint64_t ns)
+{
+	atomic_add64(&h->count[histo_bucket(ns)], 1);
+	atomic_add64(&h->n, 1);
+	atomic_add64(&h->sum, ns);
+	/* a racing larger sample may be lost; it is only a watermark */
+	if (ns > h->max)
+		h->max = ns;
+}
+
+void histo_reset(histo *h)
+{
+	memset((void*)h, 0, sizeof(histo));
+}
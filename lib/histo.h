@@ -0,0 +1,31 @@
+/*
+----------------------------------------------------------------------
+HISTO :: log2-bucketed duration histogram
+Bucket b counts durations of [2^b, 2^(b+1)) nanoseconds, with the
+first bucket also taking zero and the last everything beyond it.
+Adding a sample is a handful of shifts and relaxed atomic adds, so
+several threads can record into one histogram without a lock.
+----------------------------------------------------------------------
+*/
+
+#ifndef HISTO__H
+#define HISTO__H
+
+#include "sync.h"
+
+#define HISTO_BUCKETS	40	/* up to 2^40 ns, about 18 minutes */
+
+typedef struct {
+	volatile uint64_t count[HISTO_BUCKETS];
+	volatile uint64_t n, sum, max;	/* samples, total and worst in ns */
+} histo;
+
+int histo_bucket(uint64_t ns);
+void histo_add(histo *h, uint64_t ns);
+void histo_reset(histo *h);
+
+#ifdef HISTO_INLINE
+#include "histo.c"
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+/*
+----------------------------------------------------------------------
+HPOOL :: a reserve of recycled LabVIEW handles
+String handles given to LabVIEW by the multi-part receives can be
+handed back once their contents have been used, and are then kept
+here instead of being disposed; the next receive takes the pooled
+handle closest to the size it needs, so a steady stream of messages
+stops going through the LabVIEW memory manager at all.
+----------------------------------------------------------------------
+*/
+
+#include "hpool.h"
+
+#include <stdlib.h>
+
+hpool* hpool_init(int nmax)
+{
+	hpool *pool;
+
+	if (nmax <= 0)
+		return NULL;
+	pool = calloc(sizeof(hpool), 1);
+	if (!pool)
+		return NULL;
+	pool->slots = calloc(sizeof(hpool_slot), nmax);
+	if (!pool->slots) {
+		free(pool);
+		return NULL;
+	}
+	pool->nmax = nmax;
+	return pool;
+}
+
+void hpool_free(hpool *pool)
+{
+	if (!pool)
+		return;
+	while (pool->n > 0)
+		DSDisposeHandle(pool->slots[--pool->n].h);
+	free(pool->slots);
+	free(pool);
+}
+
+UHandle hpool_get(hpool *pool, size_t size)
+{
+	int i, best = -1;
+	UHandle h;
+
+	/* smallest handle that is already big enough, else the biggest one */
+	for (i = 0; i < pool->n; ++i) {
+		if (best < 0)
+			best = i;
+		else if (pool->slots[best].size < size)
+			best = (pool->slots[i].size > pool->slots[best].size) ? i : best;
+		else if ((pool->slots[i].size >= size)
+			 && (pool->slots[i].size < pool->slots[best].size))
+			best = i;
+	}
+	if (best < 0)
+		return NULL;	/* empty; caller should fall back to DSNewHandle */
+	h = pool->slots[best].h;
+	pool->slots[best] = pool->slots[--pool->n];
+	if (DSSetHandleSize(h, size) != mgNoErr) {
+		DSDisposeHandle(h);
+		return NULL;
+	}
+	return h;
+}
+
+int hpool_put(hpool *pool, UHandle h)
+{
+	if (!h)
+		return -1;
+	if (!pool || (pool->n >= pool->nmax)) {
+		DSDisposeHandle(h);
+		return -1;
+	}
+	pool->slots[pool->n].h = h;
+	pool->slots[pool->n].size = DSGetHandleSize(h);
+	++pool->n;
+	return 0;
+}
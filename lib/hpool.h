@@ -0,0 +1,37 @@
+/*
+----------------------------------------------------------------------
+HPOOL :: a reserve of recycled LabVIEW handles
+String handles given to LabVIEW by the multi-part receives can be
+handed back once their contents have been used, and are then kept
+here instead of being disposed; the next receive takes the pooled
+handle closest to the size it needs, so a steady stream of messages
+stops going through the LabVIEW memory manager at all.
+----------------------------------------------------------------------
+*/
+
+#ifndef HPOOL__H
+#define HPOOL__H
+
+#include <stddef.h>
+#include <extcode.h>
+
+typedef struct {
+	UHandle h;
+	size_t size;	/* size of the handle when it was put back */
+} hpool_slot;
+
+typedef struct {
+	hpool_slot *slots;
+	int n, nmax;	/* handles on hand, and how many to keep */
+} hpool;
+
+hpool* hpool_init(int nmax);
+void hpool_free(hpool *pool);
+UHandle hpool_get(hpool *pool, size_t size);
+int hpool_put(hpool *pool, UHandle h);
+
+#ifdef HPOOL_INLINE
+#include "hpool.c"
+#endif
+
+#endif
@@ -0,0 +1,295 @@
+/*
+----------------------------------------------------------------------
+LVC :: last-value cache, per topic
+A publisher keeps a copy of the latest message of every topic (a
+fixed-length prefix) in a small open-addressed hash table and can hand
+out the whole table, or the topics under a prefix, as one snapshot.
+If its subscribers all opted in, it also stamps each message it sends
+with a per-topic sequence number right after the topic, and says so in
+its snapshots; a subscriber that starts from a snapshot saying so keeps
+the same table of sequence numbers only, and uses it to drop the live
+messages the snapshot already gave it.
+----------------------------------------------------------------------
+*/
+
+#include "lvc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * a stamp is magic 0xC7 'V' 'S', a zero byte and the topic's sequence
+ * number (little-endian); a snapshot is magic 0xC7 'V' 'N', a flags
+ * byte (LVC_SNAP_STAMPED) and the number of entries, then per entry its
+ * sequence number and length and the message itself, topic included
+ */
+static void lvc_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t lvc_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* FNV-1a */
+static uint32_t lvc_hash(const uint8_t *topic, int len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ *topic++) * 16777619u;
+	return h;
+}
+
+static int lvc_reindex(lvc_table *t, int nindex)
+{
+	int i, j, *index;
+
+	if (!(index = malloc(nindex * sizeof(int))))
+		return -1;
+	memset(index, 0xFF, nindex * sizeof(int));
+	for (i = 0; i < t->n; ++i) {
+		j = lvc_hash(t->entries[i].msg, t->topiclen) & (nindex - 1);
+		while (index[j] >= 0)
+			j = (j + 1) & (nindex - 1);
+		index[j] = i;
+	}
+	free(t->index);
+	t->index = index;
+	t->nindex = nindex;
+	return 0;
+}
+
+/* the entry for the topic msg starts with, created if create is set */
+static lvc_entry* lvc_find(lvc_table *t, const uint8_t *msg, int create)
+{
+	int j;
+	lvc_entry *e;
+
+	j = lvc_hash(msg, t->topiclen) & (t->nindex - 1);
+	for (; t->index[j] >= 0; j = (j + 1) & (t->nindex - 1)) {
+		e = &t->entries[t->index[j]];
+		if (!memcmp(e->msg, msg, t->topiclen))
+			return e;
+	}
+	if (!create)
+		return NULL;
+	if (t->n >= t->nalloc) {
+		e = realloc(t->entries, (t->nalloc + 16) * sizeof(lvc_entry));
+		if (!e)
+			return NULL;
+		t->entries = e;
+		t->nalloc += 16;
+	}
+	e = &t->entries[t->n];
+	memset(e, 0, sizeof(lvc_entry));
+	if (!(e->msg = malloc(t->topiclen ? t->topiclen : 1)))
+		return NULL;
+	memcpy(e->msg, msg, t->topiclen);
+	e->len = e->cap = t->topiclen;
+	t->index[j] = t->n++;
+	/* keep the table at most half full so probes stay short */
+	if ((2 * t->n >= t->nindex) && (lvc_reindex(t, 2 * t->nindex) < 0)) {
+		free(e->msg);
+		t->index[j] = -1;
+		--t->n;
+		return NULL;
+	}
+	return &t->entries[t->n - 1];
+}
+
+lvc_table* lvc_init(int topiclen)
+{
+	lvc_table *t;
+
+	if (topiclen < 0)
+		return NULL;
+	t = calloc(sizeof(lvc_table), 1);
+	if (!t)
+		return NULL;
+	t->topiclen = topiclen;
+	if (lvc_reindex(t, 16) < 0) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void lvc_free(lvc_table *t)
+{
+	if (!t)
+		return;
+	while (t->n > 0)
+		free(t->entries[--t->n].msg);
+	free(t->entries);
+	free(t->index);
+	free(t);
+}
+
+/*
+ * publisher: keep msg as the latest of its topic and give it the next
+ * sequence number; returns -1 if msg is shorter than a topic or cannot
+ * be kept
+ */
+int lvc_store(lvc_table *t, const void *msg, size_t len, uint32_t *seq)
+{
+	uint8_t *p;
+	lvc_entry *e;
+
+	if ((len < (size_t)t->topiclen) || !(e = lvc_find(t, msg, 1)))
+		return -1;
+	if (len > e->cap) {
+		if (!(p = realloc(e->msg, len)))
+			return -1;
+		e->msg = p;
+		e->cap = len;
+	}
+	memcpy(e->msg, msg, len);
+	e->len = len;
+	/* 0 means nothing seen yet, so skip it on wrap-around */
+	if (++e->seq == 0)
+		e->seq = 1;
+	*seq = e->seq;
+	return 0;
+}
+
+/* write msg with its stamp into out, which holds len + LVC_STAMPSIZE */
+size_t lvc_stamp(const lvc_table *t, const void *msg, size_t len,
+		 uint32_t seq, void *out)
+{
+	uint8_t *op = out;
+
+	memcpy(op, msg, t->topiclen);
+	op += t->topiclen;
+	op[0] = 0xC7;
+	op[1] = 'V';
+	op[2] = 'S';
+	op[3] = 0;
+	lvc_put32(op + 4, seq);
+	memcpy(op + LVC_STAMPSIZE, (const uint8_t*)msg + t->topiclen,
+	       len - t->topiclen);
+	return len + LVC_STAMPSIZE;
+}
+
+/*
+ * subscriber: note that seq of the topic msg starts with was seen;
+ * returns 0 if it is no newer than one seen before
+ */
+int lvc_seen(lvc_table *t, const void *msg, size_t len, uint32_t seq)
+{
+	lvc_entry *e;
+
+	if ((len < (size_t)t->topiclen) || !(e = lvc_find(t, msg, 1)))
+		return 1;	/* cannot tell, so let it through */
+	/* serial number arithmetic, so wrap-around is fine */
+	if (e->seq && ((int32_t)(seq - e->seq) <= 0))
+		return 0;
+	e->seq = seq;
+	return 1;
+}
+
+/*
+ * subscriber: strip the stamp off a live message in place; returns the
+ * new length, LVC_STALE if the message is no newer than one seen before
+ * or LVC_RAW if it carries no stamp
+ */
+int lvc_accept(lvc_table *t, void *msg, size_t len)
+{
+	uint8_t *p = (uint8_t*)msg + t->topiclen;
+
+	if ((len < (size_t)t->topiclen + LVC_STAMPSIZE) || (p[0] != 0xC7)
+	    || (p[1] != 'V') || (p[2] != 'S') || (p[3] != 0))
+		return LVC_RAW;
+	if (!lvc_seen(t, msg, len, lvc_get32(p + 4)))
+		return LVC_STALE;
+	len -= LVC_STAMPSIZE;
+	memmove(p, p + LVC_STAMPSIZE, len - t->topiclen);
+	return (int)len;
+}
+
+/* bytes needed for a snapshot of the topics starting with prefix */
+size_t lvc_snapshot_size(const lvc_table *t, const void *prefix, size_t plen)
+{
+	int i;
+	size_t size = LVC_SNAPHDRSIZE;
+	const lvc_entry *e;
+
+	for (i = 0; i < t->n; ++i) {
+		e = &t->entries[i];
+		if (e->seq && (e->len >= plen) && !memcmp(e->msg, prefix, plen))
+			size += 8 + e->len;
+	}
+	return size;
+}
+
+/* write that snapshot into out; returns its size */
+size_t lvc_snapshot(const lvc_table *t, const void *prefix, size_t plen,
+		    void *out)
+{
+	int i;
+	uint32_t n = 0;
+	uint8_t *op = out;
+	const lvc_entry *e;
+
+	op += LVC_SNAPHDRSIZE;
+	for (i = 0; i < t->n; ++i) {
+		e = &t->entries[i];
+		if (!e->seq || (e->len < plen) || memcmp(e->msg, prefix, plen))
+			continue;
+		lvc_put32(op, e->seq);
+		lvc_put32(op + 4, (uint32_t)e->len);
+		memcpy(op + 8, e->msg, e->len);
+		op += 8 + e->len;
+		++n;
+	}
+	op = out;
+	op[0] = 0xC7;
+	op[1] = 'V';
+	op[2] = 'N';
+	op[3] = t->stamped ? LVC_SNAP_STAMPED : 0;
+	lvc_put32(op + 4, n);
+	return lvc_snapshot_size(t, prefix, plen);
+}
+
+/*
+ * walk a received snapshot; *pos starts at 0, returns 1 per entry, 0
+ * at the end and -1 if the snapshot is malformed
+ */
+int lvc_snapshot_next(const void *snap, size_t len, size_t *pos,
+		      uint32_t *seq, const void **msg, size_t *mlen)
+{
+	const uint8_t *p = snap;
+	uint32_t n;
+
+	if (*pos == 0) {
+		if ((len < LVC_SNAPHDRSIZE) || (p[0] != 0xC7) || (p[1] != 'V')
+		    || (p[2] != 'N') || (p[3] & ~LVC_SNAP_STAMPED))
+			return -1;
+		*pos = LVC_SNAPHDRSIZE;
+	}
+	if (*pos == len)
+		return 0;
+	if (len - *pos < 8)
+		return -1;
+	n = lvc_get32(p + *pos + 4);
+	if (n > len - *pos - 8)
+		return -1;
+	*seq = lvc_get32(p + *pos);
+	*msg = p + *pos + 8;
+	*mlen = n;
+	*pos += 8 + n;
+	return 1;
+}
+
+/* whether the publisher of a well-formed snapshot stamps its live messages */
+int lvc_snapshot_stamped(const void *snap, size_t len)
+{
+	const uint8_t *p = snap;
+
+	return (len >= LVC_SNAPHDRSIZE) && (p[3] & LVC_SNAP_STAMPED);
+}
@@ -0,0 +1,60 @@
+/*
+----------------------------------------------------------------------
+LVC :: last-value cache, per topic
+A publisher keeps a copy of the latest message of every topic (a
+fixed-length prefix) in a small open-addressed hash table and can hand
+out the whole table, or the topics under a prefix, as one snapshot.
+If its subscribers all opted in, it also stamps each message it sends
+with a per-topic sequence number right after the topic, and says so in
+its snapshots; a subscriber that starts from a snapshot saying so keeps
+the same table of sequence numbers only, and uses it to drop the live
+messages the snapshot already gave it.
+----------------------------------------------------------------------
+*/
+
+#ifndef LVC__H
+#define LVC__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LVC_STAMPSIZE	8	/* after the topic */
+#define LVC_SNAPHDRSIZE	8
+#define LVC_STALE	(-2)	/* no newer than what was seen; drop it */
+#define LVC_RAW		(-1)	/* not stamped; pass it on as it is */
+#define LVC_SNAP_STAMPED	0x01	/* snapshot flag: the live messages are stamped */
+
+typedef struct {
+	uint8_t *msg;		/* latest message, topic included */
+	size_t len, cap;
+	uint32_t seq;		/* of that message, 0 before the first */
+} lvc_entry;
+
+typedef struct {
+	int topiclen;
+	int stamped;		/* publisher: live messages carry stamps */
+	lvc_entry *entries;
+	int n, nalloc;
+	int *index;		/* hash of topic -> entry, -1 if free */
+	int nindex;		/* a power of two, more than twice n */
+} lvc_table;
+
+lvc_table* lvc_init(int topiclen);
+void lvc_free(lvc_table *t);
+int lvc_store(lvc_table *t, const void *msg, size_t len, uint32_t *seq);
+size_t lvc_stamp(const lvc_table *t, const void *msg, size_t len,
+		 uint32_t seq, void *out);
+int lvc_accept(lvc_table *t, void *msg, size_t len);
+int lvc_seen(lvc_table *t, const void *msg, size_t len, uint32_t seq);
+size_t lvc_snapshot_size(const lvc_table *t, const void *prefix, size_t plen);
+size_t lvc_snapshot(const lvc_table *t, const void *prefix, size_t plen,
+		    void *out);
+int lvc_snapshot_next(const void *snap, size_t len, size_t *pos,
+		      uint32_t *seq, const void **msg, size_t *mlen);
+int lvc_snapshot_stamped(const void *snap, size_t len);
+
+#ifdef LVC_INLINE
+#include "lvc.c"
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+/*
+----------------------------------------------------------------------
+LZC :: a small LZ77 block codec of the LZ4 family
+Compresses one buffer at a time into sequences of literals and
+back-references within 64 KiB, found through a 4096-entry hash of the
+next four bytes; no entropy stage, so both directions run at memory
+speed on small targets. The decoder checks every length and offset
+against its buffers, so a corrupt or foreign block is rejected rather
+than overrunning anything.
+----------------------------------------------------------------------
+*/
+
+#include "lzc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZC_HASH_BITS	12
+#define LZC_MINMATCH	4
+#define LZC_MAXOFFSET	65535
+#define LZC_TAIL	12	/* no match starts this close to the end */
+#define LZC_SKIP	6	/* widen the search step after 2^n misses */
+
+/*
+ * a block is a run of sequences, each a token (literal count in the high
+ * nibble, match length - 4 in the low one, 15 meaning more follow in
+ * bytes up to 255), the literals, then a 16-bit little-endian offset;
+ * the last sequence has literals only
+ */
+
+static uint32_t lzc_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint32_t lzc_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZC_HASH_BITS);
+}
+
+static uint8_t* lzc_putlen(uint8_t *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)n;
+	return op;
+}
+
+static uint8_t* lzc_literals(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t nlit, size_t nmatch)
+{
+	uint8_t *token;
+
+	/* worst case: token, literal length, literals, offset, match length */
+	if ((op >= oend)
+	    || ((size_t)(oend - op) < nlit + nlit / 255 + nmatch / 255 + 5))
+		return NULL;
+	token = op++;
+	*token = (uint8_t)(((nlit < 15) ? nlit : 15) << 4);
+	if (nlit >= 15)
+		op = lzc_putlen(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	return op + nlit;
+}
+
+size_t lzc_bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+/* returns the compressed size, or 0 if it would not fit in cap bytes */
+int lzc_compress(const void *src, int n, void *dst, int cap)
+{
+	uint32_t table[1 << LZC_HASH_BITS];
+	const uint8_t *base = src, *ip = base, *anchor = base;
+	const uint8_t *end = base + n, *ref, *mp;
+	uint8_t *op = dst, *oend = op + cap, *token;
+	uint32_t h, misses = 0;
+	size_t off, nmatch;
+
+	memset(table, 0, sizeof(table));
+	while ((n > LZC_TAIL) && (ip < end - LZC_TAIL)) {
+		h = lzc_hash(lzc_read32(ip));
+		ref = base + table[h];
+		table[h] = (uint32_t)(ip - base);
+		if ((ref >= ip) || (ip - ref > LZC_MAXOFFSET)
+		    || (lzc_read32(ref) != lzc_read32(ip))) {
+			ip += 1 + (misses++ >> LZC_SKIP);
+			continue;
+		}
+		misses = 0;
+		/* extend the match as far as it goes, short of the tail */
+		for (mp = ip + LZC_MINMATCH, ref += LZC_MINMATCH;
+		     (mp < end - 5) && (*mp == *ref); ++mp, ++ref)
+			;
+		nmatch = mp - ip - LZC_MINMATCH;
+		off = mp - ref;
+		token = op;
+		if (!(op = lzc_literals(op, oend, anchor, ip - anchor, nmatch)))
+			return 0;
+		*op++ = (uint8_t)off;
+		*op++ = (uint8_t)(off >> 8);
+		*token |= (uint8_t)((nmatch < 15) ? nmatch : 15);
+		if (nmatch >= 15)
+			op = lzc_putlen(op, nmatch - 15);
+		ip = anchor = mp;
+	}
+	if (!(op = lzc_literals(op, oend, anchor, end - anchor, 0)))
+		return 0;
+	return (int)(op - (uint8_t*)dst);
+}
+
+/* returns size, or -1 if the block is corrupt or does not decode to size bytes */
+int lzc_decompress(const void *src, int n, void *dst, int size)
+{
+	const uint8_t *ip = src, *iend = ip + n, *ref;
+	uint8_t *op = dst, *oend = op + size;
+	size_t nlit, nmatch, off;
+	uint8_t token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+		if ((nlit = token >> 4) == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				nlit += (b = *ip++);
+			} while (b == 255);
+		}
+		if ((nlit > (size_t)(iend - ip)) || (nlit > (size_t)(oend - op)))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == iend)
+			break;	/* the last sequence has no match */
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || (off > (size_t)(op - (uint8_t*)dst)))
+			return -1;
+		if ((nmatch = token & 15) == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				nmatch += (b = *ip++);
+			} while (b == 255);
+		}
+		nmatch += LZC_MINMATCH;
+		if (nmatch > (size_t)(oend - op))
+			return -1;
+		/* an overlapping match repeats the last off bytes; copy what
+		 * is already there, which doubles the period every time */
+		for (ref = op - off; nmatch > off; off *= 2) {
+			memcpy(op, ref, off);
+			op += off;
+			nmatch -= off;
+		}
+		memcpy(op, ref, nmatch);
+		op += nmatch;
+	}
+	return (op == oend) ? size : -1;
+}
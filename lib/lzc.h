@@ -0,0 +1,26 @@
+/*
+----------------------------------------------------------------------
+LZC :: a small LZ77 block codec of the LZ4 family
+Compresses one buffer at a time into sequences of literals and
+back-references within 64 KiB, found through a 4096-entry hash of the
+next four bytes; no entropy stage, so both directions run at memory
+speed on small targets. The decoder checks every length and offset
+against its buffers, so a corrupt or foreign block is rejected rather
+than overrunning anything.
+----------------------------------------------------------------------
+*/
+
+#ifndef LZC__H
+#define LZC__H
+
+#include <stddef.h>
+
+size_t lzc_bound(size_t n);
+int lzc_compress(const void *src, int n, void *dst, int cap);
+int lzc_decompress(const void *src, int n, void *dst, int size);
+
+#ifdef LZC_INLINE
+#include "lzc.c"
+#endif
+
+#endif
@@ -0,0 +1,132 @@
+/*
+----------------------------------------------------------------------
+MSGPOOL :: a reserve of pre-allocated nanomsg chunks
+Chunks are allocated ahead of time in a few size classes so the send
+path can take one instead of calling nn_allocmsg. A chunk handed to
+nn_send belongs to nanomsg afterwards, so only chunks that were never
+sent come back; the rest are replaced by msgpool_refill, which is
+meant to be called outside of time-critical loops.
+----------------------------------------------------------------------
+*/
+
+#include "msgpool.h"
+
+#include <stdlib.h>
+#include <nanomsg/nn.h>
+
+static int msgpool_class_sort(const void *p1, const void *p2)
+{
+	const msgpool_class *c1 = p1, *c2 = p2;
+	return (c1->size > c2->size) - (c1->size < c2->size);
+}
+
+msgpool* msgpool_init(const unsigned int *sizes, const unsigned int *counts, int n)
+{
+	msgpool *pool;
+	int i;
+
+	if ((n <= 0) || (n > MSGPOOL_MAX_CLASSES))
+		return NULL;
+	pool = calloc(sizeof(msgpool), 1);
+	if (!pool)
+		return NULL;
+	for (i = 0; i < n; ++i) {
+		pool->cls[i].size = sizes[i];
+		pool->cls[i].nmax = counts[i];
+	}
+	pool->nclasses = n;
+	/* keep classes in ascending size so the first fit is the best fit */
+	qsort(pool->cls, n, sizeof(msgpool_class), msgpool_class_sort);
+	for (i = 0; i < n; ++i) {
+		pool->cls[i].chunks = calloc(sizeof(void*), pool->cls[i].nmax + 1);
+		if (!pool->cls[i].chunks) {
+			msgpool_free(pool);
+			return NULL;
+		}
+	}
+	msgpool_refill(pool);
+	return pool;
+}
+
+void msgpool_free(msgpool *pool)
+{
+	int i;
+	msgpool_class *c;
+
+	if (!pool)
+		return;
+	for (i = 0; i < pool->nclasses; ++i) {
+		c = &pool->cls[i];
+		while (c->n > 0)
+			nn_freemsg(c->chunks[--c->n]);
+		free(c->chunks);
+	}
+	free(pool);
+}
+
+int msgpool_refill(msgpool *pool)
+{
+	int i, nalloc = 0;
+	msgpool_class *c;
+	void *chunk;
+
+	/* top every class up to its target; returns the number allocated */
+	for (i = 0; i < pool->nclasses; ++i) {
+		c = &pool->cls[i];
+		while (c->n < c->nmax) {
+			if (!(chunk = nn_allocmsg(c->size, 0)))
+				return nalloc;
+			c->chunks[c->n++] = chunk;
+			++nalloc;
+		}
+	}
+	return nalloc;
+}
+
+void* msgpool_get(msgpool *pool, size_t len)
+{
+	int i;
+	msgpool_class *c;
+	void *chunk, *trimmed;
+
+	/* smallest class that fits and still has chunks on hand */
+	for (i = 0; i < pool->nclasses; ++i) {
+		c = &pool->cls[i];
+		if ((c->size < len) || (c->n == 0))
+			continue;
+		chunk = c->chunks[--c->n];
+		if (len == c->size)
+			return chunk;
+		/* a chunk's size is the message size, so trim it (in place) */
+		if (!(trimmed = nn_reallocmsg(chunk, len)))
+			c->chunks[c->n++] = chunk;
+		return trimmed;
+	}
+	return NULL;	/* miss; caller should fall back to nn_allocmsg */
+}
+
+int msgpool_put(msgpool *pool, void *chunk, size_t len)
+{
+	int i;
+	msgpool_class *c;
+	void *trimmed;
+
+	/* largest class the chunk can still serve without growing */
+	for (i = pool->nclasses - 1; i >= 0; --i) {
+		c = &pool->cls[i];
+		if (c->size > len)
+			continue;
+		if (c->n >= c->nmax)
+			break;
+		/* pooled chunks are always exactly their class size */
+		if (len != c->size) {
+			if (!(trimmed = nn_reallocmsg(chunk, c->size)))
+				break;
+			chunk = trimmed;
+		}
+		c->chunks[c->n++] = chunk;
+		return 0;
+	}
+	nn_freemsg(chunk);
+	return -1;
+}
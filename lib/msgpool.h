@@ -0,0 +1,40 @@
+/*
+----------------------------------------------------------------------
+MSGPOOL :: a reserve of pre-allocated nanomsg chunks
+Chunks are allocated ahead of time in a few size classes so the send
+path can take one instead of calling nn_allocmsg. A chunk handed to
+nn_send belongs to nanomsg afterwards, so only chunks that were never
+sent come back; the rest are replaced by msgpool_refill, which is
+meant to be called outside of time-critical loops.
+----------------------------------------------------------------------
+*/
+
+#ifndef MSGPOOL__H
+#define MSGPOOL__H
+
+#include <stddef.h>
+
+#define MSGPOOL_MAX_CLASSES	8
+
+typedef struct {
+	size_t size;	/* capacity of every chunk in this class */
+	int n, nmax;	/* chunks on hand, and how many to keep */
+	void **chunks;
+} msgpool_class;
+
+typedef struct {
+	msgpool_class cls[MSGPOOL_MAX_CLASSES];
+	int nclasses;
+} msgpool;
+
+msgpool* msgpool_init(const unsigned int *sizes, const unsigned int *counts, int n);
+void msgpool_free(msgpool *pool);
+int msgpool_refill(msgpool *pool);
+void* msgpool_get(msgpool *pool, size_t len);
+int msgpool_put(msgpool *pool, void *chunk, size_t len);
+
+#ifdef MSGPOOL_INLINE
+#include "msgpool.c"
+#endif
+
+#endif
@@ -28,10 +28,45 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
 #include <nanomsg/nn.h>
+#include <nanomsg/pair.h>
+#include <nanomsg/reqrep.h>
 #include <extcode.h>
 
-#define USE_SOCKET_MUTEX	0
+#define SYNC_INLINE
+#include "sync.h"
+#define OBJTABLE_INLINE
+#include "objtable.h"
+#define MSGPOOL_INLINE
+#include "msgpool.h"
+#define RINGBUF_INLINE
+#include "ringbuf.h"
+#define HISTO_INLINE
+#include "histo.h"
+#define HPOOL_INLINE
+#include "hpool.h"
+#define BSWAP_INLINE
+#include "bswap.h"
+#define LZC_INLINE
+#include "lzc.h"
+#define DELTA_INLINE
+#include "delta.h"
+#define CONFLATE_INLINE
+#include "conflate.h"
+#define LVC_INLINE
+#include "lvc.h"
+
+
+/* persistent pollers use epoll over the sockets' descriptors where available */
+#ifdef __linux__
+#define POLLER_EPOLL		1
+#include <sys/epoll.h>
+#include <unistd.h>
+#else
+#define POLLER_EPOLL		0
+#endif
 #define ERROR_BASE		NN_HAUSNUMERO	/* base error number in LV */
 #define ECRIT			1097
 
@@ -82,124 +117,579 @@ void* LVALIGN( void *x )
 #define LVALIGN(x) (x)
 #endif
 
-#if USE_SOCKET_MUTEX
-#ifdef _WIN32
-typedef HANDLE mutex_t;
+typedef struct {
+	uint32_t tag;
+	uint32_t id;
+	int flags;
+	int ipv6;
+} ctx_t;
+
+typedef struct {
+	void *ctx;
+	bonzai *socks;
+	bonzai *inst;
+	int flags;
+	objref ref;
+} ctx_obj;
+
+/* wrapper-level statistics, read through lvnanomsg_get_statistic */
+#define LVSTAT_BASE		1000
+#define LVSTAT_RECV_COPIED	1000	/* bytes copied from chunks into LV */
+#define LVSTAT_RECV_LEASED	1001	/* bytes handed out as leases */
+#define LVSTAT_SEND_COPIED	1002	/* bytes copied from LV into chunks */
+#define LVSTAT_POOL_HITS	1003	/* sends served from the chunk pool */
+#define LVSTAT_POOL_MISSES	1004	/* sends that fell back to nn_allocmsg */
+#define LVSTAT_POOL_RECYCLED	1005	/* unsent chunks returned to the pool */
+#define LVSTAT_SEND_CONTENDED	1006	/* send-side lock found already taken */
+#define LVSTAT_RECV_CONTENDED	1007	/* recv-side lock found already taken */
+#define LVSTAT_HANDLES_REUSED	1008	/* receive handles taken from the handle pool */
+#define LVSTAT_HANDLES_NEW	1009	/* receive handles that had to be allocated */
+#define LVSTAT_HANDLES_RETURNED	1010	/* handles LabVIEW gave back to the pool */
+#define LVSTAT_ZIP_IN		1011	/* bytes offered to the compressor */
+#define LVSTAT_ZIP_OUT		1012	/* bytes actually sent for them */
+#define LVSTAT_ZIP_NS		1013	/* time spent compressing */
+#define LVSTAT_UNZIP_IN		1014	/* compressed bytes received */
+#define LVSTAT_UNZIP_OUT	1015	/* bytes they inflated to */
+#define LVSTAT_UNZIP_NS		1016	/* time spent inflating */
+#define LVSTAT_DELTA_IN		1017	/* bytes offered to the delta encoder */
+#define LVSTAT_DELTA_OUT	1018	/* bytes of the frames it produced */
+#define LVSTAT_DELTA_KEYFRAMES	1019	/* of those frames, keyframes */
+#define LVSTAT_DELTA_SKIPPED	1020	/* deltas dropped waiting for a keyframe */
+#define LVSTAT_CONFLATED	1021	/* staged sends replaced before they went out */
+#define LVSTAT_PACED		1022	/* staged sends the pacing thread sent */
+#define LVSTAT_PACE_FAILED	1023	/* staged sends nanomsg would not take */
+#define LVSTAT_LVC_SNAPSHOTS	1024	/* last-value snapshots served */
+#define LVSTAT_LVC_DUPLICATES	1025	/* live messages a snapshot already gave */
+#define LVSTAT_COUNT		26
+
+/* per-socket timing histograms, read through lvnanomsg_histogram_read */
+#define HIST_SEND		0	/* whole send calls */
+#define HIST_RECV		1	/* whole receive calls */
+#define HIST_BLOCKED		2	/* inside nanomsg calls that may block */
+#define HIST_LOCKWAIT		3	/* waiting for a contended side lock */
+#define HIST_COUNT		4
+
+/*
+ * nanomsg lets one thread send while another receives on the same socket,
+ * so the wrapper state is split the same way: sendlock guards the pool,
+ * recvlock the leases, handle pool and receive scratch; neither is held across a call
+ * that may block, and flags is only ever changed atomically
+ */
+typedef struct {
+	int sock;
+	ctx_obj *ctx;
+	atomic_t flags;
+	int eid;
+	lock_t sendlock;
+	lock_t recvlock;
+	objref ref;
+	bonzai *leases;		/* references of outstanding lease_obj's */
+	msgpool *pool;		/* pre-allocated send chunks, may be NULL */
+	hpool *hpool;		/* recycled receive handles, may be NULL */
+	atomic_t zipmin;	/* compress sends of this many bytes and up, 0 = off */
+	delta_table *dtx;	/* per-topic delta encoding, under sendlock */
+	delta_table *drx;	/* and decoding, under recvlock */
+	conflate_map *cfl;	/* latest unsent message per topic, under sendlock */
+	uint64_t cfldue_us;	/* next paced flush, under pacelock */
+	uint32_t cflperiod_us;
+	struct lvcsvc *lvc;	/* last-value cache, swapped under sendlock */
+	lvc_table *lvrx;	/* sequence numbers seen, under recvlock */
+	struct nn_iovec *rxiov;	/* receive-side scratch, reused across calls */
+	int nrxiov;
+	struct nn_iovec *scativ;	/* prepared scatter-receive layout, if any */
+	int nscat;
+	size_t scatsize;
+	struct rxloop *rxloop;	/* receiver loop serving this socket, if any */
+	int rcvtimeo;		/* receive timeout as now set on the socket */
+	int rcvtimeo_user;	/* and as set through setsockopt */
+	uint64_t lvstats[LVSTAT_COUNT];
+	histo *hist;		/* HIST_COUNT histograms, once enabled */
+	atomic_t histon;
+} sock_obj;
+
+typedef struct rxloop rxloop;
+
+/* a last-value cache attached to a publisher, see LAST-VALUE CACHE */
+typedef struct lvcsvc {
+	lvc_table *cache;	/* under lock */
+	lock_t lock;
+	int rep;		/* snapshot endpoint */
+	thread_t thread;
+	volatile int running;
+	sock_obj *sockobj;	/* the publisher, which outlives it */
+} lvcsvc;
+
+typedef struct {
+	void *msg;		/* nanomsg chunk */
+	uint32_t len;
+	objref sockref;
+	objref ref;
+} lease_obj;
+
+bonzai *allinst = NULL;
 
-mutex_t create_mutex()
+/* object types held in the handle table */
+#define OBJ_CTX		1
+#define OBJ_SOCK	2
+#define OBJ_LEASE	3
+#define OBJ_RING	4
+#define OBJ_POLLER	5
+#define OBJ_DEVICE	6
+#define OBJ_DISPATCHER	7
+#define OBJ_REQUEST	8
+#define OBJ_ASYNC	9
+
+#define FLAG_BLOCKING	1	/* a blocking receive is in progress */
+#define FLAG_INTERRUPT	2
+#define FLAG_POLLING	4	/* an lvnanomsg_poll is waiting on it */
+#define FLAG_INUSE	(FLAG_BLOCKING | FLAG_POLLING)
+
+/*
+ * resolve reference r of type t into x and hold it, bail out if stale or
+ * fails check y; whatever gets past it must objtable_put(r) once done
+ */
+#define CHECK_INTERNAL(x,r,t,y,z,m)					\
+do {									\
+	if (!((x) = objtable_get(r, t)) || !(y)) {			\
+		if (m) {						\
+			DEBUGMSG("SANITY FAIL %s@%i -- %p (%p)",	\
+				__FUNCTION__, __LINE__, (void*)(r), x);	\
+		}							\
+		if (x)							\
+			objtable_put(r);				\
+		return -z;						\
+	}								\
+} while (0)
+#define CHECK_SOCK(x,r)	CHECK_INTERNAL(x, r, OBJ_SOCK, ((x)->sock >= 0), ENOTSOCK, 1)
+#define CHECK_CTX(x,r)	CHECK_INTERNAL(x, r, OBJ_CTX, (x)->ctx, EINVAL, 1)
+
+/* CHECK_SOCK for a call that already holds something else it must put back */
+static sock_obj* sock_get(objref sockref)
+{
+	sock_obj *sockobj = objtable_get(sockref, OBJ_SOCK);
+
+	if (sockobj && (sockobj->sock < 0)) {
+		objtable_put(sockref);
+		return NULL;
+	}
+	return sockobj;
+}
+
+/* the destructor of a lease, once it was released and nobody reads it */
+static void lease_free(lease_obj *lease)
 {
-	mutex_t m = CreateMutex(NULL /* default security */,
-				FALSE /* unowned */,
-				NULL /* unnamed */);
-	return m;
+	nn_freemsg(lease->msg);
+	free(lease);
 }
 
-void destroy_mutex(mutex_t m)
+static void rx_unregister(sock_obj *sockobj);
+static void pace_unregister(sock_obj *sockobj);
+static void lvc_shutdown(lvcsvc *svc);
+
+/* start timing a call, if the socket keeps histograms */
+#define HIST_START(s)	(atomic_get(&(s)->histon) ? clock_ns() : 0)
+
+static void sock_hist(sock_obj *sockobj, int kind, uint64_t t0)
 {
-	if (m)
-		CloseHandle(m);
+	if (t0 && sockobj->hist)
+		histo_add(&sockobj->hist[kind], clock_ns() - t0);
 }
 
-int acquire_mutex(mutex_t m)
+/* take one side's lock, counting the times somebody else had it */
+static void sock_lock(sock_obj *sockobj, lock_t *l, int stat)
 {
-	DWORD ret;
+	uint64_t t0;
+
+	if (lock_try(l))
+		return;
+	t0 = HIST_START(sockobj);
+	lock_enter(l);
+	++sockobj->lvstats[stat - LVSTAT_BASE];	/* under the lock just taken */
+	sock_hist(sockobj, HIST_LOCKWAIT, t0);
+}
 
-	if (!m)
-		return -ECRIT;
-	ret = WaitForSingleObject(m, INFINITE);
+#define sock_lock_send(s)	sock_lock((s), &(s)->sendlock, LVSTAT_SEND_CONTENDED)
+#define sock_unlock_send(s)	lock_leave(&(s)->sendlock)
+#define sock_lock_recv(s)	sock_lock((s), &(s)->recvlock, LVSTAT_RECV_CONTENDED)
+#define sock_unlock_recv(s)	lock_leave(&(s)->recvlock)
+
+/*
+ * release everything a socket object owns besides the nanomsg socket;
+ * its destructor, so it runs once the last call holding it is done
+ */
+static void sock_free(sock_obj *sockobj)
+{
+	int i;
+	size_t len;
+	void *msg;
 
-	/* error means mutex was destroyed */
-	return (ret == WAIT_OBJECT_0) ? 0 : -ECRIT;
+	/* chunks still leased out die with the socket, unless released meanwhile */
+	for (i = 0; i < sockobj->leases->n; ++i)
+		objtable_remove((objref)sockobj->leases->elem[i]);
+	bonzai_free(sockobj->leases);
+	msgpool_free(sockobj->pool);
+	hpool_free(sockobj->hpool);
+	delta_free(sockobj->dtx);
+	delta_free(sockobj->drx);
+	if (sockobj->cfl) {
+		while (conflate_take(sockobj->cfl, &msg, &len))
+			nn_freemsg(msg);
+		conflate_free(sockobj->cfl);
+	}
+	lvc_shutdown(sockobj->lvc);
+	lvc_free(sockobj->lvrx);
+	free(sockobj->rxiov);
+	free(sockobj->scativ);
+	free(sockobj->hist);
+	lock_destroy(&sockobj->sendlock);
+	lock_destroy(&sockobj->recvlock);
+	/* let go of the context last; it may go with this */
+	objtable_put(sockobj->ctx->ref);
+	free(sockobj);
 }
 
-int release_mutex(mutex_t m)
+/* grow the receive-side iovec scratch to n entries; call with recvlock held */
+static struct nn_iovec* sock_rxiov(sock_obj *sockobj, int n)
 {
-	return ReleaseMutex(m) ? -ECRIT : 0;
+	struct nn_iovec *iov;
+
+	if (n <= sockobj->nrxiov)
+		return sockobj->rxiov;
+	iov = realloc(sockobj->rxiov, n * sizeof(struct nn_iovec));
+	if (!iov)
+		return NULL;
+	sockobj->rxiov = iov;
+	sockobj->nrxiov = n;
+	return iov;
 }
-#else
-typedef pthread_mutex_t mutex_t;
 
-mutex_t create_mutex()
+#define TIMEO_USER	(-2)	/* whatever was set through setsockopt */
+
+/*
+ * give the socket receive timeout ms (or the user's) for its next
+ * blocking receive, calling into nanomsg only when that changes; call
+ * with the blocking claim held; sends have no claim, so they leave
+ * NN_SNDTIMEO as the user set it and timed ones poll instead
+ */
+static void sock_timeo(sock_obj *sockobj, int ms)
 {
-	mutex_t m = 0;
-	int ret = pthread_mutex_init(&m, NULL);
-	return (ret == 0) ? m : 0;
+	if (ms == TIMEO_USER)
+		ms = sockobj->rcvtimeo_user;
+	if (ms < -1)
+		ms = -1;
+	if ((sockobj->rcvtimeo != ms)
+	    && (nn_setsockopt(sockobj->sock, NN_SOL_SOCKET, NN_RCVTIMEO, &ms, sizeof(ms)) == 0))
+		sockobj->rcvtimeo = ms;
 }
 
-void destroy_mutex(mutex_t m)
+/* a handle of size bytes for a received part, recycled if the socket pools them */
+static UHandle sock_newhandle(sock_obj *sockobj, size_t size)
 {
-	if (m)
-		pthread_mutex_destroy(&m);
+	UHandle h = NULL;
+
+	sock_lock_recv(sockobj);
+	if (sockobj->hpool)
+		h = hpool_get(sockobj->hpool, size);
+	++sockobj->lvstats[(h ? LVSTAT_HANDLES_REUSED : LVSTAT_HANDLES_NEW) - LVSTAT_BASE];
+	sock_unlock_recv(sockobj);
+
+	return h ? h : DSNewHandle(size);
 }
 
-int acquire_mutex(mutex_t m)
+/* give a handle back to the pool of sockref, or dispose of it if there is none */
+static void sock_puthandle(objref sockref, UHandle h)
 {
-	return pthread_mutex_lock(&m); /* error means mutex was destroyed */
+	sock_obj *sockobj = objtable_get(sockref, OBJ_SOCK);
+
+	if (!sockobj) {
+		DSDisposeHandle(h);
+		return;
+	}
+	sock_lock_recv(sockobj);
+	hpool_put(sockobj->hpool, h);
+	sock_unlock_recv(sockobj);
+	objtable_put(sockref);
 }
 
-int release_mutex(mutex_t m)
+/*
+ * compressed payloads carry a header, magic "\xC7LZ", a codec byte and
+ * the inflated size (little-endian), so they can be told from raw ones
+ */
+#define ZIP_HDRSIZE		8
+#define ZIP_CODEC_LZC		1
+
+/* take a send chunk from the socket's pool if it has one; call with sendlock held */
+static void* sock_allocmsg(sock_obj *sockobj, size_t len)
 {
-	return pthread_mutex_unlock(&m);
+	void *msg;
+
+	if (!sockobj->pool)
+		return nn_allocmsg(len, 0);
+	if ((msg = msgpool_get(sockobj->pool, len))) {
+		++sockobj->lvstats[LVSTAT_POOL_HITS - LVSTAT_BASE];
+		return msg;
+	}
+	++sockobj->lvstats[LVSTAT_POOL_MISSES - LVSTAT_BASE];
+	return nn_allocmsg(len, 0);
 }
-#endif
-#else
-typedef int mutex_t;
 
-mutex_t create_mutex()		{ return 0; }
-void destroy_mutex(mutex_t m)	{ return; }
-int acquire_mutex(mutex_t m)	{ return 0; }
-int release_mutex(mutex_t m)	{ return 0; }
-#endif 
+/* dispose of a chunk nanomsg did not take; call with sendlock held */
+static void sock_freemsg(sock_obj *sockobj, void *msg, size_t len)
+{
+	if (!sockobj->pool)
+		nn_freemsg(msg);
+	else if (msgpool_put(sockobj->pool, msg, len) == 0)
+		++sockobj->lvstats[LVSTAT_POOL_RECYCLED - LVSTAT_BASE];
+}
 
-typedef struct {
-	uint32_t tag;
-	uint32_t id;
-	int flags;
-	int ipv6;
-} ctx_t;
+/* swap a chunk about to be sent for a compressed one, if that pays off */
+static void sock_deflate(sock_obj *sockobj, void **msg, size_t *len)
+{
+	int n, zipmin = atomic_get(&sockobj->zipmin);
+	uint64_t t0;
+	uint8_t *zip, *trimmed;
+
+	if ((zipmin <= 0) || (*len < (size_t)zipmin)
+	    || (*len <= ZIP_HDRSIZE + 1) || (*len > INT_MAX))
+		return;
+	if (!(zip = nn_allocmsg(ZIP_HDRSIZE + lzc_bound(*len), 0)))
+		return;	/* then it goes out as it is */
+	t0 = clock_ns();
+	/* only worth it if it comes out smaller, header and all */
+	n = lzc_compress(*msg, (int)*len, zip + ZIP_HDRSIZE,
+			 (int)(*len - ZIP_HDRSIZE - 1));
+	atomic_add64(&sockobj->lvstats[LVSTAT_ZIP_NS - LVSTAT_BASE], clock_ns() - t0);
+	atomic_add64(&sockobj->lvstats[LVSTAT_ZIP_IN - LVSTAT_BASE], *len);
+	if ((n <= 0) || !(trimmed = nn_reallocmsg(zip, ZIP_HDRSIZE + n))) {
+		nn_freemsg(zip);
+		atomic_add64(&sockobj->lvstats[LVSTAT_ZIP_OUT - LVSTAT_BASE], *len);
+		return;
+	}
+	trimmed[0] = 0xC7;
+	trimmed[1] = 'L';
+	trimmed[2] = 'Z';
+	trimmed[3] = ZIP_CODEC_LZC;
+	trimmed[4] = (uint8_t)*len;
+	trimmed[5] = (uint8_t)(*len >> 8);
+	trimmed[6] = (uint8_t)(*len >> 16);
+	trimmed[7] = (uint8_t)(*len >> 24);
+	sock_lock_send(sockobj);
+	sock_freemsg(sockobj, *msg, *len);
+	sock_unlock_send(sockobj);
+	*msg = trimmed;
+	*len = ZIP_HDRSIZE + n;
+	atomic_add64(&sockobj->lvstats[LVSTAT_ZIP_OUT - LVSTAT_BASE], *len);
+}
 
-typedef struct {
-	void *ctx;
-	bonzai *socks;
-	bonzai *inst;
-	int flags;
-} ctx_obj;
+/* swap a received chunk for its inflated self; returns the new length */
+static int sock_inflate(sock_obj *sockobj, void **msg, int len)
+{
+	int n;
+	uint32_t size;
+	uint64_t t0;
+	const uint8_t *zip = *msg;
+	void *out;
+
+	if (!atomic_get(&sockobj->zipmin) || (len < ZIP_HDRSIZE)
+	    || (zip[0] != 0xC7) || (zip[1] != 'L') || (zip[2] != 'Z')
+	    || (zip[3] != ZIP_CODEC_LZC))
+		return len;	/* raw, or a codec we do not know */
+	size = zip[4] | (zip[5] << 8) | (zip[6] << 16) | ((uint32_t)zip[7] << 24);
+	/* no block expands more than 255-fold */
+	if ((size > INT_MAX) || (size / 255 > (uint32_t)len)
+	    || !(out = nn_allocmsg(size, 0)))
+		return len;
+	t0 = clock_ns();
+	n = lzc_decompress(zip + ZIP_HDRSIZE, len - ZIP_HDRSIZE, out, size);
+	atomic_add64(&sockobj->lvstats[LVSTAT_UNZIP_NS - LVSTAT_BASE], clock_ns() - t0);
+	if (n < 0) {
+		/* not one of ours after all, pass it on untouched */
+		nn_freemsg(out);
+		return len;
+	}
+	atomic_add64(&sockobj->lvstats[LVSTAT_UNZIP_IN - LVSTAT_BASE], len);
+	atomic_add64(&sockobj->lvstats[LVSTAT_UNZIP_OUT - LVSTAT_BASE], n);
+	nn_freemsg(*msg);
+	*msg = out;
+	return n;
+}
 
-typedef struct {
-	int sock;
-	ctx_obj *ctx;
-	int flags;
-	int eid;
-	mutex_t mutex;
-} sock_obj;
+/*
+ * keep a chunk about to be sent in the socket's last-value cache and,
+ * if it stamps, stamp it; a stamping publisher never sends a message
+ * long enough for a topic without its stamp, so subscribers need not
+ * guess, and if one cannot be kept or stamped the chunk is disposed of
+ * and -ENOBUFS returned to fail the send
+ */
+static int sock_stamp(sock_obj *sockobj, void **msg, size_t *len)
+{
+	int ret;
+	uint32_t seq;
+	void *frame = NULL;
+	lvcsvc *svc;
+
+	if (!sockobj->lvc)
+		return 0;	/* unlocked peek; the common case is off */
+	sock_lock_send(sockobj);
+	if (!(svc = sockobj->lvc) || (*len < (size_t)svc->cache->topiclen)) {
+		sock_unlock_send(sockobj);
+		return 0;	/* too short for a topic; it goes out as it is */
+	}
+	if (svc->cache->stamped
+	    && !(frame = sock_allocmsg(sockobj, *len + LVC_STAMPSIZE))) {
+		sock_freemsg(sockobj, *msg, *len);
+		sock_unlock_send(sockobj);
+		return -ENOBUFS;
+	}
+	lock_enter(&svc->lock);
+	ret = lvc_store(svc->cache, *msg, *len, &seq);
+	lock_leave(&svc->lock);
+	if (!frame) {
+		sock_unlock_send(sockobj);
+		return 0;	/* kept, at best, but not stamped */
+	}
+	if (ret < 0) {
+		sock_freemsg(sockobj, frame, *len + LVC_STAMPSIZE);
+		sock_freemsg(sockobj, *msg, *len);
+		sock_unlock_send(sockobj);
+		return -ENOBUFS;
+	}
+	lvc_stamp(svc->cache, *msg, *len, seq, frame);
+	sock_freemsg(sockobj, *msg, *len);
+	sock_unlock_send(sockobj);
+	*msg = frame;
+	*len += LVC_STAMPSIZE;
+	return 0;
+}
 
-bonzai *allinst = NULL;
-bonzai *validobj = NULL;
+/*
+ * swap a chunk about to be sent for its keyframe or delta frame; the
+ * topic's state moves on even if the send then fails, which receivers
+ * see as a gap and get over at the next keyframe
+ */
+static void sock_delta(sock_obj *sockobj, void **msg, size_t *len)
+{
+	int n, key;
+	size_t cap;
+	void *frame, *trimmed = NULL;
+
+	if (!sockobj->dtx)
+		return;	/* unlocked peek; the common case is off */
+	sock_lock_send(sockobj);
+	if (!sockobj->dtx) {
+		sock_unlock_send(sockobj);
+		return;
+	}
+	cap = delta_bound(sockobj->dtx, *len);
+	if (!(frame = sock_allocmsg(sockobj, cap))) {
+		sock_unlock_send(sockobj);
+		return;
+	}
+	n = delta_encode(sockobj->dtx, *msg, *len, frame, cap, &key);
+	if ((n < 0) || !(trimmed = nn_reallocmsg(frame, n))) {
+		sock_freemsg(sockobj, frame, cap);
+		sock_unlock_send(sockobj);
+		return;
+	}
+	sockobj->lvstats[LVSTAT_DELTA_IN - LVSTAT_BASE] += *len;
+	sockobj->lvstats[LVSTAT_DELTA_OUT - LVSTAT_BASE] += n;
+	sockobj->lvstats[LVSTAT_DELTA_KEYFRAMES - LVSTAT_BASE] += key;
+	sock_freemsg(sockobj, *msg, *len);
+	sock_unlock_send(sockobj);
+	*msg = trimmed;
+	*len = n;
+}
 
-#define FLAG_BLOCKING	1
-#define FLAG_INTERRUPT	2
+/*
+ * swap a received frame for the message it rebuilds and strip its
+ * last-value stamp; returns the new length, or DELTA_SKIP if the caller
+ * should drop it (a delta we have no base for, or a value a snapshot
+ * already gave); call with recvlock held, or use sock_unframe
+ */
+static int sock_unframe_held(sock_obj *sockobj, void **msg, int len)
+{
+	int n, size;
+	void *out;
+
+	/* a delta that cannot decode is dropped before anything is allocated */
+	size = sockobj->drx ? delta_size(sockobj->drx, *msg, len) : DELTA_RAW;
+	if (size == DELTA_SKIP) {
+		++sockobj->lvstats[LVSTAT_DELTA_SKIPPED - LVSTAT_BASE];
+		return DELTA_SKIP;
+	}
+	if ((size >= 0) && (out = nn_allocmsg(size, 0))) {
+		n = delta_decode(sockobj->drx, *msg, len, out, size);
+		if (n >= 0) {
+			nn_freemsg(*msg);
+			*msg = out;
+			len = n;
+		} else {
+			nn_freemsg(out);
+			if (n == DELTA_SKIP) {
+				++sockobj->lvstats[LVSTAT_DELTA_SKIPPED - LVSTAT_BASE];
+				return DELTA_SKIP;
+			}
+			/* not a frame after all */
+		}
+	}
+	if (sockobj->lvrx) {
+		n = lvc_accept(sockobj->lvrx, *msg, len);
+		if (n == LVC_STALE) {
+			++sockobj->lvstats[LVSTAT_LVC_DUPLICATES - LVSTAT_BASE];
+			return DELTA_SKIP;
+		}
+		if (n >= 0)
+			len = n;
+	}
+	return len;
+}
 
-#define CHECK_INTERNAL(x,y,z,m)						\
-do {									\
-	if (!(x) || !(y) || (bonzai_find(validobj,x) < 0)) {		\
-		if (m) {						\
-			DEBUGMSG("SANITY FAIL %s@%i -- %p (%p)",	\
-					__FUNCTION__, __LINE__, y, x);	\
-		}							\
-		return -z;						\
-	}								\
-} while (0)
-#define CHECK_SOCK(x)	CHECK_INTERNAL(x, ((x->sock) >= 0), ENOTSOCK, 1);
-#define CHECK_CTX(x)	CHECK_INTERNAL(x, x->ctx, EINVAL, 1);
+static int sock_unframe(sock_obj *sockobj, void **msg, int len)
+{
+	if (!sockobj->drx && !sockobj->lvrx)
+		return len;	/* unlocked peek; the common case is off */
+	sock_lock_recv(sockobj);
+	len = sock_unframe_held(sockobj, msg, len);
+	sock_unlock_recv(sockobj);
+	return len;
+}
+
+/*
+ * stage a chunk for the pacing thread instead of sending it, if the
+ * socket conflates; returns 0 if it took the chunk, which replaces any
+ * still waiting for the same topic
+ */
+static int sock_conflate(sock_obj *sockobj, void *msg, size_t len)
+{
+	int ret;
+	size_t oldlen;
+	void *old;
+
+	if (!sockobj->cfl)
+		return -1;	/* unlocked peek; the common case is off */
+	sock_lock_send(sockobj);
+	if (!sockobj->cfl) {
+		sock_unlock_send(sockobj);
+		return -1;
+	}
+	ret = conflate_put(sockobj->cfl, msg, len, &old, &oldlen);
+	if (ret > 0) {
+		sock_freemsg(sockobj, old, oldlen);
+		++sockobj->lvstats[LVSTAT_CONFLATED - LVSTAT_BASE];
+	}
+	sock_unlock_send(sockobj);
+	return (ret < 0) ? -1 : 0;
+}
 
-EXPORT int lvnanomsg_close(sock_obj *sockobj, int flags)
+EXPORT int lvnanomsg_close(objref sockref, int flags)
 {
 	int ret, i;
 	int sock;
 	ctx_obj *ctxobj;
+	sock_obj *sockobj;
 
 	/* validate */
-	CHECK_SOCK(sockobj);
+	CHECK_SOCK(sockobj, sockref);
 	sock = sockobj->sock;
 	ctxobj = sockobj->ctx;
 	DEBUGMSG("CLOSE socket %d (%p)", sock, sockobj);
@@ -209,39 +699,59 @@ EXPORT int lvnanomsg_close(sock_obj *sockobj, int flags)
 		/* set the linger time to zero */
 		nn_setsockopt(sock, NN_SOL_SOCKET, NN_LINGER, &linger, sizeof(linger));
 	}
-	/* don't proceed if the socket is currently in use */
-#if USE_SOCKET_MUTEX
-	acquire_mutex(sockobj->mutex);
-	destroy_mutex(sockobj->mutex); /* should cancel any waiting acquires */
-	sockobj->mutex = 0;
-#endif
-	/* close the socket */
-	ret = nn_close(sock);
+	/* take it away from its receiver loop before the descriptor goes */
+	rx_unregister(sockobj);
+	/* and from the pacing thread, which sends what it still has staged */
+	pace_unregister(sockobj);
+	/* the reference is stale from here on, so no new call can start */
+	if (objtable_remove(sockref) < 0) {
+		objtable_put(sockref);
+		return -ENOTSOCK;	/* somebody else closed it meanwhile */
+	}
+	/*
+	 * calls still holding it check for this under a side lock, so that
+	 * they never use the number once nanomsg may hand it to a new socket
+	 */
+	sock_lock_send(sockobj);
+	sock_lock_recv(sockobj);
+	sockobj->sock = -1;
+	sock_unlock_recv(sockobj);
+	sock_unlock_send(sockobj);
+	/* close the socket, which wakes any call still blocked in it */
+	ret = RET0(nn_close(sock));
+	TRACE(TR_CLOSE, sock, ret, 0);
 	/* clean up */
-	bonzai_clip(validobj, sockobj);
-	free(sockobj);
 	/* remove from context */
 	i = bonzai_find(ctxobj->socks, sockobj);
 	DEBUGMSG("  FOUND at pos %i of %p (%p)", i, ctxobj->ctx, ctxobj);
 	if (i >= 0)
 		ctxobj->socks->elem[i] = NULL;
+	/* calls still in flight hold it, and the last of them frees it */
+	objtable_put(sockref);
 	//if ( bonzai_clip( ctxobj->socks, sockobj ) < 0 ) ret = -EFAULT;
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_ctx_destroy(ctx_obj **pinstdata, ctx_obj *ctxobj, int flags)
+/* the context's destructor, once nobody holds it, its sockets included */
+static void ctx_free(ctx_obj *ctxobj)
 {
-	void *ctx;
+	free(ctxobj->ctx);
+	bonzai_free(ctxobj->socks);		/* kill list of sockets */
+	free(ctxobj);				/* free memory associated */
+}
+
+EXPORT int lvnanomsg_ctx_destroy(objref *pinstdata, objref ctxref, int flags)
+{
+	ctx_obj *ctxobj;
 
 	/* validate */
-	CHECK_CTX(ctxobj);
-	ctx = ctxobj->ctx;
+	CHECK_CTX(ctxobj, ctxref);
 	DEBUGMSG("TERM on %p (%p)", ctxobj->ctx, ctxobj);
 
-	/* store a pointer in the instance in case of interrupt */
+	/* store the reference in the instance in case of interrupt */
 	if (pinstdata)
-		*pinstdata = ctxobj;
+		*pinstdata = ctxref;
 
 	/* attempt to prevent hanging by closing all non-blocking sockets */
 	if (flags) {
@@ -254,34 +764,38 @@ EXPORT int lvnanomsg_ctx_destroy(ctx_obj **pinstdata, ctx_obj *ctxobj, int flags
 		ctxobj->flags |= FLAG_INTERRUPT;
 		for (i = 0; i < tree->n; ++i) {
 			/* note we MUST NOT close blocking sockets; they are in use in another thread */
-			if (((sockobj = tree->elem[i])) && !(sockobj->flags & FLAG_BLOCKING)) {
+			if (((sockobj = tree->elem[i])) && !(atomic_get(&sockobj->flags) & FLAG_INUSE)) {
 				DEBUGMSG("  TERMCLOSE %i = %d (%p)", i, sockobj->sock, sockobj);
-				lvnanomsg_close(sockobj, 1);
+				lvnanomsg_close(sockobj->ref, 1);
 			}
 		}
 	}
 
-	/* close the context -- this may hang!! */
-	free(ctx);
+	/* reference is no longer valid; of racing destroys only one goes on */
+	if (objtable_remove(ctxref) < 0) {
+		objtable_put(ctxref);
+		return 0;
+	}
 	/* we succeeded, clean up */
-	bonzai_free(ctxobj->socks);		/* kill list of sockets */
 	bonzai_clip(ctxobj->inst, ctxobj);	/* remove from owning instance */
-	bonzai_clip(validobj, ctxobj);		/* remove from list of valid objects */
-	bonzai_sort(validobj);			/* remove NULLs from list of objects */
-	free(ctxobj);				/* free memory associated */
+	objtable_put(ctxref);			/* freed once its last socket is */
 	DEBUGMSG("  TERM complete");
 
 	return 0;
 }
 
-EXPORT int lvnanomsg_ctx_destroy_abort(ctx_obj **pinstdata)
+EXPORT int lvnanomsg_ctx_destroy_abort(objref *pinstdata)
 {
+	objref ctxref = pinstdata ? *pinstdata : 0;
+	ctx_obj *ctxobj;
+
 	/* aborting a term call because some sockets are not closed */
-	if (pinstdata && *pinstdata) {
-		DEBUGMSG("INTERRUPT term on %p", pinstdata[0]->ctx);
+	if ((ctxobj = objtable_get(ctxref, OBJ_CTX))) {
+		DEBUGMSG("INTERRUPT term on %p", ctxobj->ctx);
 		/* close all non-blocking sockets then close context */
-		pinstdata[0]->flags |= FLAG_INTERRUPT;
-		lvnanomsg_ctx_destroy(NULL, *pinstdata, 1);
+		ctxobj->flags |= FLAG_INTERRUPT;
+		lvnanomsg_ctx_destroy(NULL, ctxref, 1);
+		objtable_put(ctxref);
 	}
 
 	return 0;
@@ -300,11 +814,12 @@ EXPORT int lvnanomsg_ctx_create_reserve(bonzai** pinstdata)
 	return 0;
 }
 
-EXPORT int lvnanomsg_ctx_create(bonzai** pinstdata, ctx_obj** ctxptr)
+EXPORT int lvnanomsg_ctx_create(bonzai** pinstdata, objref *ctxptr)
 {
 	/* create a context and data structures to track it */
 	void *ctx;
-	*ctxptr = NULL;
+	ctx_obj *ctxobj;
+	*ctxptr = 0;
 	CRITCHECK;
 
 	/* create a new context */
@@ -313,16 +828,23 @@ EXPORT int lvnanomsg_ctx_create(bonzai** pinstdata, ctx_obj** ctxptr)
 		return -1; /* failed */
 
 	/* success! */
-	*ctxptr = calloc(sizeof(ctx_obj), 1);
-	if (!(*ctxptr))
+	ctxobj = calloc(sizeof(ctx_obj), 1);
+	if (!ctxobj)
 		return -1;
 
-	ctxptr[0]->socks = bonzai_init(ctx);
-	ctxptr[0]->inst = *pinstdata;
-	ctxptr[0]->ctx = ctx;
-	bonzai_grow(validobj, *ctxptr);		/* is a valid object */
-	bonzai_grow(*pinstdata, *ctxptr);	/* belongs to an inst */
-	DEBUGMSG("INIT context %p (%p); %i objs", ctx, *ctxptr, validobj->n);
+	ctxobj->socks = bonzai_init(ctx);
+	ctxobj->inst = *pinstdata;
+	ctxobj->ctx = ctx;
+	ctxobj->ref = objtable_add(ctxobj, OBJ_CTX);	/* is a valid object */
+	if (!ctxobj->ref) {
+		bonzai_free(ctxobj->socks);
+		free(ctxobj);
+		free(ctx);
+		return -EMFILE;
+	}
+	bonzai_grow(*pinstdata, ctxobj);	/* belongs to an inst */
+	*ctxptr = ctxobj->ref;
+	DEBUGMSG("INIT context %p (%p); %i objs", ctx, ctxobj, objtable_count());
 
 	return 0;
 }
@@ -342,7 +864,7 @@ EXPORT int lvnanomsg_ctx_create_unreserve(bonzai** pinstdata)
 	for (i = 0; i < insttree->n; ++i) {
 		if ((ctxobj = insttree->elem[i]))
 			/* eliminate this context */
-			lvnanomsg_ctx_destroy( NULL, ctxobj, 1);
+			lvnanomsg_ctx_destroy( NULL, ctxobj->ref, 1);
 	}
 	/* free the data structure */
 	bonzai_free(insttree);
@@ -353,22 +875,27 @@ EXPORT int lvnanomsg_ctx_create_unreserve(bonzai** pinstdata)
 	return 0;
 }
 
-EXPORT int lvnanomsg_socket(ctx_obj *ctxobj, sock_obj **sockptr, int type, int linger)
+static int sock_create(objref ctxref, objref *sockptr, int domain, int type,
+		       int linger)
 {
 	int ret = 0;
 	int sock;
+	ctx_obj *ctxobj;
+	sock_obj *sockobj;
 
-	*sockptr = NULL;
+	*sockptr = 0;
+	/* validate */
+	CHECK_CTX(ctxobj, ctxref);
 	DEBUGMSG("CREATE socket from %p (%p), %u existing",
 		 ctxobj->ctx, ctxobj, ctxobj->socks->n);
-	/* validate */
-	CHECK_CTX(ctxobj);
 
 	/* avoid issue #574 (https://zeromq.jira.com/browse/LIBZMQ-574) */
-	if (ctxobj->socks->n >= 512)
+	if (ctxobj->socks->n >= 512) {
+		objtable_put(ctxref);
 		return -EMFILE;
+	}
 	/* try to create a socket */
-	sock = nn_socket(AF_SP, type);
+	sock = nn_socket(domain, type);
 	if (sock < 0) {
 		ret = sock;
 		goto out;
@@ -377,40 +904,96 @@ EXPORT int lvnanomsg_socket(ctx_obj *ctxobj, sock_obj **sockptr, int type, int l
 	/* success! */
 	ret = nn_setsockopt(sock, NN_SOL_SOCKET, NN_LINGER, &linger, sizeof(int));
 	/* track objects */
-	sockptr[0] = calloc(sizeof(sock_obj), 1);
-	sockptr[0]->ctx = ctxobj;
-	sockptr[0]->sock = sock;
-#if USE_SOCKET_MUTEX
-	sockptr[0]->mutex = create_mutex();
-#endif
-	bonzai_grow(ctxobj->socks, *sockptr);
-	bonzai_grow(validobj, *sockptr);
-	DEBUGMSG("  SOCKET complete %d (%p); %i objs", sock, *sockptr, validobj->n);
+	sockobj = calloc(sizeof(sock_obj), 1);
+	sockobj->ctx = ctxobj;
+	sockobj->sock = sock;
+	sockobj->leases = bonzai_init(NULL);
+	lock_init(&sockobj->sendlock);
+	lock_init(&sockobj->recvlock);
+	/* nanomsg's defaults: wait for ever */
+	sockobj->rcvtimeo = sockobj->rcvtimeo_user = -1;
+	sockobj->ref = objtable_add(sockobj, OBJ_SOCK);
+	if (!sockobj->ref) {
+		nn_close(sock);
+		sock_free(sockobj);	/* puts our hold on the context */
+		return -EMFILE;
+	}
+	bonzai_grow(ctxobj->socks, sockobj);
+	*sockptr = sockobj->ref;
+	DEBUGMSG("  SOCKET complete %d (%p); %i objs", sock, sockobj, objtable_count());
+	/*
+	 * the socket keeps our hold on the context until its destructor, so
+	 * that a context destroyed under a blocked socket outlives it
+	 */
+	ret = RET0(ret);
+	TRACE(TR_SOCKET, sock, ret, 0);
+	return ret;
 
 out:
-	return RET0(ret);
+	ret = RET0(ret);
+	TRACE(TR_SOCKET, sock, ret, 0);
+	objtable_put(ctxref);
+	return ret;
+}
+
+EXPORT int lvnanomsg_socket(objref ctxref, objref *sockptr, int type, int linger)
+{
+	return sock_create(ctxref, sockptr, AF_SP, type, linger);
+}
+
+/* a raw socket passes routing headers through, e.g. for a dispatcher */
+EXPORT int lvnanomsg_socket_raw(objref ctxref, objref *sockptr, int type,
+				int linger)
+{
+	return sock_create(ctxref, sockptr, AF_SP_RAW, type, linger);
 }
 
-EXPORT int lvnanomsg_poll(bonzai **pinstdata, sock_obj **sockobjs, int *events,
+EXPORT int lvnanomsg_poll(bonzai **pinstdata, const objref *sockrefs, int *events,
 			  int n, long timeout, unsigned int *nevents)
 {
 	int ret = 0, i;
+	uint64_t t0 = 0;
 	struct nn_pollfd *items;
+	sock_obj **sockobjs, *sockobj;
 
 	items = calloc(n, sizeof(struct nn_pollfd));
+	sockobjs = calloc(n, sizeof(sock_obj*));
+	if (!items || !sockobjs) {
+		free(items);
+		free(sockobjs);
+		return -ENOMEM;
+	}
 	if (nevents)
 		*nevents = 0;
+
+	/* resolve every reference before touching any socket state */
+	for (i = 0 ; i < n; ++i) {
+		sockobjs[i] = objtable_get(sockrefs[i], OBJ_SOCK);
+		if (!sockobjs[i] || (sockobjs[i]->sock < 0)) {
+			DEBUGMSG("SANITY FAIL %s@%i -- %p",
+				 __FUNCTION__, __LINE__, (void*)sockrefs[i]);
+			if (sockobjs[i])
+				++i;
+			while (i-- > 0)
+				objtable_put(sockrefs[i]);
+			free(items);
+			free(sockobjs);
+			return -ENOTSOCK;
+		}
+		if (!t0)
+			t0 = HIST_START(sockobjs[i]);
+	}
 	if (pinstdata)
 		*pinstdata = bonzai_init(NULL);
 
 	for (i = 0 ; i < n; ++i) {
-		CHECK_SOCK(sockobjs[i]);	/* may leak mem if breaks */
 		items[i].fd = sockobjs[i]->sock;
 		items[i].events = events[i];
 		items[i].revents = 0;
 		if (timeout != 0) {
-			bonzai_grow(*pinstdata, sockobjs[i]);
-			sockobjs[i]->flags |= FLAG_BLOCKING;	/* a blocking call */
+			if (pinstdata)
+				bonzai_grow(*pinstdata, (void*)sockrefs[i]);
+			atomic_or(&sockobjs[i]->flags, FLAG_POLLING);	/* a blocking call */
 		}
 	}
 
@@ -419,6 +1002,7 @@ EXPORT int lvnanomsg_poll(bonzai **pinstdata, sock_obj **sockobjs, int *events,
 		ret = -ETERM;
 		DEBUGMSG("POLL ETERM");
 	}
+	TRACE(TR_POLL, -1, ret, n);
 
 	if (pinstdata) {
 		bonzai_free(*pinstdata);
@@ -429,17 +1013,24 @@ EXPORT int lvnanomsg_poll(bonzai **pinstdata, sock_obj **sockobjs, int *events,
 		events[i] = items[i].revents;
 		if (nevents && events[i])
 			++*nevents;
-		sockobjs[i]->flags &= ~FLAG_BLOCKING;	/* no longer blocking */
+		/* the socket may have been closed by an abort meanwhile */
+		if (!(sockobj = objtable_get(sockrefs[i], OBJ_SOCK)))
+			continue;
+		atomic_and(&sockobj->flags, ~FLAG_POLLING);	/* no longer blocking */
+		sock_hist(sockobj, HIST_BLOCKED, t0);
 		/* did the owning context get terminated? */
-		if ((ret == -ETERM) && (sockobjs[i]->ctx->flags & FLAG_INTERRUPT)) {
-			DEBUGMSG("  POLL CLOSE %d (%p)",
-						sockobjs[i]->sock, sockobjs[i]);
-			lvnanomsg_close(sockobjs[i], 1);
+		if ((ret == -ETERM) && (sockobj->ctx->flags & FLAG_INTERRUPT)) {
+			DEBUGMSG("  POLL CLOSE %d (%p)", sockobj->sock, sockobj);
+			lvnanomsg_close(sockrefs[i], 1);
 		}
+		objtable_put(sockrefs[i]);
 	}
+	/* the holds taken up front kept them from going away during the wait */
+	for (i = 0 ; i < n; ++i)
+		objtable_put(sockrefs[i]);
 
 	free(items);
-	DEBUGMSG("  POLL ret %d", ret);
+	free(sockobjs);
 
 	return ret;
 }
@@ -448,6 +1039,7 @@ EXPORT int lvnanomsg_poll_abort(bonzai **pinstdata)
 {
 	bonzai *tree;
 	ctx_obj *ctxobj;
+	sock_obj *sockobj;
 	int i;
 
 	/* aborting a poll call */
@@ -458,53 +1050,87 @@ EXPORT int lvnanomsg_poll_abort(bonzai **pinstdata)
 
 	/* terminate each context, provided it's not already terminating */
 	for (i = 0; i < tree->n; ++i) {
-		if (((ctxobj = ((sock_obj*)tree->elem[i])->ctx))
-		    && !(ctxobj->flags & FLAG_INTERRUPT)) {
+		if (!(sockobj = objtable_get((objref)tree->elem[i], OBJ_SOCK)))
+			continue;
+		if (((ctxobj = sockobj->ctx)) && !(ctxobj->flags & FLAG_INTERRUPT)) {
 			DEBUGMSG("  POLLINT kill %p (%p)", ctxobj->ctx, ctxobj);
-			lvnanomsg_close((sock_obj*)tree->elem[i], 1);
+			lvnanomsg_close(sockobj->ref, 1);
 		}
+		objtable_put((objref)tree->elem[i]);
 	}
 
 	return 0;
 }
 
 
-EXPORT int lvnanomsg_recvmsg(sock_obj **pinstdata, sock_obj *sockobj,
+/* claim the blocking receive and publish it for recv_abort; is one already in progress? */
+static int sock_recv_claim(objref *pinstdata, sock_obj *sockobj)
+{
+	if (atomic_or(&sockobj->flags, FLAG_BLOCKING) & FLAG_BLOCKING)
+		return -1;
+	/* prepare for blocking call */
+	if (pinstdata)
+		*pinstdata = sockobj->ref;
+	return 0;
+}
+
+/* give the blocking receive up again; sockobj is gone if ret was -ETERM */
+static void sock_recv_done(objref *pinstdata, sock_obj *sockobj, int ret)
+{
+	atomic_and(&sockobj->flags, ~FLAG_BLOCKING);
+	/* was the call terminated? */
+	if (ret == -ETERM) {
+		DEBUGMSG("  TERM during RECV on %d", sockobj->sock);
+		/* if it was an interrupt, we MUST close */
+		if (sockobj->ctx->flags & FLAG_INTERRUPT)
+			lvnanomsg_close(sockobj->ref, 1);
+	}
+	if (pinstdata)
+		*pinstdata = 0;
+}
+
+EXPORT int lvnanomsg_recvmsg(objref *pinstdata, objref sockref,
 			     char **h, const int lenvec[], const int size, int *flags)
 {
 	int ret = 0, n, i;
+	uint64_t t0, t1;
 	struct nn_msghdr hdr;
 	struct nn_iovec *iovec = NULL;
 	UHandle ptr;
 	bonzai *list;
+	sock_obj *sockobj;
 
 	CRITCHECK;
-	list = bonzai_init(NULL);
+	CHECK_SOCK(sockobj, sockref);
+	/* a blocking receive like the others, so that it can be aborted */
+	if (sock_recv_claim(pinstdata, sockobj) < 0) {
+		objtable_put(sockref);
+		return -EINPROGRESS;
+	}
+	t0 = HIST_START(sockobj);
 
 	iovec = (struct nn_iovec *)malloc(sizeof(struct nn_iovec) * size);
-	if (!iovec)
+	if (!iovec) {
+		sock_recv_done(pinstdata, sockobj, -ENOMEM);
+		objtable_put(sockref);
 		return -ENOMEM;
+	}
+	list = bonzai_init(NULL);
 
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.msg_iov = iovec;
 	hdr.msg_iovlen = size;
 
 
-	/* clear input handle */
-	if (acquire_mutex(sockobj->mutex) != 0)
-		return -ECRIT;
-
 	for (i = 0; i < size; i++) {
 		/* get the next message part */
-		ptr = DSNewHClr(4);
-		DSSetHSzClr(ptr, 4);
+		ptr = sock_newhandle(sockobj, lenvec[i] + 4);
 		if (!ptr) {
 			/* shit, out of memory */
 			ret = -ENOBUFS;
 			break;
 		}
 
-		DSSetHandleSize(ptr, lenvec[i] + 4);
 		iovec->iov_base = *ptr + 4;
 		iovec->iov_len = *(u32*)*ptr = lenvec[i];
 		iovec++;
@@ -513,9 +1139,22 @@ EXPORT int lvnanomsg_recvmsg(sock_obj **pinstdata, sock_obj *sockobj,
 		bonzai_grow(list, (void*)ptr);
 	}
 
-	ret = nn_recvmsg(sockobj->sock, &hdr, flags ? *flags : 0);
-
-	release_mutex(sockobj->mutex);
+	/* not with some of the parts missing */
+	if (ret == 0) {
+		sock_timeo(sockobj, TIMEO_USER);
+		t1 = HIST_START(sockobj);
+		ret = nn_recvmsg(sockobj->sock, &hdr, flags ? *flags : 0);
+		if (ret < 0)
+			ret = RET0(ret);	/* grab errno before anything else runs */
+		sock_hist(sockobj, HIST_BLOCKED, t1);
+		TRACE(TR_RECVMSG, sockobj->sock, ret, (ret > 0) ? ret : 0);
+	}
+	sock_recv_done(pinstdata, sockobj, ret);
+	if (ret >= 0) {
+		sock_lock_recv(sockobj);
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += ret;
+		sock_unlock_recv(sockobj);
+	}
 
 	/* turn stack into compatible array of handles */
 	n = list->n;
@@ -524,365 +1163,4357 @@ EXPORT int lvnanomsg_recvmsg(sock_obj **pinstdata, sock_obj *sockobj,
 	*(u32*)*h = n;
 	bonzai_free(list);
 	free(hdr.msg_iov);
+	sock_hist(sockobj, HIST_RECV, t0);
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return (ret < 0) ? ret : 0;
 }
 
-EXPORT int lvnanomsg_recv(sock_obj **pinstdata, sock_obj *sockobj,
-			  UHandle h, int *flags)
+/*
+ * receive one message as a nanomsg chunk, with the abort semantics of a
+ * blocking call; returns the length or -errno, and only on success is
+ * *sockptr set, still held for the caller to objtable_put, and so is *t0,
+ * the start time for the HIST_RECV sample the caller records when done;
+ * a wait is limited to timeout ms, or TIMEO_USER for the socket's own
+ */
+static int sock_recv_chunk(objref *pinstdata, objref sockref,
+			   sock_obj **sockptr, void **msg, int *flags,
+			   uint64_t *t0, int timeout)
 {
-	int ret = 0;
-	int sock;
-	void *msg = NULL;
+	int ret = 0, skip;
+	uint64_t t1;
+	sock_obj *sockobj;
 
-	DSSetHSzClr(h, 4); /* clear the output handle */
-	CHECK_SOCK(sockobj);
-	/* is this already blocking? */
-	if (sockobj->flags & FLAG_BLOCKING)
+	*msg = NULL;
+	CHECK_SOCK(sockobj, sockref);
+	if (sock_recv_claim(pinstdata, sockobj) < 0) {
+		objtable_put(sockref);
 		return -EINPROGRESS;
-	sock = sockobj->sock;
-	/* prepare for blocking call */
-	if (pinstdata)
-		*pinstdata = sockobj;
-
-	if (acquire_mutex(sockobj->mutex) != 0)
-		return -ECRIT;
-	sockobj->flags |= FLAG_BLOCKING;
-	DEBUGMSG("RECV on %d into %p", sockobj->sock, *h);
-	ret = nn_recv(sock, &msg, NN_MSG, flags ? *flags : 0);
-	DEBUGMSG("  RECV ret %d", ret);
-	sockobj->flags &= ~FLAG_BLOCKING;
-	release_mutex(sockobj->mutex);
-
-	/* was the call terminated? */
-	if ((ret < 0) && (nn_errno() == ETERM)) {
-		DEBUGMSG("  TERM during RECV on %d", sockobj->sock);
-		/* if it was an interrupt, we MUST close */
-		if (sockobj->ctx->flags & FLAG_INTERRUPT)
-			lvnanomsg_close(sockobj, 1);
 	}
-	if (pinstdata)
-		*pinstdata = NULL;
+	sock_timeo(sockobj, timeout);
 
-	/* was it success? */
-	if (ret >= 0) {
-		int l = ret;	
-		DSSetHandleSize(h, l + 4);
-		*( u32* )*h = l;
-		memcpy(*h + 4, msg, l);
-		nn_freemsg(msg);
+	*t0 = HIST_START(sockobj);
+	do {
+		t1 = *t0 ? clock_ns() : 0;
+		ret = nn_recv(sockobj->sock, msg, NN_MSG, flags ? *flags : 0);
+		if (ret < 0)
+			ret = RET0(ret);	/* grab errno before anything else runs */
+		sock_hist(sockobj, HIST_BLOCKED, t1);
+		TRACE(TR_RECV, sockobj->sock, ret, (ret > 0) ? ret : 0);
+		skip = 0;
+		if (ret >= 0) {
+			ret = sock_inflate(sockobj, msg, ret);
+			/* a delta whose base we missed, or a value we had */
+			if ((ret = sock_unframe(sockobj, msg, ret)) == DELTA_SKIP) {
+				nn_freemsg(*msg);
+				*msg = NULL;
+				skip = 1;
+			}
+		}
+	} while (skip);
+	sock_recv_done(pinstdata, sockobj, ret);
+	if (ret < 0)
+		objtable_put(sockref);
+	if (sockptr)
+		*sockptr = (ret >= 0) ? sockobj : NULL;
+
+	return ret;
+}
+
+static int sock_recv(objref *pinstdata, objref sockref, UHandle h, int *flags,
+		     int timeout)
+{
+	int ret;
+	uint64_t t0;
+	void *msg;
+	sock_obj *sockobj;
+
+	DSSetHSzClr(h, 4); /* clear the output handle */
+	ret = sock_recv_chunk(pinstdata, sockref, &sockobj, &msg, flags, &t0, timeout);
+
+	/* was it success? */
+	if (ret >= 0) {
+		int l = ret;	
+		if (DSSetHandleSize(h, l + 4) != mgNoErr) {
+			nn_freemsg(msg);
+			objtable_put(sockref);
+			return -ENOMEM;
+		}
+		*( u32* )*h = l;
+		memcpy(*h + 4, msg, l);
+		nn_freemsg(msg);
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += l;
+		sock_hist(sockobj, HIST_RECV, t0);
+		objtable_put(sockref);
+	}
+
+	return (ret < 0) ? ret : 0;
+}
+
+EXPORT int lvnanomsg_recv(objref *pinstdata, objref sockref,
+			  UHandle h, int *flags)
+{
+	return sock_recv(pinstdata, sockref, h, flags, TIMEO_USER);
+}
+
+/*
+ * LEASED RECEIVE
+ * hand the nanomsg chunk itself to LabVIEW instead of copying it into a
+ * handle; the data pointer stays valid until the lease is released (or
+ * the socket is closed) and can be read with MoveBlock or lease_read
+ */
+EXPORT int lvnanomsg_recv_lease(objref *pinstdata, objref sockref,
+				objref *leaseptr, uintptr_t *data, uint32_t *len,
+				int *flags)
+{
+	int ret;
+	uint64_t t0;
+	void *msg;
+	sock_obj *sockobj;
+	lease_obj *lease;
+
+	*leaseptr = 0;
+	*data = 0;
+	*len = 0;
+	ret = sock_recv_chunk(pinstdata, sockref, &sockobj, &msg, flags, &t0, TIMEO_USER);
+	if (ret < 0)
+		return ret;
+
+	lease = calloc(sizeof(lease_obj), 1);
+	if (!lease) {
+		nn_freemsg(msg);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	lease->msg = msg;
+	lease->len = ret;
+	lease->sockref = sockref;
+	lease->ref = objtable_add(lease, OBJ_LEASE);
+	if (!lease->ref) {
+		nn_freemsg(msg);
+		free(lease);
+		objtable_put(sockref);
+		return -EMFILE;
+	}
+	sock_lock_recv(sockobj);
+	bonzai_grow(sockobj->leases, (void*)lease->ref);
+	sockobj->lvstats[LVSTAT_RECV_LEASED - LVSTAT_BASE] += ret;
+	sock_unlock_recv(sockobj);
+	sock_hist(sockobj, HIST_RECV, t0);
+	objtable_put(sockref);
+
+	*leaseptr = lease->ref;
+	*data = (uintptr_t)msg;
+	*len = ret;
+	return 0;
+}
+
+EXPORT int lvnanomsg_lease_read(objref leaseref, uint32_t offset, uint32_t len,
+				UHandle h)
+{
+	lease_obj *lease;
+	sock_obj *sockobj;
+
+	DSSetHSzClr(h, 4); /* clear the output handle */
+	if (!(lease = objtable_get(leaseref, OBJ_LEASE)))
+		return -EINVAL;
+	/* clamp the slice to the message */
+	if (offset > lease->len)
+		offset = lease->len;
+	if (len > lease->len - offset)
+		len = lease->len - offset;
+	if (DSSetHandleSize(h, len + 4) != mgNoErr) {
+		objtable_put(leaseref);
+		return -ENOMEM;
+	}
+	*(u32*)*h = len;
+	memcpy(*h + 4, (char*)lease->msg + offset, len);
+	if ((sockobj = objtable_get(lease->sockref, OBJ_SOCK))) {
+		sock_lock_recv(sockobj);
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += len;
+		sock_unlock_recv(sockobj);
+		objtable_put(lease->sockref);
+	}
+	objtable_put(leaseref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_lease_release(objref leaseref)
+{
+	lease_obj *lease;
+	sock_obj *sockobj;
+
+	if (!(lease = objtable_get(leaseref, OBJ_LEASE)))
+		return -EINVAL;
+	/* of a second release, or the socket's close, only one gets to free it */
+	if (objtable_remove(leaseref) < 0) {
+		objtable_put(leaseref);
+		return -EINVAL;
+	}
+	/* the owning socket need not sweep it on close any more */
+	if ((sockobj = objtable_get(lease->sockref, OBJ_SOCK))) {
+		sock_lock_recv(sockobj);
+		bonzai_clip(sockobj->leases, (void*)leaseref);
+		sock_unlock_recv(sockobj);
+		objtable_put(lease->sockref);
+	}
+	objtable_put(leaseref);	/* lease_free, once a read in progress is done */
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_recv_timeout(objref *pinstdata, objref sockref,
+				  UHandle h, int *flags, long timeout)
+{
+	/* one nanomsg call, the timeout travelling as the socket's NN_RCVTIMEO */
+	int ret, f = flags ? (*flags & ~NN_DONTWAIT) : 0;
+
+	if (timeout < 0)
+		timeout = -1;
+	ret = sock_recv(pinstdata, sockref, h, &f, (int)timeout);
+
+	return (ret == -ETIMEDOUT) ? -EAGAIN : ret;
+}
+
+
+EXPORT int lvnanomsg_recv_abort(objref *pinstdata)
+{
+	/*
+	 * ABORT semantics are somewhat confusing with NANOMSG:
+ 	 * 1. we want to stop this socket blocking, so we need to use nn_term()
+	 * 2. we need to stop nn_term() blocking since we called it from the GUI thread (THIS thread)
+	 * 3. therefore we need to close all sockets associated with the context
+	 * 4. we cannot close THIS socket because it's still being used in the OTHER thread (by the blocking call)
+	 * 5. therefore we close all sockets but the blocking one and use the blocking thread to close that socket.
+	 * GOT ALL THAT??
+	 */
+	objref sockref = *pinstdata;
+	sock_obj *sockobj = objtable_get(sockref, OBJ_SOCK);
+	/* only worry about blocking calls */
+	if (!sockobj)
+		return 0;
+	if (!(atomic_get(&sockobj->flags) & FLAG_INUSE)) {
+		objtable_put(sockref);
+		return 0;
+	}
+
+	*pinstdata = 0;
+	/* we need to term the context to get the blocking call to return */
+	DEBUGMSG("INTERRUPT send/recv on %d", sockobj->sock);
+	/* we rely on the function unblocking and succeeding */
+	lvnanomsg_ctx_destroy(NULL, sockobj->ctx->ref, 1);
+	DEBUGMSG("  INTERRUPT done");
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * receive parts until a receive fails; the first waits at most first ms
+ * (TIMEO_USER: the socket's own timeout and the caller's flags), or with
+ * a deadline on lvnanomsg_clock_ms all of them wait until then at most
+ */
+static int sock_recv_multi(objref *pinstdata, objref sockref, char **h,
+			   int *flags, int first, uint64_t deadline)
+{
+	int ret = 0, n, f, timeout = first;
+	uint64_t t0, now;
+	void *msg;
+	UHandle ptr;
+	bonzai *list;
+	sock_obj *sockobj;
+	CRITCHECK;
+	list = bonzai_init(NULL);
+
+	do {
+		f = flags ? *flags : 0;
+		if (deadline) {
+			now = clock_us() / 1000;
+			timeout = (now < deadline) ? (int)(deadline - now) : 0;
+			f &= ~NN_DONTWAIT;
+		} else if (timeout != TIMEO_USER) {
+			f &= ~NN_DONTWAIT;	/* the first part is waited for */
+		}
+		/* get the next message part */
+		ret = sock_recv_chunk(pinstdata, sockref, &sockobj, &msg, &f, &t0, timeout);
+		if (!deadline)
+			timeout = TIMEO_USER;
+		if (ret < 0)
+			break;
+
+		/* copy it into a handle sized once, from the pool if possible */
+		ptr = sock_newhandle(sockobj, ret + 4);
+		if (!ptr) {
+			/* shit, out of memory */
+			nn_freemsg(msg);
+			objtable_put(sockref);
+			ret = -ENOBUFS;
+			break;
+		}
+		*(u32*)*ptr = ret;
+		memcpy(*ptr + 4, msg, ret);
+		nn_freemsg(msg);
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += ret;
+		sock_hist(sockobj, HIST_RECV, t0);
+		objtable_put(sockref);
+
+		/* add it to the stack */
+		bonzai_grow(list, (void*)ptr);
+	} while (1);
+
+	/* turn stack into compatible array of handles */
+	n = list->n;
+	DSSetHandleSize(h, 8 + n * sizeof(void*));
+	memcpy(LVALIGN(*h + 4), list->elem, n * sizeof(void*));
+	*(u32*)*h = n;
+	bonzai_free(list);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_recv_multi(objref *pinstdata, objref sockref,
+				char** h, int *flags)
+{
+	return sock_recv_multi(pinstdata, sockref, h, flags, TIMEO_USER, 0);
+}
+
+EXPORT int lvnanomsg_recv_multi_timeout(objref *pinstdata, objref sockref,
+					char** h, int *flags, long timeout)
+{
+	int ret;
+
+	DSSetHSzClr(h, 4);		/* in case it fails */
+	if (timeout < 0)
+		timeout = -1;
+	ret = sock_recv_multi(pinstdata, sockref, h, flags, (int)timeout, 0);
+
+	return (ret == -ETIMEDOUT) ? -EAGAIN : ret;
+}
+
+/*
+ * receive whatever parts arrive until an absolute deadline, in ms on
+ * lvnanomsg_clock_ms, however many receives that takes
+ */
+EXPORT int lvnanomsg_recv_multi_deadline(objref *pinstdata, objref sockref,
+					 char** h, int *flags, uint64_t deadline)
+{
+	int ret;
+
+	DSSetHSzClr(h, 4);		/* in case it fails */
+	ret = sock_recv_multi(pinstdata, sockref, h, flags, TIMEO_USER,
+			      deadline ? deadline : 1);
+
+	return (ret == -ETIMEDOUT) ? -EAGAIN : ret;
+}
+
+/* the monotonic clock deadlines are measured on */
+EXPORT uint64_t lvnanomsg_clock_ms(void)
+{
+	return clock_us() / 1000;
+}
+
+/*
+ * BATCHED RECEIVE
+ * drain up to maxmsgs messages into one contiguous byte array h, with
+ * message i at bytes [off[i], off[i+1]) of the I32 offset table; only the
+ * first receive may block, and the drain stops once maxbytes (if > 0) has
+ * been reached, so the last message may take it over the limit
+ */
+EXPORT int lvnanomsg_recv_batch(objref *pinstdata, objref sockref, UHandle h,
+				UHandle offsets, int maxmsgs, int maxbytes,
+				int *flags)
+{
+	int ret, n, i;
+	uint64_t t0;
+	size_t total;
+	void *msg;
+	char *dst;
+	uint32_t *off;
+	struct nn_iovec *iov;
+	sock_obj *sockobj;
+
+	DSSetHSzClr(h, 4);		/* clear the outputs */
+	DSSetHSzClr(offsets, 4);
+	if (maxmsgs <= 0)
+		return -EINVAL;
+	ret = sock_recv_chunk(pinstdata, sockref, &sockobj, &msg, flags, &t0, TIMEO_USER);
+	if (ret < 0)
+		return ret;
+
+	sock_lock_recv(sockobj);
+	if (!(iov = sock_rxiov(sockobj, maxmsgs))) {
+		sock_unlock_recv(sockobj);
+		nn_freemsg(msg);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	/* hold on to the chunks until we know how big the output is */
+	iov[0].iov_base = msg;
+	iov[0].iov_len = total = ret;
+	for (n = 1; n < maxmsgs; ++n) {
+		if ((maxbytes > 0) && (total >= (size_t)maxbytes))
+			break;
+		ret = nn_recv(sockobj->sock, &msg, NN_MSG, NN_DONTWAIT);
+		if (ret < 0)
+			break;
+		ret = sock_inflate(sockobj, &msg, ret);
+		if ((ret = sock_unframe_held(sockobj, &msg, ret)) == DELTA_SKIP) {
+			nn_freemsg(msg);
+			--n;
+			continue;
+		}
+		iov[n].iov_base = msg;
+		iov[n].iov_len = ret;
+		total += ret;
+	}
+
+	ret = 0;
+	if ((DSSetHandleSize(h, total + 4) != mgNoErr)
+	    || (DSSetHandleSize(offsets, (n + 2) * sizeof(uint32_t)) != mgNoErr))
+		ret = -ENOMEM;	/* the chunks are lost either way */
+	else {
+		*(u32*)*h = total;
+		*(u32*)*offsets = n + 1;
+		dst = *h + 4;
+		off = (uint32_t*)(*offsets + 4);
+		off[0] = 0;
+		for (i = 0; i < n; ++i) {
+			memcpy(dst + off[i], iov[i].iov_base, iov[i].iov_len);
+			off[i + 1] = off[i] + iov[i].iov_len;
+		}
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += total;
+	}
+	TRACE(TR_RECV_BATCH, sockobj->sock, ret ? ret : n, (uint32_t)total);
+	for (i = 0; i < n; ++i)
+		nn_freemsg(iov[i].iov_base);
+	sock_unlock_recv(sockobj);
+	sock_hist(sockobj, HIST_RECV, t0);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * SCATTER RECEIVE
+ * for fixed-layout frames: the part sizes are registered once and kept
+ * on the socket as a ready nn_iovec array, and each receive scatters
+ * the message straight into a buffer LabVIEW allocated once (parts
+ * back to back, at least the sum of the sizes) and passes in every
+ * time, with no allocation on either side; n = 0 drops the layout
+ */
+EXPORT int lvnanomsg_scatter_prepare(objref sockref, const uint32_t *lens, int n)
+{
+	int i;
+	size_t total = 0;
+	struct nn_iovec *iov = NULL, *old;
+	sock_obj *sockobj;
+
+	if (n < 0)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if (n > 0) {
+		if (!(iov = malloc(n * sizeof(struct nn_iovec)))) {
+			objtable_put(sockref);
+			return -ENOMEM;
+		}
+		for (i = 0; i < n; ++i) {
+			iov[i].iov_base = NULL;	/* filled in by every receive */
+			iov[i].iov_len = lens[i];
+			total += lens[i];
+		}
+	}
+
+	/* the layout is only ever used by the blocking receive, so claim that */
+	if (atomic_or(&sockobj->flags, FLAG_BLOCKING) & FLAG_BLOCKING) {
+		free(iov);
+		objtable_put(sockref);
+		return -EINPROGRESS;
+	}
+	old = sockobj->scativ;
+	sockobj->scativ = iov;
+	sockobj->nscat = n;
+	sockobj->scatsize = total;
+	atomic_and(&sockobj->flags, ~FLAG_BLOCKING);
+	free(old);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * counts gets the bytes that landed in each part and msglen the size of
+ * the whole message, which is larger than the layout if it was truncated
+ */
+EXPORT int lvnanomsg_scatter_recv(objref *pinstdata, objref sockref,
+				  char *buf, uint32_t buflen, int32_t *counts,
+				  uint32_t *msglen, int *flags)
+{
+	int ret, i;
+	uint64_t t0, t1;
+	size_t left;
+	char *dst = buf;
+	struct nn_msghdr hdr;
+	sock_obj *sockobj;
+
+	CRITCHECK;
+	CHECK_SOCK(sockobj, sockref);
+	if (sock_recv_claim(pinstdata, sockobj) < 0) {
+		objtable_put(sockref);
+		return -EINPROGRESS;
+	}
+	if (!sockobj->scativ || (buflen < sockobj->scatsize)) {
+		ret = sockobj->scativ ? -EMSGSIZE : -EINVAL;
+		sock_recv_done(pinstdata, sockobj, 0);
+		objtable_put(sockref);
+		return ret;
+	}
+
+	/* point the prepared layout at this call's buffer */
+	for (i = 0; i < sockobj->nscat; ++i) {
+		sockobj->scativ[i].iov_base = dst;
+		dst += sockobj->scativ[i].iov_len;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = sockobj->scativ;
+	hdr.msg_iovlen = sockobj->nscat;
+
+	sock_timeo(sockobj, TIMEO_USER);
+	t0 = HIST_START(sockobj);
+	t1 = t0 ? clock_ns() : 0;
+	ret = nn_recvmsg(sockobj->sock, &hdr, flags ? *flags : 0);
+	if (ret < 0)
+		ret = RET0(ret);	/* grab errno before anything else runs */
+	sock_hist(sockobj, HIST_BLOCKED, t1);
+	TRACE(TR_RECVMSG, sockobj->sock, ret, (ret > 0) ? ret : 0);
+	if (ret >= 0) {
+		/* nanomsg fills the parts in order and reports the whole size */
+		left = ret;
+		for (i = 0; i < sockobj->nscat; ++i) {
+			counts[i] = (left < sockobj->scativ[i].iov_len)
+				? left : sockobj->scativ[i].iov_len;
+			left -= counts[i];
+		}
+		if (msglen)
+			*msglen = ret;
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] +=
+			(ret - left);
+		sock_hist(sockobj, HIST_RECV, t0);
+	}
+	sock_recv_done(pinstdata, sockobj, ret);
+	objtable_put(sockref);
+
+	return (ret < 0) ? ret : 0;
+}
+
+/*
+ * TYPED ARRAYS
+ * numeric arrays sent as they are instead of flattened to strings in G:
+ * a short header (type, dimensions, byte order) and the elements, in
+ * the byte order the sender asked for; the receiver resizes a typed
+ * array handle from the header and swaps, if needed, during the copy
+ */
+#define ARRAY_MAGIC		0xA7
+#define ARRAY_BIGENDIAN		1	/* dims and data are big-endian */
+#define ARRAY_MAX_DIMS		4
+
+/* magic, type, ndims, flags, then the dims, padded to 8 bytes */
+#define ARRAY_HDRSIZE(nd)	((4 + 4 * (nd) + 7) & ~7)
+
+/* element size of a LabVIEW numeric type, and of the parts it swaps in */
+static int array_esize(int type, int *swap)
+{
+	switch (type) {
+	case iB: case uB:		*swap = 1; return 1;
+	case iW: case uW:		*swap = 2; return 2;
+	case iL: case uL: case fS:	*swap = 4; return 4;
+	case iQ: case uQ: case fD:	*swap = 8; return 8;
+	case cS:			*swap = 4; return 8;
+	case cD:			*swap = 8; return 16;
+	default:			return 0;
+	}
+}
+
+/* the natural alignment of 8-byte members, which LabVIEW follows */
+typedef struct {
+	int32_t n;
+	double x;
+} array_align8;
+
+/* where the elements of an ndims array start, past the I32 dimensions */
+static char* array_data(UHandle h, int ndims, int swap)
+{
+	uintptr_t p = (uintptr_t)(*h + ndims * sizeof(int32_t));
+#if LVALIGNMENT > 1
+	uintptr_t align = (swap < 8) ? swap : offsetof(array_align8, x);
+	p = (p + align - 1) & ~(align - 1);
+#endif
+	return (char*)p;
+}
+
+/* copy elements, swapping them if their byte orders differ */
+static void array_copy(void *dst, const void *src, size_t n, int swap, int flip)
+{
+	if (flip)
+		bswap_copy(dst, src, n, swap);
+	else
+		memcpy(dst, src, n * swap);
+}
+
+/* send the numeric array arr of LabVIEW type code type */
+EXPORT int lvnanomsg_send_array(objref sockref, int type, int ndims,
+				const UHandle arr, int bigendian, int *flags)
+{
+	int ret, i, esize, swap, flip;
+	uint32_t dim;
+	size_t n = 1, hdr, len;
+	uint64_t t0, t1;
+	char *msg;
+	sock_obj *sockobj;
+
+	if (!(esize = array_esize(type, &swap))
+	    || (ndims < 1) || (ndims > ARRAY_MAX_DIMS))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	t0 = HIST_START(sockobj);
+	for (i = 0; i < ndims; ++i)
+		n *= (arr && *arr) ? ((int32_t*)*arr)[i] : 0;
+	hdr = ARRAY_HDRSIZE(ndims);
+	len = hdr + n * esize;
+	flip = !bigendian != !bswap_bigendian();
+
+	sock_lock_send(sockobj);
+	msg = sock_allocmsg(sockobj, len);
+	if (msg)
+		sockobj->lvstats[LVSTAT_SEND_COPIED - LVSTAT_BASE] += len - hdr;
+	sock_unlock_send(sockobj);
+	if (msg == NULL) {
+		objtable_put(sockref);
+		return -ENOBUFS;
+	}
+	memset(msg, 0, hdr);
+	msg[0] = (char)ARRAY_MAGIC;
+	msg[1] = (char)type;
+	msg[2] = (char)ndims;
+	msg[3] = bigendian ? ARRAY_BIGENDIAN : 0;
+	for (i = 0; i < ndims; ++i) {
+		dim = (arr && *arr) ? ((int32_t*)*arr)[i] : 0;
+		array_copy(msg + 4 + 4 * i, &dim, 1, 4, flip);
+	}
+	if (n)
+		array_copy(msg + hdr, array_data(arr, ndims, swap),
+			   n * esize / swap, swap, flip);
+	if (sock_stamp(sockobj, (void**)&msg, &len) < 0) {
+		objtable_put(sockref);
+		return -ENOBUFS;
+	}
+	sock_delta(sockobj, (void**)&msg, &len);
+	sock_deflate(sockobj, (void**)&msg, &len);
+
+	/* may block, so no lock is held */
+	t1 = t0 ? clock_ns() : 0;
+	ret = RET0(nn_send(sockobj->sock, &msg, NN_MSG, flags ? *flags : 0));
+	sock_hist(sockobj, HIST_BLOCKED, t1);
+	TRACE(TR_SEND, sockobj->sock, ret, (uint32_t)len);
+	/* nanomsg only takes the chunk if the send succeeded */
+	if (ret < 0) {
+		sock_lock_send(sockobj);
+		sock_freemsg(sockobj, msg, len);
+		sock_unlock_send(sockobj);
+	}
+	sock_hist(sockobj, HIST_SEND, t0);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * receive into the numeric array arr, which must be of the type and
+ * number of dimensions that were sent; anything else is dropped with
+ * EPROTO
+ */
+EXPORT int lvnanomsg_recv_array(objref *pinstdata, objref sockref, int type,
+				int ndims, UHandle arr, int *flags)
+{
+	int ret, i, esize, swap, flip;
+	uint32_t dim;
+	size_t n = 1, hdr;
+	uint64_t t0;
+	char *msg;
+	sock_obj *sockobj;
+
+	if (!(esize = array_esize(type, &swap))
+	    || (ndims < 1) || (ndims > ARRAY_MAX_DIMS))
+		return -EINVAL;
+	ret = sock_recv_chunk(pinstdata, sockref, &sockobj, (void**)&msg, flags, &t0, TIMEO_USER);
+	if (ret < 0)
+		return ret;
+
+	/* check the header against what LabVIEW expects */
+	hdr = ARRAY_HDRSIZE(ndims);
+	if ((ret < (int)hdr) || ((uint8_t)msg[0] != ARRAY_MAGIC)
+	    || (msg[1] != type) || (msg[2] != ndims)) {
+		nn_freemsg(msg);
+		objtable_put(sockref);
+		return -EPROTO;
+	}
+	flip = !(msg[3] & ARRAY_BIGENDIAN) != !bswap_bigendian();
+	for (i = 0; i < ndims; ++i) {
+		array_copy(&dim, msg + 4 + 4 * i, 1, 4, flip);
+		/* LabVIEW dims are int32, and their product must fit the payload */
+		if ((dim > INT32_MAX)
+		    || (dim && (n > (((size_t)ret - hdr) / esize) / dim)))
+			break;
+		n *= dim;
+	}
+	/* only resize once the size is known to be exact */
+	if ((i < ndims) || ((size_t)ret - hdr != n * esize)) {
+		nn_freemsg(msg);
+		objtable_put(sockref);
+		return -EPROTO;
+	}
+
+	if (NumericArrayResize(type, ndims, &arr, n) != mgNoErr) {
+		nn_freemsg(msg);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	for (i = 0; i < ndims; ++i)
+		array_copy((int32_t*)*arr + i, msg + 4 + 4 * i, 1, 4, flip);
+	if (n)
+		array_copy(array_data(arr, ndims, swap), msg + hdr,
+			   n * esize / swap, swap, flip);
+	nn_freemsg(msg);
+	sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += n * esize;
+	sock_hist(sockobj, HIST_RECV, t0);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * GATHER SEND
+ * the parts of string array h go out as one message; nn_sendmsg would
+ * copy an iovec over the handles into a fresh chunk anyway, so gather
+ * them into a (pooled) chunk ourselves and hand that over as NN_MSG,
+ * which is the same single copy without an allocation or iovec array
+ */
+EXPORT int lvnanomsg_sendmsg(objref sockref, char** h, int *flags)
+{
+	UHandle *part = (UHandle*)LVALIGN(*h + 4);
+	int ret = 0, i, n = *(u32*)*h;
+	size_t len = 0, l;
+	uint64_t t0, t1;
+	char *dst;
+	void *msg;
+	struct nn_iovec iov;
+	struct nn_msghdr hdr;
+	sock_obj *sockobj;
+	
+	CHECK_SOCK(sockobj, sockref);
+	t0 = HIST_START(sockobj);
+	for (i = 0; i < n; ++i) {
+		if (part[i])	/* empty strings may have no handle at all */
+			len += *(u32*)*part[i];
+	}
+
+	sock_lock_send(sockobj);
+	msg = sock_allocmsg(sockobj, len);
+	if (msg)
+		sockobj->lvstats[LVSTAT_SEND_COPIED - LVSTAT_BASE] += len;
+	sock_unlock_send(sockobj);
+	if (msg == NULL) {
+		objtable_put(sockref);
+		return -ENOBUFS;
+	}
+	for (dst = msg, i = 0; i < n; ++i) {
+		if (!part[i])
+			continue;
+		l = *(u32*)*part[i];
+		memcpy(dst, *part[i] + 4, l);
+		dst += l;
+	}
+	if (sock_stamp(sockobj, &msg, &len) < 0) {
+		objtable_put(sockref);
+		return -ENOBUFS;
+	}
+	sock_delta(sockobj, &msg, &len);
+	sock_deflate(sockobj, &msg, &len);
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = &msg;
+	iov.iov_len = NN_MSG;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	/* may block, so no lock is held */
+	t1 = t0 ? clock_ns() : 0;
+	ret = RET0(nn_sendmsg(sockobj->sock, &hdr, flags ? *flags : 0));
+	sock_hist(sockobj, HIST_BLOCKED, t1);
+	TRACE(TR_SENDMSG, sockobj->sock, ret, (uint32_t)len);
+	/* nanomsg only takes the chunk if the send succeeded */
+	if (ret < 0) {
+		sock_lock_send(sockobj);
+		sock_freemsg(sockobj, msg, len);
+		sock_unlock_send(sockobj);
+	}
+	sock_hist(sockobj, HIST_SEND, t0);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * nn_send of chunk *msg waiting at most ms (-1 for ever), without
+ * touching the socket's NN_SNDTIMEO, which concurrent sends rely on:
+ * wait for room with nn_poll and send without blocking until the
+ * time is up; returns 0 or -errno, -ETIMEDOUT once the time is up
+ */
+static int sock_send_timed(sock_obj *sockobj, void **msg, int flags, int ms)
+{
+	int ret, wait;
+	uint64_t end = clock_ns() + (uint64_t)((ms > 0) ? ms : 0) * 1000000;
+	struct nn_pollfd pfd;
+
+	for (;;) {
+		ret = nn_send(sockobj->sock, msg, NN_MSG, flags | NN_DONTWAIT);
+		if (ret >= 0)
+			return 0;
+		if ((nn_errno() != EAGAIN) || (flags & NN_DONTWAIT))
+			return RET0(ret);
+		/* room may go to another sender first, so wait out what is left */
+		wait = -1;
+		if (ms >= 0) {
+			uint64_t now = clock_ns();
+
+			if (now >= end)
+				return -ETIMEDOUT;
+			wait = (int)((end - now + 999999) / 1000000);
+		}
+		pfd.fd = sockobj->sock;
+		pfd.events = NN_POLLOUT;
+		pfd.revents = 0;
+		if ((ret = nn_poll(&pfd, 1, wait)) < 0)
+			return RET0(ret);
+	}
+}
+
+/* send one message, a wait limited to timeout ms or TIMEO_USER for the socket's own */
+static int sock_send(objref sockref, const UHandle h, int *flags, int timeout)
+{
+	int ret = 0;
+	uint64_t t0, t1;
+	size_t len = 0;
+	void *msg;
+	sock_obj *sockobj;
+
+	CHECK_SOCK(sockobj, sockref);
+	t0 = HIST_START(sockobj);
+
+	if (h) {
+		const int l = *(u32*)*h;
+		sock_lock_send(sockobj);
+		msg = sock_allocmsg(sockobj, l);
+		if (msg == NULL) {
+			/* oh shit we're out of memory */
+			sock_unlock_send(sockobj);
+			objtable_put(sockref);
+			return -ENOBUFS;
+		}
+		sockobj->lvstats[LVSTAT_SEND_COPIED - LVSTAT_BASE] += l;
+		sock_unlock_send(sockobj);
+		memcpy(msg, *h + 4, l);
+		len = l;
+		if (sock_conflate(sockobj, msg, len) == 0) {
+			/* the pacing thread sends it, or a newer one */
+			if (flags)
+				*flags = 0;
+			sock_hist(sockobj, HIST_SEND, t0);
+			objtable_put(sockref);
+			return 0;
+		}
+		if (sock_stamp(sockobj, &msg, &len) < 0) {
+			objtable_put(sockref);
+			return -ENOBUFS;
+		}
+		sock_delta(sockobj, &msg, &len);
+		sock_deflate(sockobj, &msg, &len);
+	}
+	/* may block, so no lock is held */
+	t1 = t0 ? clock_ns() : 0;
+	if (timeout == TIMEO_USER)
+		ret = RET0(nn_send(sockobj->sock, &msg, NN_MSG, flags ? *flags : 0));
+	else
+		ret = sock_send_timed(sockobj, &msg, flags ? *flags : 0, timeout);
+	sock_hist(sockobj, HIST_BLOCKED, t1);
+	TRACE(TR_SEND, sockobj->sock, ret, (uint32_t)len);
+	/* nanomsg only takes the chunk if the send succeeded */
+	if ((ret < 0) && h) {
+		sock_lock_send(sockobj);
+		sock_freemsg(sockobj, msg, len);
+		sock_unlock_send(sockobj);
+	}
+	if (flags)
+		*flags = 0; /* unused */
+	sock_hist(sockobj, HIST_SEND, t0);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_send(objref sockref, const UHandle h, int *flags)
+{
+	return sock_send(sockref, h, flags, TIMEO_USER);
+}
+
+/* a send that waits at most timeout ms, NN_SNDTIMEO aside; -EAGAIN after */
+EXPORT int lvnanomsg_send_timeout(objref sockref, const UHandle h, int *flags,
+				  long timeout)
+{
+	int ret, f = flags ? (*flags & ~NN_DONTWAIT) : 0;
+
+	if (timeout < 0)
+		timeout = -1;
+	ret = sock_send(sockref, h, &f, (int)timeout);
+
+	return (ret == -ETIMEDOUT) ? -EAGAIN : ret;
+}
+
+EXPORT int lvnanomsg_send_multi(objref sockref, char** h, int *flags)
+{
+	int ret = 0, n;
+	char ***ptr = (char***)LVALIGN(*h + 4);
+	sock_obj *sockobj;
+	CHECK_SOCK(sockobj, sockref);
+
+	for (n = *(u32*)*h; n > 0; ++ptr, --n) {
+		/* locking is inside here */
+		ret = lvnanomsg_send(sockref, (UHandle)*ptr, flags);
+		if (ret < 0)
+			break;
+	}
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * BATCHED SEND
+ * send the messages packed back to back in byte array h, with their
+ * lengths in the I32 array lens, under a single socket check; each goes
+ * the way of a single send (conflation, LVC stamps, delta encoding,
+ * compression), and the send lock is only held to take and return
+ * chunks, never across a send that may block; stops at the first
+ * failure (e.g. EAGAIN with NN_DONTWAIT once the send buffer fills) and
+ * reports how many messages were accepted in *nsent
+ */
+EXPORT int lvnanomsg_send_batch(objref sockref, const UHandle h,
+				const UHandle lens, int *flags, int *nsent)
+{
+	int ret = 0, i, n, f;
+	uint64_t t0, t1;
+	size_t pos, total, mlen;
+	const char *src;
+	const int32_t *len;
+	void *msg;
+	sock_obj *sockobj;
+
+	if (nsent)
+		*nsent = 0;
+	n = *(int32_t*)*lens;
+	len = (const int32_t*)(*lens + 4);
+	src = *h + 4;
+	total = *(u32*)*h;
+	f = flags ? *flags : 0;
+
+	/* make sure the length table describes the buffer before sending anything */
+	for (i = 0, pos = 0; i < n; ++i) {
+		if (len[i] < 0)
+			return -EINVAL;
+		pos += len[i];
+	}
+	if (pos > total)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	t0 = HIST_START(sockobj);
+
+	for (i = 0, pos = 0; i < n; pos += len[i++]) {
+		sock_lock_send(sockobj);
+		msg = sock_allocmsg(sockobj, len[i]);
+		if (msg)
+			sockobj->lvstats[LVSTAT_SEND_COPIED - LVSTAT_BASE] += len[i];
+		sock_unlock_send(sockobj);
+		if (msg == NULL) {
+			ret = -ENOBUFS;
+			break;
+		}
+		memcpy(msg, src + pos, len[i]);
+		mlen = len[i];
+		if (sock_conflate(sockobj, msg, mlen) == 0)
+			continue;	/* staged for the pacing thread */
+		if (sock_stamp(sockobj, &msg, &mlen) < 0) {
+			ret = -ENOBUFS;
+			break;
+		}
+		sock_delta(sockobj, &msg, &mlen);
+		sock_deflate(sockobj, &msg, &mlen);
+		/* may block, so no lock is held */
+		t1 = t0 ? clock_ns() : 0;
+		ret = RET0(nn_send(sockobj->sock, &msg, NN_MSG, f));
+		sock_hist(sockobj, HIST_BLOCKED, t1);
+		if (ret < 0) {
+			sock_lock_send(sockobj);
+			sock_freemsg(sockobj, msg, mlen);
+			sock_unlock_send(sockobj);
+			break;
+		}
+	}
+	TRACE(TR_SEND_BATCH, sockobj->sock, ret ? ret : i, (uint32_t)pos);
+	if (nsent)
+		*nsent = i;
+	if (flags)
+		*flags = 0; /* unused */
+	sock_hist(sockobj, HIST_SEND, t0);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * SEND POOL
+ * give the socket a reserve of pre-allocated chunks in n size classes;
+ * n = 0 removes the pool again
+ */
+EXPORT int lvnanomsg_pool_configure(objref sockref, const uint32_t *sizes,
+				    const uint32_t *counts, int n)
+{
+	msgpool *pool = NULL;
+	sock_obj *sockobj;
+
+	if ((n < 0) || (n > MSGPOOL_MAX_CLASSES))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if ((n > 0) && !(pool = msgpool_init(sizes, counts, n))) {
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+
+	sock_lock_send(sockobj);
+	msgpool_free(sockobj->pool);
+	sockobj->pool = pool;
+	sock_unlock_send(sockobj);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/* top the pool back up; call this from a loop that can afford allocation */
+EXPORT int lvnanomsg_pool_refill(objref sockref, int *nalloc)
+{
+	int n = 0;
+	sock_obj *sockobj;
+
+	CHECK_SOCK(sockobj, sockref);
+	sock_lock_send(sockobj);
+	if (sockobj->pool)
+		n = msgpool_refill(sockobj->pool);
+	sock_unlock_send(sockobj);
+	objtable_put(sockref);
+	if (nalloc)
+		*nalloc = n;
+
+	return 0;
+}
+
+/*
+ * HANDLE POOL
+ * keep up to nmax of the string handles LabVIEW gives back through
+ * handles_release, for recv_multi, recvmsg and the monitor to refill
+ * instead of allocating new ones; nmax = 0 removes the pool again
+ */
+EXPORT int lvnanomsg_handles_configure(objref sockref, int nmax)
+{
+	hpool *pool = NULL, *old;
+	sock_obj *sockobj;
+
+	if (nmax < 0)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if ((nmax > 0) && !(pool = hpool_init(nmax))) {
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+
+	sock_lock_recv(sockobj);
+	old = sockobj->hpool;
+	sockobj->hpool = pool;
+	sock_unlock_recv(sockobj);
+	objtable_put(sockref);
+	hpool_free(old);
+
+	return 0;
+}
+
+/* hand back the strings of an array from recv_multi or recvmsg, leaving it empty */
+EXPORT int lvnanomsg_handles_release(objref sockref, UHandle h)
+{
+	UHandle *elem;
+	u32 i, n;
+	sock_obj *sockobj;
+
+	if (!h || !*h)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	n = *(u32*)*h;
+	elem = (UHandle*)LVALIGN(*h + 4);
+
+	sock_lock_recv(sockobj);
+	for (i = 0; i < n; ++i) {
+		if (hpool_put(sockobj->hpool, elem[i]) == 0)
+			++sockobj->lvstats[LVSTAT_HANDLES_RETURNED - LVSTAT_BASE];
+		elem[i] = NULL;
+	}
+	sock_unlock_recv(sockobj);
+	objtable_put(sockref);
+	*(u32*)*h = 0;
+
+	return 0;
+}
+
+/*
+ * COMPRESSION
+ * payloads of at least threshold bytes go out LZ-compressed (lzc.h)
+ * behind a short header, whenever that makes them smaller; the socket
+ * then also inflates whatever arrives with that header and passes the
+ * rest through untouched, so it can still take raw messages from peers
+ * that do not compress; threshold 0 turns it off again
+ */
+EXPORT int lvnanomsg_compress_configure(objref sockref, int threshold)
+{
+	sock_obj *sockobj;
+
+	if (threshold < 0)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	atomic_set(&sockobj->zipmin, threshold);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * DELTA ENCODING
+ * for publishers that resend slowly changing state: messages are keyed
+ * by their first topiclen bytes and, per topic, go out as a keyframe at
+ * least every keyframe messages and as XOR deltas against the previous
+ * one in between (see delta.h); the same call on the subscriber makes
+ * it rebuild them, dropping deltas until it has a keyframe to apply
+ * them to; keyframe = 0 turns it off
+ */
+EXPORT int lvnanomsg_delta_configure(objref sockref, int topiclen, int keyframe)
+{
+	delta_table *tx = NULL, *rx = NULL, *old;
+	sock_obj *sockobj;
+
+	if ((topiclen < 0) || (keyframe < 0))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if (keyframe > 0) {
+		tx = delta_init(topiclen, keyframe);
+		rx = delta_init(topiclen, keyframe);
+		if (!tx || !rx) {
+			delta_free(tx);
+			delta_free(rx);
+			objtable_put(sockref);
+			return -ENOMEM;
+		}
+	}
+
+	sock_lock_send(sockobj);
+	old = sockobj->dtx;
+	sockobj->dtx = tx;
+	sock_unlock_send(sockobj);
+	delta_free(old);
+	sock_lock_recv(sockobj);
+	old = sockobj->drx;
+	sockobj->drx = rx;
+	sock_unlock_recv(sockobj);
+	objtable_put(sockref);
+	delta_free(old);
+
+	return 0;
+}
+
+/*
+ * CONFLATION
+ * for publishers producing faster than some subscribers can take: with
+ * rate > 0, lvnanomsg_send no longer sends but stages each message as
+ * the latest of its topic (its first topiclen bytes, see conflate.h),
+ * replacing whatever that topic still had waiting; one pacing thread
+ * sends each socket's staged messages rate times a second, so the
+ * bandwidth is bounded by the number of topics instead of the producer,
+ * and delta encoding and compression apply to what actually goes out;
+ * messages shorter than a topic are sent straight away; rate = 0
+ * sends what is staged and turns it off again
+ */
+#define PACE_MAX_RATE	1000	/* flushes per second, at millisecond sleeps */
+#define PACE_IDLE_MS	50	/* longest sleep, so new sockets are picked up */
+
+static lock_t pacelock;		/* protects the pacer and every socket's pacing */
+static objref *paced = NULL;	/* sockets being paced */
+static int npaced = 0, maxpaced = 0;
+static thread_t pacethread;
+static volatile int pacerunning = 0;
+
+/*
+ * send what was staged in map, at most one message per topic; a failed
+ * send stops the flush, the topic's next value takes another go at the
+ * next tick; call with pacelock held
+ */
+static void pace_flush(sock_obj *sockobj, conflate_map *map)
+{
+	int n, ret;
+	size_t len;
+	void *msg;
+
+	sock_lock_send(sockobj);
+	n = map->pending;
+	sock_unlock_send(sockobj);
+	while (n-- > 0) {
+		sock_lock_send(sockobj);
+		ret = conflate_take(map, &msg, &len);
+		sock_unlock_send(sockobj);
+		if (!ret)
+			break;
+		if (sock_stamp(sockobj, &msg, &len) < 0) {
+			sock_lock_send(sockobj);
+			++sockobj->lvstats[LVSTAT_PACE_FAILED - LVSTAT_BASE];
+			sock_unlock_send(sockobj);
+			break;
+		}
+		sock_delta(sockobj, &msg, &len);
+		sock_deflate(sockobj, &msg, &len);
+		ret = RET0(nn_send(sockobj->sock, &msg, NN_MSG, NN_DONTWAIT));
+		TRACE(TR_SEND, sockobj->sock, ret, (uint32_t)len);
+		if (ret >= 0) {
+			atomic_add64(&sockobj->lvstats[LVSTAT_PACED - LVSTAT_BASE], 1);
+			continue;
+		}
+		sock_lock_send(sockobj);
+		sock_freemsg(sockobj, msg, len);
+		++sockobj->lvstats[LVSTAT_PACE_FAILED - LVSTAT_BASE];
+		sock_unlock_send(sockobj);
+		break;
+	}
+}
+
+static THREAD_PROC(pace_thread, arg)
+{
+	int i, ms;
+	uint64_t now, next;
+	sock_obj *sockobj;
+
+	while (pacerunning) {
+		lock_enter(&pacelock);
+		now = clock_us();
+		next = now + PACE_IDLE_MS * 1000;
+		for (i = 0; i < npaced; ++i) {
+			if (!(sockobj = objtable_get(paced[i], OBJ_SOCK))) {
+				paced[i--] = paced[--npaced];	/* closed meanwhile */
+				continue;
+			}
+			if (now >= sockobj->cfldue_us) {
+				pace_flush(sockobj, sockobj->cfl);
+				/* keep the cadence, but do not catch up after a stall */
+				sockobj->cfldue_us += sockobj->cflperiod_us;
+				if (sockobj->cfldue_us <= now)
+					sockobj->cfldue_us = now + sockobj->cflperiod_us;
+			}
+			if (sockobj->cfldue_us < next)
+				next = sockobj->cfldue_us;
+			objtable_put(paced[i]);
+		}
+		lock_leave(&pacelock);
+		now = clock_us();
+		ms = (next > now) ? (int)((next - now + 999) / 1000) : 0;
+		if (ms > 0)
+			thread_sleep(ms);
+	}
+	THREAD_RETURN;
+}
+
+/* stop pacing a socket and send what it has staged; call with pacelock held */
+static void pace_drop(sock_obj *sockobj)
+{
+	int i;
+	size_t len;
+	void *msg;
+	conflate_map *map;
+
+	for (i = 0; i < npaced; ++i) {
+		if (paced[i] == sockobj->ref) {
+			paced[i] = paced[--npaced];
+			break;
+		}
+	}
+	sock_lock_send(sockobj);
+	map = sockobj->cfl;
+	sockobj->cfl = NULL;	/* sends go straight out from here on */
+	sock_unlock_send(sockobj);
+	if (!map)
+		return;
+	pace_flush(sockobj, map);
+	/* whatever the flush could not send */
+	sock_lock_send(sockobj);
+	while (conflate_take(map, &msg, &len))
+		sock_freemsg(sockobj, msg, len);
+	sock_unlock_send(sockobj);
+	conflate_free(map);
+}
+
+static void pace_unregister(sock_obj *sockobj)
+{
+	/* unlocked peek; most sockets never conflate */
+	if (!sockobj->cfl)
+		return;
+	lock_enter(&pacelock);
+	pace_drop(sockobj);
+	lock_leave(&pacelock);
+}
+
+/* stop and join the pacing thread; staged messages die with their sockets */
+static void pace_stop(void)
+{
+	lock_enter(&pacelock);
+	if (pacerunning) {
+		pacerunning = 0;
+		lock_leave(&pacelock);
+		thread_join(pacethread);
+		lock_enter(&pacelock);
+	}
+	free(paced);
+	paced = NULL;
+	npaced = maxpaced = 0;
+	lock_leave(&pacelock);
+}
+
+/* lvnanomsg_conflate_configure, with the socket held */
+static int pace_configure(sock_obj *sockobj, int topiclen, int rate)
+{
+	objref *regs;
+	conflate_map *map;
+
+	if (rate > PACE_MAX_RATE)
+		rate = PACE_MAX_RATE;
+
+	lock_enter(&pacelock);
+	pace_drop(sockobj);
+	if (rate == 0) {
+		lock_leave(&pacelock);
+		return 0;
+	}
+	if (npaced >= maxpaced) {
+		regs = realloc(paced, (maxpaced + 16) * sizeof(objref));
+		if (!regs) {
+			lock_leave(&pacelock);
+			return -ENOMEM;
+		}
+		paced = regs;
+		maxpaced += 16;
+	}
+	if (!(map = conflate_init(topiclen))) {
+		lock_leave(&pacelock);
+		return -ENOMEM;
+	}
+	if (!pacerunning) {
+		pacerunning = 1;
+		if (thread_create(&pacethread, pace_thread, NULL) != 0) {
+			pacerunning = 0;
+			lock_leave(&pacelock);
+			conflate_free(map);
+			return -ENOMEM;
+		}
+		DEBUGMSG("PACER started");
+	}
+	sockobj->cflperiod_us = 1000000 / rate;
+	sockobj->cfldue_us = clock_us() + sockobj->cflperiod_us;
+	paced[npaced++] = sockobj->ref;
+	sock_lock_send(sockobj);
+	sockobj->cfl = map;
+	sock_unlock_send(sockobj);
+	lock_leave(&pacelock);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_conflate_configure(objref sockref, int topiclen, int rate)
+{
+	int ret;
+	sock_obj *sockobj;
+
+	if ((topiclen < 0) || (rate < 0))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	ret = pace_configure(sockobj, topiclen, rate);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * LAST-VALUE CACHE
+ * so that a subscriber starting late does not sit blank until every
+ * topic is published again: lvc_attach makes a publisher keep the
+ * latest message of each topic (its first topiclen bytes, see lvc.h)
+ * and answer snapshot requests on a REP socket bound to addr from a
+ * thread of its own; the request is a topic prefix, empty for all of them
+ *
+ * a subscriber connects and subscribes as usual, then lvc_sync fetches
+ * a snapshot into an array of strings
+ *
+ * what goes out on the publisher itself is left as it is, so that plain
+ * subscribers and other nanomsg peers see no difference; only with
+ * LVC_ATTACH_STAMP does it put a per-topic sequence number after the
+ * topic of every message, and then every subscriber must lvc_sync
+ * before it receives, as it would see the stamps otherwise; snapshots
+ * say whether the live messages are stamped, and if so the receives
+ * on a synced subscriber strip the stamps and drop whatever live
+ * message the snapshot already covered, so snapshot and stream join
+ * without a gap or a duplicate
+ */
+#define LVC_POLL_MS	100	/* how soon the snapshot thread notices a detach */
+#define LVC_ATTACH_STAMP	0x01	/* stamp the live messages, see above */
+
+static THREAD_PROC(lvc_thread, arg)
+{
+	int n;
+	size_t size;
+	void *req, *reply;
+	lvcsvc *svc = arg;
+
+	while (svc->running) {
+		/* times out now and then to look at running */
+		if ((n = nn_recv(svc->rep, &req, NN_MSG, 0)) < 0) {
+			if (nn_errno() == ETERM)
+				break;
+			continue;
+		}
+		lock_enter(&svc->lock);
+		size = lvc_snapshot_size(svc->cache, req, n);
+		if ((reply = nn_allocmsg(size, 0)))
+			lvc_snapshot(svc->cache, req, n, reply);
+		lock_leave(&svc->lock);
+		nn_freemsg(req);
+		if (!reply) {
+			/* an empty reply tells the client we ran out of memory */
+			nn_send(svc->rep, "", 0, 0);
+			continue;
+		}
+		if (nn_send(svc->rep, &reply, NN_MSG, 0) < 0)
+			nn_freemsg(reply);
+		else
+			atomic_add64(&svc->sockobj->lvstats[LVSTAT_LVC_SNAPSHOTS - LVSTAT_BASE], 1);
+	}
+	THREAD_RETURN;
+}
+
+/* stop the snapshot thread and release the cache */
+static void lvc_shutdown(lvcsvc *svc)
+{
+	if (!svc)
+		return;
+	if (svc->running) {
+		svc->running = 0;
+		thread_join(svc->thread);
+	}
+	if (svc->rep >= 0)
+		nn_close(svc->rep);
+	lvc_free(svc->cache);
+	lock_destroy(&svc->lock);
+	free(svc);
+}
+
+static void sock_lvc_detach(sock_obj *sockobj)
+{
+	lvcsvc *svc;
+
+	sock_lock_send(sockobj);
+	svc = sockobj->lvc;
+	sockobj->lvc = NULL;
+	sock_unlock_send(sockobj);
+	lvc_shutdown(svc);
+}
+
+EXPORT int lvnanomsg_lvc_detach(objref sockref)
+{
+	sock_obj *sockobj;
+
+	CHECK_SOCK(sockobj, sockref);
+	sock_lvc_detach(sockobj);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/* lvnanomsg_lvc_attach, with the socket held */
+static int sock_lvc_attach(sock_obj *sockobj, int topiclen, const char *addr,
+			   int flags)
+{
+	int ret, tmo = LVC_POLL_MS;
+	lvcsvc *svc, *old;
+
+	/* the old cache may hold on to the same address */
+	sock_lvc_detach(sockobj);
+
+	if (!(svc = calloc(sizeof(lvcsvc), 1)))
+		return -ENOMEM;
+	lock_init(&svc->lock);
+	svc->sockobj = sockobj;
+	svc->rep = -1;
+	if (!(svc->cache = lvc_init(topiclen))) {
+		lvc_shutdown(svc);
+		return -ENOMEM;
+	}
+	svc->cache->stamped = !!(flags & LVC_ATTACH_STAMP);
+	svc->rep = nn_socket(AF_SP, NN_REP);
+	if ((svc->rep < 0)
+	    || (nn_setsockopt(svc->rep, NN_SOL_SOCKET, NN_RCVTIMEO, &tmo, sizeof(tmo)) < 0)
+	    || (nn_setsockopt(svc->rep, NN_SOL_SOCKET, NN_SNDTIMEO, &tmo, sizeof(tmo)) < 0)
+	    || (nn_bind(svc->rep, addr) < 0)) {
+		ret = RET0(-1);
+		lvc_shutdown(svc);
+		return ret;
+	}
+	svc->running = 1;
+	if (thread_create(&svc->thread, lvc_thread, svc) != 0) {
+		svc->running = 0;
+		lvc_shutdown(svc);
+		return -ENOMEM;
+	}
+
+	sock_lock_send(sockobj);
+	old = sockobj->lvc;	/* only if another attach raced us */
+	sockobj->lvc = svc;
+	sock_unlock_send(sockobj);
+	lvc_shutdown(old);
+	DEBUGMSG("LVC serving %d on %s", sockobj->sock, addr);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_lvc_attach(objref sockref, int topiclen, const char *addr,
+				int flags)
+{
+	int ret;
+	sock_obj *sockobj;
+
+	if ((topiclen < 0) || !addr || (flags & ~LVC_ATTACH_STAMP))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	ret = sock_lvc_attach(sockobj, topiclen, addr, flags);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/* lvnanomsg_lvc_sync, with the socket held */
+static int sock_lvc_sync(sock_obj *sockobj, int topiclen, const char *addr,
+			 const char *prefix, int timeout, char **h)
+{
+	int ret, req, n, stamped;
+	size_t pos = 0, mlen;
+	uint32_t seq;
+	const void *entry;
+	void *snap;
+	UHandle ptr;
+	bonzai *list;
+	lvc_table *rx, *old;
+
+	if (!(rx = lvc_init(topiclen)))
+		return -ENOMEM;
+	/* a one-off REQ socket of our own, never seen by LabVIEW */
+	if ((req = nn_socket(AF_SP, NN_REQ)) < 0) {
+		lvc_free(rx);
+		return RET0(req);
+	}
+	if ((nn_setsockopt(req, NN_SOL_SOCKET, NN_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+	    || (nn_setsockopt(req, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+	    || (nn_connect(req, addr) < 0)
+	    || (nn_send(req, prefix ? prefix : "", prefix ? strlen(prefix) : 0, 0) < 0)
+	    || ((n = nn_recv(req, &snap, NN_MSG, 0)) < 0)) {
+		ret = RET0(-1);
+		nn_close(req);
+		lvc_free(rx);
+		return ret;
+	}
+	nn_close(req);
+	if (n == 0) {
+		nn_freemsg(snap);
+		lvc_free(rx);
+		return -ENOBUFS;
+	}
+
+	stamped = lvc_snapshot_stamped(snap, n);
+	list = bonzai_init(NULL);
+	while ((ret = lvc_snapshot_next(snap, n, &pos, &seq, &entry, &mlen)) > 0) {
+		lvc_seen(rx, entry, mlen, seq);
+		ptr = sock_newhandle(sockobj, mlen + 4);
+		if (!ptr) {
+			ret = -ENOBUFS;
+			break;
+		}
+		*(u32*)*ptr = (u32)mlen;
+		memcpy(*ptr + 4, entry, mlen);
+		sockobj->lvstats[LVSTAT_RECV_COPIED - LVSTAT_BASE] += mlen;
+		bonzai_grow(list, (void*)ptr);
+	}
+	nn_freemsg(snap);
+	if (ret < 0) {
+		while (list->n > 0)
+			DSDisposeHandle(list->elem[--list->n]);
+		bonzai_free(list);
+		lvc_free(rx);
+		return (ret == -1) ? -EPROTO : ret;
+	}
+
+	/* turn stack into compatible array of handles */
+	n = list->n;
+	DSSetHandleSize(h, 8 + n * sizeof(void*));
+	memcpy(LVALIGN(*h + 4), list->elem, n * sizeof(void*));
+	*(u32*)*h = n;
+	bonzai_free(list);
+
+	/*
+	 * from here on, live messages the snapshot covered are dropped; but
+	 * only stamps tell which they are, and the stamps need stripping
+	 */
+	if (!stamped) {
+		lvc_free(rx);
+		rx = NULL;
+	}
+	sock_lock_recv(sockobj);
+	old = sockobj->lvrx;
+	sockobj->lvrx = rx;
+	sock_unlock_recv(sockobj);
+	lvc_free(old);
+
+	return n;
+}
+
+EXPORT int lvnanomsg_lvc_sync(objref sockref, int topiclen, const char *addr,
+			      const char *prefix, int timeout, char **h)
+{
+	int ret;
+	sock_obj *sockobj;
+
+	if ((topiclen < 0) || !addr)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	ret = sock_lvc_sync(sockobj, topiclen, addr, prefix, timeout, h);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * TIMING HISTOGRAMS
+ * log2-bucketed histograms (see histo.h) of how long the send and receive
+ * calls take, how much of that is spent blocked inside nanomsg and how
+ * long they waited for a side lock; off by default, and two clock reads
+ * per call once switched on
+ */
+EXPORT int lvnanomsg_histogram_enable(objref sockref, int enable)
+{
+	histo *hist = NULL;
+	sock_obj *sockobj;
+
+	CHECK_SOCK(sockobj, sockref);
+	if (enable && !sockobj->hist) {
+		if (!(hist = calloc(HIST_COUNT, sizeof(histo)))) {
+			objtable_put(sockref);
+			return -ENOMEM;
+		}
+		/* kept until the socket goes, so a call in flight never loses it */
+		sock_lock_send(sockobj);
+		sock_lock_recv(sockobj);
+		if (!sockobj->hist) {
+			sockobj->hist = hist;
+			hist = NULL;
+		}
+		sock_unlock_recv(sockobj);
+		sock_unlock_send(sockobj);
+		free(hist);
+	}
+	atomic_set(&sockobj->histon, enable ? 1 : 0);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/* snapshot of one histogram; returns the number of buckets it has */
+EXPORT int lvnanomsg_histogram_read(objref sockref, int kind, uint64_t *counts,
+				    int nbuckets, uint64_t *n, uint64_t *sum,
+				    uint64_t *max)
+{
+	int i;
+	histo *hist;
+	sock_obj *sockobj;
+
+	if ((kind < 0) || (kind >= HIST_COUNT))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if (nbuckets > HISTO_BUCKETS)
+		nbuckets = HISTO_BUCKETS;
+	hist = sockobj->hist ? &sockobj->hist[kind] : NULL;
+	for (i = 0; i < nbuckets; ++i)
+		counts[i] = hist ? hist->count[i] : 0;
+	if (n)
+		*n = hist ? hist->n : 0;
+	if (sum)
+		*sum = hist ? hist->sum : 0;
+	if (max)
+		*max = hist ? hist->max : 0;
+	objtable_put(sockref);
+
+	return HISTO_BUCKETS;
+}
+
+/* clear one histogram, or all of them if kind < 0 */
+EXPORT int lvnanomsg_histogram_reset(objref sockref, int kind)
+{
+	int i;
+	sock_obj *sockobj;
+
+	if (kind >= HIST_COUNT)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	for (i = 0; sockobj->hist && (i < HIST_COUNT); ++i) {
+		if ((kind < 0) || (kind == i))
+			histo_reset(&sockobj->hist[i]);
+	}
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/* blocks the calling thread for good; see DEVICE SERVICE for a managed one */
+EXPORT int lvnanomsg_device(objref sockref1, objref sockref2)
+{
+	int ret;
+	int s1, s2;
+	sock_obj *sockobj1, *sockobj2;
+
+	if (!(sockobj1 = sock_get(sockref1)))
+		return -ENOTSOCK;
+	if (!(sockobj2 = sock_get(sockref2))) {
+		objtable_put(sockref1);
+		return -ENOTSOCK;
+	}
+	s1 = sockobj1->sock;
+	s2 = sockobj2->sock;
+
+	ret = RET0(nn_device(s1, s2));
+	objtable_put(sockref2);
+	objtable_put(sockref1);
+
+	return ret;
+}
+
+/*
+ * DEVICE SERVICE
+ * forwarders on background threads instead of nn_device on the caller's:
+ * device_start returns a reference that device_stop ends, and forwards
+ * in each direction the pair of sockets allows (the source can receive,
+ * the destination send); every wakeup forwards a batch of up to
+ * DEVICE_BATCH messages as zero-copy chunks, passed through untouched
+ * along with their SP headers, so raw REQ/REP and SURVEYOR/RESPONDENT
+ * pairs route their replies back as they do through nn_device
+ *
+ * each direction counts what it forwarded, dropped and filtered out, can
+ * be limited to messages starting with one of a set of topic prefixes,
+ * and every Nth message forwarded can be copied to a tap socket; the
+ * destination is sent to without waiting and a message it will not take
+ * is dropped, unless DEVICE_LOSSLESS asks to wait on its NN_SNDFD until
+ * it does
+ */
+#define DEVICE_BATCH		64	/* messages forwarded per wakeup */
+#define DEVICE_POLL_MS		100	/* how soon a forwarder notices a stop */
+#define DEVICE_LOSSLESS		1	/* flag: wait for a full destination */
+
+typedef struct {
+	uint8_t *prefix;
+	size_t len;
+} devfilter;
+
+typedef struct device_obj device_obj;
+
+typedef struct {
+	device_obj *dev;
+	objref from, to;
+	thread_t thread;
+	int started;
+	devfilter *filters;	/* under dev->lock; none forwards everything */
+	int nfilters;
+	uint32_t tapcount;	/* touched by the forwarder only */
+	/* statistics, added to by the forwarder once per batch */
+	uint64_t msgs, bytes, dropped, filtered, sampled;
+	void *batch[DEVICE_BATCH];
+	void *ctrl[DEVICE_BATCH];	/* their SP headers, NN_MSG chunks */
+	int lens[DEVICE_BATCH];
+	char keep[DEVICE_BATCH];
+} devdir;
+
+struct device_obj {
+	lock_t lock;		/* guards the filters and the tap */
+	devdir dirs[2];		/* 0 forwards the first socket to the second */
+	volatile int running;
+	int flags;
+	objref tap;		/* 0 if none */
+	int tapevery;
+	objref ref;
+};
+
+static bonzai *devices = NULL;	/* running devices, stopped on unload */
+static lock_t devlock;
+
+/* does a message pass the direction's filters; call with dev->lock held */
+static int device_match(devdir *d, const void *msg, int len)
+{
+	int i;
+
+	if (d->nfilters == 0)
+		return 1;
+	for (i = 0; i < d->nfilters; ++i) {
+		if (((size_t)len >= d->filters[i].len)
+		    && !memcmp(msg, d->filters[i].prefix, d->filters[i].len))
+			return 1;
+	}
+	return 0;
+}
+
+/* receive or send a message along with its header chunk, without waiting */
+static int device_xfer(int sock, void **body, void **ctrl, int send)
+{
+	int ret;
+	struct nn_iovec iov;
+	struct nn_msghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = body;
+	iov.iov_len = NN_MSG;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = ctrl;
+	hdr.msg_controllen = NN_MSG;
+	if (!send)
+		return nn_recvmsg(sock, &hdr, NN_DONTWAIT);
+	ret = nn_sendmsg(sock, &hdr, NN_DONTWAIT);
+	if (ret >= 0)
+		*ctrl = NULL;	/* nanomsg took the header too */
+	return ret;
+}
+
+static void device_drop(void *body, void *ctrl)
+{
+	nn_freemsg(body);
+	if (ctrl)
+		nn_freemsg(ctrl);
+}
+
+/*
+ * send a message on; a full destination drops it unless DEVICE_LOSSLESS,
+ * which waits on its NN_SNDFD instead; < 0 if it is still ours
+ */
+static int device_send(device_obj *dev, sock_obj *dst, void **body, void **ctrl)
+{
+	int ret, err;
+	struct nn_pollfd pfd;
+
+	for (;;) {
+		/* under the lock a close marks the socket gone under */
+		sock_lock_send(dst);
+		pfd.fd = dst->sock;
+		ret = (pfd.fd >= 0) ? device_xfer(pfd.fd, body, ctrl, 1) : -1;
+		err = (pfd.fd >= 0) ? nn_errno() : EBADF;
+		sock_unlock_send(dst);
+		if ((ret >= 0) || (err != EAGAIN)
+		    || !(dev->flags & DEVICE_LOSSLESS) || !dev->running)
+			return ret;
+		pfd.events = NN_POLLOUT;
+		pfd.revents = 0;
+		nn_poll(&pfd, 1, DEVICE_POLL_MS);
+	}
+}
+
+/* forward one batch from src to dst; < 0 once src is gone */
+static int device_pass(devdir *d, sock_obj *src, sock_obj *dst)
+{
+	int i, n, ret, every;
+	uint32_t sampled, dropped, filtered, msgs;
+	uint64_t bytes;
+	void *copy;
+	objref tapref;
+	struct nn_pollfd pfd;
+	device_obj *dev = d->dev;
+	sock_obj *tap;
+
+	if ((pfd.fd = src->sock) < 0)
+		return -1;
+	pfd.events = NN_POLLIN;
+	pfd.revents = 0;
+	/* no timeout on the caller's socket is touched */
+	if ((ret = nn_poll(&pfd, 1, DEVICE_POLL_MS)) <= 0)
+		return ((ret < 0) && (nn_errno() != EINTR)) ? -1 : 0;
+	/* the socket may have been closed during the poll, so look again */
+	sock_lock_recv(src);
+	for (n = 0; (n < DEVICE_BATCH) && (src->sock >= 0); ++n) {
+		d->ctrl[n] = NULL;
+		ret = device_xfer(src->sock, &d->batch[n], &d->ctrl[n], 0);
+		if (ret < 0)
+			break;
+		d->lens[n] = ret;
+	}
+	sock_unlock_recv(src);
+	if (n == 0)
+		return 0;	/* the next pass finds out if it was closed */
+
+	lock_enter(&dev->lock);
+	for (i = 0; i < n; ++i)
+		d->keep[i] = (char)device_match(d, d->batch[i], d->lens[i]);
+	tapref = dev->tap;
+	every = dev->tapevery;
+	lock_leave(&dev->lock);
+	tap = (tapref && every) ? objtable_get(tapref, OBJ_SOCK) : NULL;
+
+	sampled = dropped = filtered = msgs = 0;
+	bytes = 0;
+	for (i = 0; i < n; ++i) {
+		if (!d->keep[i]) {
+			device_drop(d->batch[i], d->ctrl[i]);
+			++filtered;
+			continue;
+		}
+		if (tap && (++d->tapcount >= (uint32_t)every)) {
+			d->tapcount = 0;
+			if ((copy = nn_allocmsg(d->lens[i], 0))) {
+				memcpy(copy, d->batch[i], d->lens[i]);
+				sock_lock_send(tap);
+				ret = (tap->sock >= 0) ? nn_send(tap->sock, &copy, NN_MSG, NN_DONTWAIT) : -1;
+				sock_unlock_send(tap);
+				if (ret < 0)
+					nn_freemsg(copy);
+				else
+					++sampled;
+			}
+		}
+		if (device_send(dev, dst, &d->batch[i], &d->ctrl[i]) < 0) {
+			device_drop(d->batch[i], d->ctrl[i]);
+			++dropped;
+			continue;
+		}
+		++msgs;
+		bytes += d->lens[i];
+	}
+	atomic_add64(&d->msgs, msgs);
+	atomic_add64(&d->bytes, bytes);
+	atomic_add64(&d->dropped, dropped);
+	atomic_add64(&d->filtered, filtered);
+	atomic_add64(&d->sampled, sampled);
+	if (tap)
+		objtable_put(tapref);
+
+	return 0;
+}
+
+static THREAD_PROC(device_thread, arg)
+{
+	int ret;
+	devdir *d = arg;
+	sock_obj *src, *dst;
+
+	while (d->dev->running) {
+		/* both sockets stay the caller's, who may close them under us */
+		if (!(src = objtable_get(d->from, OBJ_SOCK)))
+			break;
+		if (!(dst = objtable_get(d->to, OBJ_SOCK))) {
+			objtable_put(d->from);
+			break;
+		}
+		ret = device_pass(d, src, dst);
+		objtable_put(d->to);
+		objtable_put(d->from);
+		if (ret < 0)
+			break;
+	}
+	THREAD_RETURN;
+}
+
+/* can messages go from one socket to the other */
+static int device_canforward(int from, int to)
+{
+	int fd;
+	size_t sz = sizeof(fd);
+
+	/* send-only and receive-only protocols lack one of the descriptors */
+	if (nn_getsockopt(from, NN_SOL_SOCKET, NN_RCVFD, &fd, &sz) < 0)
+		return 0;
+	sz = sizeof(fd);
+	return nn_getsockopt(to, NN_SOL_SOCKET, NN_SNDFD, &fd, &sz) == 0;
+}
+
+static void device_free(device_obj *dev)
+{
+	int i;
+
+	dev->running = 0;
+	for (i = 0; i < 2; ++i) {
+		if (dev->dirs[i].started)
+			thread_join(dev->dirs[i].thread);
+		while (dev->dirs[i].nfilters > 0)
+			free(dev->dirs[i].filters[--dev->dirs[i].nfilters].prefix);
+		free(dev->dirs[i].filters);
+	}
+	lock_destroy(&dev->lock);
+	free(dev);
+}
+
+EXPORT int lvnanomsg_device_start(objref sockref1, objref sockref2, int flags,
+				  objref *devref)
+{
+	int i, ret = 0;
+	device_obj *dev;
+	sock_obj *sockobj1, *sockobj2;
+
+	*devref = 0;
+	if (!(sockobj1 = sock_get(sockref1)))
+		return -ENOTSOCK;
+	if (!(sockobj2 = sock_get(sockref2))) {
+		objtable_put(sockref1);
+		return -ENOTSOCK;
+	}
+	if (!(dev = calloc(sizeof(device_obj), 1))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	lock_init(&dev->lock);
+	dev->flags = flags;
+	dev->running = 1;
+	dev->dirs[0].from = dev->dirs[1].to = sockref1;
+	dev->dirs[0].to = dev->dirs[1].from = sockref2;
+	for (i = 0; i < 2; ++i) {
+		dev->dirs[i].dev = dev;
+		if (!device_canforward(i ? sockobj2->sock : sockobj1->sock,
+				       i ? sockobj1->sock : sockobj2->sock))
+			continue;
+		if (thread_create(&dev->dirs[i].thread, device_thread, &dev->dirs[i]) != 0) {
+			device_free(dev);
+			ret = -ENOMEM;
+			goto out;
+		}
+		dev->dirs[i].started = 1;
+	}
+	if (!dev->dirs[0].started && !dev->dirs[1].started) {
+		device_free(dev);
+		ret = -EINVAL;	/* nothing can flow either way */
+		goto out;
+	}
+	if (!(dev->ref = objtable_add(dev, OBJ_DEVICE))) {
+		device_free(dev);
+		ret = -EMFILE;
+		goto out;
+	}
+	lock_enter(&devlock);
+	bonzai_grow(devices, dev);
+	lock_leave(&devlock);
+	DEBUGMSG("DEVICE %d <-> %d started (%i/%i)", sockobj1->sock,
+		 sockobj2->sock, dev->dirs[0].started, dev->dirs[1].started);
+	*devref = dev->ref;
+out:
+	objtable_put(sockref2);
+	objtable_put(sockref1);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_device_stop(objref devref)
+{
+	device_obj *dev;
+
+	if (!(dev = objtable_get(devref, OBJ_DEVICE)))
+		return -EINVAL;
+	if (objtable_remove(devref) < 0) {
+		objtable_put(devref);
+		return -EINVAL;	/* somebody else got there first */
+	}
+	lock_enter(&devlock);
+	bonzai_clip(devices, dev);
+	lock_leave(&devlock);
+	objtable_put(devref);	/* device_free, once no call holds it */
+
+	return 0;
+}
+
+/*
+ * forward only messages starting with prefix in direction dir (0 is the
+ * first socket to the second); each call adds one, an empty or NULL
+ * prefix clears them and forwards everything again
+ */
+EXPORT int lvnanomsg_device_filter(objref devref, int dir, const char *prefix)
+{
+	size_t len = prefix ? strlen(prefix) : 0;
+	devfilter *filters;
+	devdir *d;
+	device_obj *dev;
+
+	if ((dir < 0) || (dir > 1) || !(dev = objtable_get(devref, OBJ_DEVICE)))
+		return -EINVAL;
+	d = &dev->dirs[dir];
+	lock_enter(&dev->lock);
+	if (len == 0) {
+		while (d->nfilters > 0)
+			free(d->filters[--d->nfilters].prefix);
+		lock_leave(&dev->lock);
+		objtable_put(devref);
+		return 0;
+	}
+	filters = realloc(d->filters, (d->nfilters + 1) * sizeof(devfilter));
+	if (filters)
+		d->filters = filters;
+	if (!filters || !(filters[d->nfilters].prefix = malloc(len))) {
+		lock_leave(&dev->lock);
+		objtable_put(devref);
+		return -ENOMEM;
+	}
+	memcpy(filters[d->nfilters].prefix, prefix, len);
+	filters[d->nfilters++].len = len;
+	lock_leave(&dev->lock);
+	objtable_put(devref);
+
+	return 0;
+}
+
+/* copy every Nth forwarded message to tapref without waiting; every = 0 stops */
+EXPORT int lvnanomsg_device_tap(objref devref, objref tapref, int every)
+{
+	device_obj *dev;
+	sock_obj *sockobj;
+
+	if ((every < 0) || !(dev = objtable_get(devref, OBJ_DEVICE)))
+		return -EINVAL;
+	if (every > 0) {
+		if (!(sockobj = sock_get(tapref))) {
+			objtable_put(devref);
+			return -ENOTSOCK;
+		}
+		objtable_put(tapref);	/* the forwarders look it up themselves */
+	}
+	lock_enter(&dev->lock);
+	dev->tap = every ? tapref : 0;
+	dev->tapevery = every;
+	lock_leave(&dev->lock);
+	objtable_put(devref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_device_stats(objref devref, int dir, uint64_t *msgs,
+				  uint64_t *bytes, uint64_t *dropped,
+				  uint64_t *filtered, uint64_t *sampled)
+{
+	int ret;
+	devdir *d;
+	device_obj *dev;
+
+	if ((dir < 0) || (dir > 1) || !(dev = objtable_get(devref, OBJ_DEVICE)))
+		return -EINVAL;
+	d = &dev->dirs[dir];
+	if (msgs)
+		*msgs = d->msgs;
+	if (bytes)
+		*bytes = d->bytes;
+	if (dropped)
+		*dropped = d->dropped;
+	if (filtered)
+		*filtered = d->filtered;
+	if (sampled)
+		*sampled = d->sampled;
+
+	ret = d->started ? 0 : -ENOTSUP;
+	objtable_put(devref);
+
+	return ret;
+}
+
+/* stop every device still running; call on unload only */
+static void device_stopall(void)
+{
+	int i;
+	device_obj *dev;
+
+	lock_enter(&devlock);
+	for (i = 0; i < devices->n; ++i) {
+		if ((dev = devices->elem[i])) {
+			/* and device_free, unless a call still holds it */
+			objtable_remove(dev->ref);
+		}
+	}
+	bonzai_free(devices);
+	devices = NULL;
+	lock_leave(&devlock);
+}
+
+/*
+ * DISPATCHER
+ * serves a raw REP socket (lvnanomsg_socket_raw) with several LabVIEW
+ * handler loops at once: a thread of its own receives the requests
+ * along with their routing headers and hands each to the worker with
+ * the fewest requests queued or in hand; a worker picks its requests up
+ * with dispatcher_recv, which gives it a request reference, and answers
+ * them with dispatcher_reply in whatever order it likes
+ *
+ * each worker's queue is a private inproc PAIR carrying request
+ * pointers, so waiting on it is an nn_poll with the caller's timeout;
+ * a request that finds the queue full is dropped and its client's REQ
+ * resends it in due course; per worker the time requests spent queued
+ * and in hand go into histograms (see histo.h)
+ */
+#define DISPATCH_MAX_WORKERS	64
+#define DISPATCH_BATCH		64	/* requests taken per wakeup */
+#define DISPATCH_POLL_MS	100	/* how soon the thread notices a destroy */
+
+typedef struct dispatch_obj dispatch_obj;
+
+typedef struct dreq {
+	void *ctrl;		/* routing header, handed back with the reply */
+	void *body;		/* until the worker has copied it */
+	int len;
+	int worker;
+	uint64_t t_in, t_start;	/* arrival, and pick-up by the worker */
+	dispatch_obj *disp;
+	objref ref;		/* once picked up */
+	struct dreq *prev, *next;	/* on the list of those in hand */
+} dreq;
+
+typedef struct {
+	int q_rx, q_tx;		/* inproc PAIR carrying dreq pointers */
+	atomic_t queued, inhand;
+	uint64_t served, dropped;
+	histo wait, service;	/* queued, and from pick-up to reply */
+} dworker;
+
+struct dispatch_obj {
+	objref sockref;
+	lock_t lock;		/* guards the list of requests in hand */
+	dreq *inhand;
+	dworker *workers;
+	int nworkers;
+	thread_t thread;
+	int started;
+	volatile int running;
+	atomic_t waiting;	/* worker calls inside dispatcher_recv */
+	objref ref;
+};
+
+static void dreq_free(dreq *req)
+{
+	if (req->ctrl)
+		nn_freemsg(req->ctrl);
+	if (req->body)
+		nn_freemsg(req->body);
+	free(req);
+}
+
+static THREAD_PROC(dispatch_thread, arg)
+{
+	int i, n, w;
+	void *body, *ctrl;
+	struct nn_iovec iov;
+	struct nn_msghdr hdr;
+	struct nn_pollfd pfd;
+	dispatch_obj *disp = arg;
+	sock_obj *sockobj;
+	dreq *req;
+
+	while (disp->running) {
+		if (!(sockobj = objtable_get(disp->sockref, OBJ_SOCK)))
+			break;	/* the socket was closed under us */
+		pfd.fd = sockobj->sock;
+		pfd.events = NN_POLLIN;
+		pfd.revents = 0;
+		if (nn_poll(&pfd, 1, DISPATCH_POLL_MS) <= 0) {
+			objtable_put(disp->sockref);
+			continue;
+		}
+		for (n = 0; n < DISPATCH_BATCH; ++n) {
+			memset(&hdr, 0, sizeof(hdr));
+			iov.iov_base = &body;
+			iov.iov_len = NN_MSG;
+			hdr.msg_iov = &iov;
+			hdr.msg_iovlen = 1;
+			hdr.msg_control = &ctrl;
+			hdr.msg_controllen = NN_MSG;
+			ctrl = NULL;
+			if ((i = nn_recvmsg(sockobj->sock, &hdr, NN_DONTWAIT)) < 0)
+				break;
+			if (!(req = calloc(sizeof(dreq), 1))) {
+				nn_freemsg(body);
+				if (ctrl)
+					nn_freemsg(ctrl);
+				continue;
+			}
+			req->body = body;
+			req->ctrl = ctrl;
+			req->len = i;
+			req->disp = disp;
+			req->t_in = clock_ns();
+			/* least loaded worker */
+			for (w = 0, i = 1; i < disp->nworkers; ++i) {
+				if (atomic_get(&disp->workers[i].queued) + atomic_get(&disp->workers[i].inhand)
+				    < atomic_get(&disp->workers[w].queued) + atomic_get(&disp->workers[w].inhand))
+					w = i;
+			}
+			req->worker = w;
+			atomic_inc(&disp->workers[w].queued);
+			if (nn_send(disp->workers[w].q_tx, &req, sizeof(req), NN_DONTWAIT) < 0) {
+				atomic_dec(&disp->workers[w].queued);
+				atomic_add64(&disp->workers[w].dropped, 1);
+				dreq_free(req);
+			}
+		}
+		objtable_put(disp->sockref);
+	}
+	THREAD_RETURN;
+}
+
+/* stop the thread and free everything, queued and in hand */
+static void dispatch_free(dispatch_obj *disp)
+{
+	int i;
+	dreq *req;
+
+	disp->running = 0;
+	if (disp->started)
+		thread_join(disp->thread);
+	for (i = 0; i < disp->nworkers; ++i) {
+		/* requests nobody picked up */
+		while (nn_recv(disp->workers[i].q_rx, &req, sizeof(req), NN_DONTWAIT) == sizeof(req)) {
+			if (req)
+				dreq_free(req);
+		}
+		if (disp->workers[i].q_rx >= 0)
+			nn_close(disp->workers[i].q_rx);
+		if (disp->workers[i].q_tx >= 0)
+			nn_close(disp->workers[i].q_tx);
+	}
+	while ((req = disp->inhand)) {
+		disp->inhand = req->next;
+		/* which dreq_frees it, unless a reply still holds it */
+		objtable_remove(req->ref);
+	}
+	free(disp->workers);
+	lock_destroy(&disp->lock);
+	free(disp);
+}
+
+EXPORT int lvnanomsg_dispatcher_create(objref sockref, int nworkers,
+				       objref *dispref)
+{
+	int i;
+	char addr[64];
+	dispatch_obj *disp;
+	sock_obj *sockobj;
+
+	*dispref = 0;
+	if ((nworkers <= 0) || (nworkers > DISPATCH_MAX_WORKERS))
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	if (!(disp = calloc(sizeof(dispatch_obj), 1))) {
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	lock_init(&disp->lock);
+	disp->sockref = sockref;
+	if (!(disp->workers = calloc(sizeof(dworker), nworkers))) {
+		dispatch_free(disp);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nworkers; ++i) {
+		sprintf(addr, "inproc://lvnanomsg-dispatch-%p-%i", (void*)disp, i);
+		disp->workers[i].q_rx = nn_socket(AF_SP, NN_PAIR);
+		disp->workers[i].q_tx = nn_socket(AF_SP, NN_PAIR);
+		++disp->nworkers;
+		if ((disp->workers[i].q_rx < 0) || (disp->workers[i].q_tx < 0)
+		    || (nn_bind(disp->workers[i].q_rx, addr) < 0)
+		    || (nn_connect(disp->workers[i].q_tx, addr) < 0)) {
+			dispatch_free(disp);
+			objtable_put(sockref);
+			return -ENOMEM;
+		}
+	}
+	disp->running = 1;
+	if (thread_create(&disp->thread, dispatch_thread, disp) != 0) {
+		dispatch_free(disp);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	disp->started = 1;
+	if (!(disp->ref = objtable_add(disp, OBJ_DISPATCHER))) {
+		dispatch_free(disp);
+		objtable_put(sockref);
+		return -EMFILE;
+	}
+	DEBUGMSG("DISPATCHER on %d with %i workers", sockobj->sock, nworkers);
+	*dispref = disp->ref;
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * wait up to timeout ms for the next request of a worker; its body goes
+ * into h and *reqref is what to reply to; -EAGAIN on a timeout
+ */
+EXPORT int lvnanomsg_dispatcher_recv(objref dispref, int worker, int timeout,
+				     UHandle h, objref *reqref)
+{
+	int ret;
+	struct nn_pollfd pfd;
+	dispatch_obj *disp;
+	dworker *w;
+	dreq *req;
+
+	*reqref = 0;
+	if (!(disp = objtable_get(dispref, OBJ_DISPATCHER)))
+		return -EINVAL;
+	if ((worker < 0) || (worker >= disp->nworkers)) {
+		objtable_put(dispref);
+		return -EINVAL;
+	}
+	w = &disp->workers[worker];
+	atomic_inc(&disp->waiting);
+	pfd.fd = w->q_rx;
+	pfd.events = NN_POLLIN;
+	pfd.revents = 0;
+	ret = nn_poll(&pfd, 1, timeout);
+	if (ret <= 0) {
+		ret = (ret < 0) ? RET0(ret) : -EAGAIN;
+		goto out;
+	}
+	/* another loop serving the same worker may have beaten us to it */
+	if (nn_recv(w->q_rx, &req, sizeof(req), NN_DONTWAIT) != sizeof(req)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	if (!req) {
+		ret = -EBADF;	/* woken by a destroy */
+		goto out;
+	}
+	atomic_dec(&w->queued);
+	atomic_inc(&w->inhand);
+	req->t_start = clock_ns();
+	histo_add(&w->wait, req->t_start - req->t_in);
+
+	if (DSSetHandleSize(h, req->len + 4) != mgNoErr) {
+		ret = -ENOMEM;
+	} else {
+		*(u32*)*h = req->len;
+		memcpy(*h + 4, req->body, req->len);
+		nn_freemsg(req->body);
+		req->body = NULL;
+		req->ref = objtable_add(req, OBJ_REQUEST);
+		ret = req->ref ? 0 : -EMFILE;
+	}
+	if (ret < 0) {
+		atomic_dec(&w->inhand);
+		atomic_add64(&w->dropped, 1);
+		dreq_free(req);
+		goto out;
+	}
+	lock_enter(&disp->lock);
+	req->next = disp->inhand;
+	if (req->next)
+		req->next->prev = req;
+	disp->inhand = req;
+	lock_leave(&disp->lock);
+	*reqref = req->ref;
+out:
+	atomic_dec(&disp->waiting);
+	objtable_put(dispref);
+
+	return ret;
+}
+
+/* answer a request picked up with dispatcher_recv, in any order */
+EXPORT int lvnanomsg_dispatcher_reply(objref dispref, objref reqref,
+				      const UHandle h)
+{
+	int ret;
+	uint32_t len = h ? *(u32*)*h : 0;
+	void *body;
+	struct nn_iovec iov;
+	struct nn_msghdr hdr;
+	dispatch_obj *disp;
+	sock_obj *sockobj;
+	dworker *w;
+	dreq *req;
+
+	if (!(disp = objtable_get(dispref, OBJ_DISPATCHER)))
+		return -EINVAL;
+	if (!(req = objtable_get(reqref, OBJ_REQUEST))) {
+		objtable_put(dispref);
+		return -EINVAL;
+	}
+	if (req->disp != disp) {
+		ret = -EINVAL;
+		goto out;
+	}
+	lock_enter(&disp->lock);
+	if (objtable_remove(reqref) < 0) {
+		lock_leave(&disp->lock);
+		ret = -EINVAL;	/* answered already */
+		goto out;
+	}
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		disp->inhand = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+	lock_leave(&disp->lock);
+	w = &disp->workers[req->worker];
+	atomic_dec(&w->inhand);
+
+	if (!(sockobj = objtable_get(disp->sockref, OBJ_SOCK))) {
+		ret = -ENOTSOCK;
+		goto out;
+	}
+	if (!(body = nn_allocmsg(len, 0))) {
+		objtable_put(disp->sockref);
+		ret = -ENOBUFS;
+		goto out;
+	}
+	if (len)
+		memcpy(body, *h + 4, len);
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = &body;
+	iov.iov_len = NN_MSG;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = &req->ctrl;
+	hdr.msg_controllen = NN_MSG;
+	/* a raw REP never blocks on send */
+	ret = RET0(nn_sendmsg(sockobj->sock, &hdr, NN_DONTWAIT));
+	TRACE(TR_SENDMSG, sockobj->sock, ret, len);
+	if (ret < 0)
+		nn_freemsg(body);
+	else
+		req->ctrl = NULL;	/* nanomsg took the header too */
+	histo_add(&w->service, clock_ns() - req->t_start);
+	atomic_add64(&w->served, 1);
+	objtable_put(disp->sockref);
+out:
+	objtable_put(reqref);	/* and dreq_free, if we removed it */
+	objtable_put(dispref);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_dispatcher_stats(objref dispref, int worker, int *queued,
+				      int *inhand, uint64_t *served,
+				      uint64_t *dropped, int kind,
+				      uint64_t *counts, int nbuckets)
+{
+	int i;
+	histo *hist;
+	dispatch_obj *disp;
+	dworker *w;
+
+	if (!(disp = objtable_get(dispref, OBJ_DISPATCHER)))
+		return -EINVAL;
+	if ((worker < 0) || (worker >= disp->nworkers)) {
+		objtable_put(dispref);
+		return -EINVAL;
+	}
+	w = &disp->workers[worker];
+	if (queued)
+		*queued = atomic_get(&w->queued);
+	if (inhand)
+		*inhand = atomic_get(&w->inhand);
+	if (served)
+		*served = w->served;
+	if (dropped)
+		*dropped = w->dropped;
+	/* kind 0 is the time spent queued, 1 the time in hand */
+	hist = kind ? &w->service : &w->wait;
+	if (nbuckets > HISTO_BUCKETS)
+		nbuckets = HISTO_BUCKETS;
+	for (i = 0; counts && (i < nbuckets); ++i)
+		counts[i] = hist->count[i];
+	objtable_put(dispref);
+
+	return HISTO_BUCKETS;
+}
+
+EXPORT int lvnanomsg_dispatcher_destroy(objref dispref)
+{
+	int i;
+	dreq *none = NULL;
+	dispatch_obj *disp;
+
+	if (!(disp = objtable_get(dispref, OBJ_DISPATCHER)))
+		return -EINVAL;
+	if (objtable_remove(dispref) < 0) {
+		objtable_put(dispref);
+		return -EINVAL;
+	}
+	/* kick workers out of their waits, as often as it takes them to leave */
+	while (atomic_get(&disp->waiting)) {
+		for (i = 0; i < disp->nworkers; ++i)
+			nn_send(disp->workers[i].q_tx, &none, sizeof(none), NN_DONTWAIT);
+		thread_sleep(1);
+	}
+	objtable_put(dispref);	/* dispatch_free, once no call holds it */
+
+	return 0;
+}
+
+/*
+ * ASYNC REQUESTS
+ * many requests in flight on one raw REQ socket (lvnanomsg_socket_raw)
+ * instead of REQ's strict send/receive lockstep: async_send tags each
+ * request with an ID of our own, which the REP end hands back in the
+ * reply's header, and returns without waiting; a thread per client
+ * matches replies to their requests, resends those not answered within
+ * their resend interval and gives up on those past their timeout
+ *
+ * completions (the reply, or -ETIMEDOUT) queue up for async_wait, a
+ * private inproc PAIR like the dispatcher's, so they can be waited on
+ * with a timeout; or, after async_event, are posted as a user event
+ * carrying a cluster of (string reply, U32 id, I32 status), in that
+ * order so the layout is the same with and without LabVIEW's packing
+ */
+#define ASYNC_TICK_MS		10	/* resolution of timeouts and resends */
+#define ASYNC_MAX_SLOTS		(1 << 20)
+
+typedef struct {
+	uint32_t id;		/* 0 if the slot is free */
+	void *req;		/* as sent, ID in front, for resends */
+	int len;
+	uint64_t deadline_us;	/* 0 waits for ever */
+	uint64_t resend_us;	/* next resend, 0 for none */
+	uint32_t every_us;
+} apending;
+
+typedef struct {
+	void *body;		/* nanomsg chunk, NULL unless replied */
+	int len;
+	uint32_t id;
+	int status;
+} acomp;
+
+/* the event cluster; the handle goes first, see above */
+typedef struct {
+	UHandle data;
+	uint32_t id;
+	int32_t status;
+} aevent;
+
+typedef struct {
+	objref sockref;
+	lock_t lock;		/* guards the slots, the ID counter and the event */
+	apending *slots;	/* indexed by ID, a power of two, at most half full */
+	int nslots, npending;
+	uint32_t nextid;
+	int q_rx, q_tx;		/* completions, as acomp pointers */
+	LVUserEventRef event;
+	int hasevent;
+	aevent ev;		/* reused between posts */
+	thread_t thread;
+	int started;
+	volatile int running;
+	atomic_t waiting;	/* callers inside async_wait */
+	/* statistics */
+	uint64_t sent, resent, replied, timedout, stray;
+	objref ref;
+} async_obj;
+
+/* hand a finished request to whoever waits for it; call with lock held */
+static void async_complete(async_obj *a, uint32_t id, int status,
+			   void *body, int len)
+{
+	acomp *c;
+
+	if (a->hasevent) {
+		if (DSSetHandleSize(a->ev.data, len + 4) == mgNoErr) {
+			*(u32*)*a->ev.data = len;
+			if (len)
+				memcpy(*a->ev.data + 4, body, len);
+			a->ev.id = id;
+			a->ev.status = status;
+			PostLVUserEvent(a->event, &a->ev);
+		}
+		if (body)
+			nn_freemsg(body);
+		return;
+	}
+	if (!(c = malloc(sizeof(acomp)))) {
+		if (body)
+			nn_freemsg(body);
+		return;
+	}
+	c->body = body;
+	c->len = len;
+	c->id = id;
+	c->status = status;
+	if (nn_send(a->q_tx, &c, sizeof(c), NN_DONTWAIT) < 0) {
+		if (body)
+			nn_freemsg(body);
+		free(c);
+	}
+}
+
+/* the slot of a pending ID, or NULL; call with lock held */
+static apending* async_find(async_obj *a, uint32_t id)
+{
+	apending *p = &a->slots[id & (a->nslots - 1)];
+
+	return (id && (p->id == id)) ? p : NULL;
+}
+
+static void async_drop(async_obj *a, apending *p)
+{
+	free(p->req);
+	memset(p, 0, sizeof(apending));
+	--a->npending;
+}
+
+/* double the slots; IDs in different slots before stay in different ones */
+static int async_grow(async_obj *a)
+{
+	int i, n = a->nslots * 2;
+	apending *slots;
+
+	if ((n > ASYNC_MAX_SLOTS) || !(slots = calloc(n, sizeof(apending))))
+		return -ENOBUFS;
+	for (i = 0; i < a->nslots; ++i) {
+		if (a->slots[i].id)
+			slots[a->slots[i].id & (n - 1)] = a->slots[i];
+	}
+	free(a->slots);
+	a->slots = slots;
+	a->nslots = n;
+	return 0;
+}
+
+/* the ID found in a reply's SP header, or 0 */
+static uint32_t async_hdrid(struct nn_msghdr *hdr)
+{
+	size_t sz;
+	const uint8_t *d;
+	struct nn_cmsghdr *cmsg;
+
+	for (cmsg = NN_CMSG_FIRSTHDR(hdr); cmsg; cmsg = NN_CMSG_NXTHDR(hdr, cmsg)) {
+		if ((cmsg->cmsg_level != PROTO_SP) || (cmsg->cmsg_type != SP_HDR))
+			continue;
+		/* the header's size, then the header: here the request ID */
+		d = NN_CMSG_DATA(cmsg);
+		memcpy(&sz, d, sizeof(sz));
+		if (sz < 4)
+			return 0;
+		d += sizeof(sz);
+		return ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+	}
+	return 0;
+}
+
+static THREAD_PROC(async_thread, arg)
+{
+	int i, n;
+	uint32_t id;
+	uint64_t now, last = 0;
+	size_t ctrl[32];
+	void *body;
+	struct nn_iovec iov;
+	struct nn_msghdr hdr;
+	struct nn_pollfd pfd;
+	async_obj *a = arg;
+	sock_obj *sockobj;
+	apending *p;
+
+	while (a->running) {
+		if (!(sockobj = objtable_get(a->sockref, OBJ_SOCK)))
+			break;	/* the socket was closed under us */
+		pfd.fd = sockobj->sock;
+		pfd.events = NN_POLLIN;
+		pfd.revents = 0;
+		if (nn_poll(&pfd, 1, ASYNC_TICK_MS) > 0) {
+			for (;;) {
+				memset(&hdr, 0, sizeof(hdr));
+				iov.iov_base = &body;
+				iov.iov_len = NN_MSG;
+				hdr.msg_iov = &iov;
+				hdr.msg_iovlen = 1;
+				hdr.msg_control = ctrl;
+				hdr.msg_controllen = sizeof(ctrl);
+				if ((n = nn_recvmsg(sockobj->sock, &hdr, NN_DONTWAIT)) < 0)
+					break;
+				id = async_hdrid(&hdr);
+				lock_enter(&a->lock);
+				if ((p = async_find(a, id))) {
+					async_drop(a, p);
+					++a->replied;
+					async_complete(a, id, 0, body, n);
+				} else {
+					/* a late answer to a resent or abandoned request */
+					++a->stray;
+					nn_freemsg(body);
+				}
+				lock_leave(&a->lock);
+			}
+		}
+
+		now = clock_us();
+		if (now - last < ASYNC_TICK_MS * 1000) {
+			objtable_put(a->sockref);
+			continue;
+		}
+		last = now;
+		lock_enter(&a->lock);
+		for (i = 0; i < a->nslots; ++i) {
+			p = &a->slots[i];
+			if (!p->id)
+				continue;
+			if (p->deadline_us && (now >= p->deadline_us)) {
+				id = p->id;
+				async_drop(a, p);
+				++a->timedout;
+				async_complete(a, id, -ETIMEDOUT, NULL, 0);
+			} else if (p->resend_us && (now >= p->resend_us)) {
+				/* a raw REQ does not resend by itself */
+				if (nn_send(sockobj->sock, p->req, p->len, NN_DONTWAIT) >= 0)
+					++a->resent;
+				p->resend_us = now + p->every_us;
+			}
+		}
+		lock_leave(&a->lock);
+		objtable_put(a->sockref);
+	}
+	THREAD_RETURN;
+}
+
+static void async_free(async_obj *a)
+{
+	int i;
+	acomp *c;
+
+	a->running = 0;
+	if (a->started)
+		thread_join(a->thread);
+	while ((a->q_rx >= 0)
+	       && (nn_recv(a->q_rx, &c, sizeof(c), NN_DONTWAIT) == sizeof(c))) {
+		if (c && c->body)
+			nn_freemsg(c->body);
+		free(c);
+	}
+	if (a->q_rx >= 0)
+		nn_close(a->q_rx);
+	if (a->q_tx >= 0)
+		nn_close(a->q_tx);
+	for (i = 0; i < a->nslots; ++i)
+		free(a->slots[i].req);
+	free(a->slots);
+	if (a->ev.data)
+		DSDisposeHandle(a->ev.data);
+	lock_destroy(&a->lock);
+	free(a);
+}
+
+EXPORT int lvnanomsg_async_create(objref sockref, objref *aref)
+{
+	char addr[64];
+	async_obj *a;
+	sock_obj *sockobj;
+
+	*aref = 0;
+	CHECK_SOCK(sockobj, sockref);
+	if (!(a = calloc(sizeof(async_obj), 1))) {
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	lock_init(&a->lock);
+	a->sockref = sockref;
+	a->nextid = 1;
+	a->nslots = 64;
+	sprintf(addr, "inproc://lvnanomsg-async-%p", (void*)a);
+	a->q_rx = nn_socket(AF_SP, NN_PAIR);
+	a->q_tx = nn_socket(AF_SP, NN_PAIR);
+	if (!(a->slots = calloc(a->nslots, sizeof(apending)))
+	    || !(a->ev.data = DSNewHClr(4))
+	    || (a->q_rx < 0) || (a->q_tx < 0)
+	    || (nn_bind(a->q_rx, addr) < 0)
+	    || (nn_connect(a->q_tx, addr) < 0)) {
+		async_free(a);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	a->running = 1;
+	if (thread_create(&a->thread, async_thread, a) != 0) {
+		async_free(a);
+		objtable_put(sockref);
+		return -ENOMEM;
+	}
+	a->started = 1;
+	if (!(a->ref = objtable_add(a, OBJ_ASYNC))) {
+		async_free(a);
+		objtable_put(sockref);
+		return -EMFILE;
+	}
+	DEBUGMSG("ASYNC client on %d", sockobj->sock);
+	*aref = a->ref;
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * send a request without waiting for its reply; it is resent every
+ * resend ms (0 never) until answered, and completes with -ETIMEDOUT
+ * after timeout ms (0 never); *reqid identifies its completion
+ */
+EXPORT int lvnanomsg_async_send(objref aref, const UHandle h, int timeout,
+				int resend, uint32_t *reqid)
+{
+	int ret, len = h ? *(u32*)*h : 0;
+	uint32_t id;
+	uint8_t *req;
+	uint64_t now;
+	async_obj *a;
+	sock_obj *sockobj;
+	apending *p;
+
+	*reqid = 0;
+	if ((timeout < 0) || (resend < 0) || !(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	if (!(sockobj = sock_get(a->sockref))) {
+		objtable_put(aref);
+		return -ENOTSOCK;
+	}
+	if (!(req = malloc(len + 4))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (len)
+		memcpy(req + 4, *h + 4, len);
+
+	lock_enter(&a->lock);
+	/* grow by load, not by collisions, which one stuck request keeps causing */
+	if ((2 * (a->npending + 1) > a->nslots) && (async_grow(a) < 0)
+	    && (a->npending >= a->nslots)) {
+		lock_leave(&a->lock);
+		free(req);
+		ret = -ENOBUFS;	/* that many in flight */
+		goto out;
+	}
+	/* the next ID whose slot is free, skipping those still pending */
+	do {
+		/* 31 bits; the top bit marks the end of the backtrace for REP */
+		id = 0x80000000u | a->nextid;
+		a->nextid = (a->nextid + 1) & 0x7FFFFFFF;
+		if (!a->nextid)
+			a->nextid = 1;
+	} while (a->slots[id & (a->nslots - 1)].id);
+	req[0] = (uint8_t)(id >> 24);
+	req[1] = (uint8_t)(id >> 16);
+	req[2] = (uint8_t)(id >> 8);
+	req[3] = (uint8_t)id;
+	ret = nn_send(sockobj->sock, req, len + 4, NN_DONTWAIT);
+	/* with no server yet, a request that will be resent can wait */
+	if ((ret < 0) && ((nn_errno() != EAGAIN) || !resend)) {
+		ret = RET0(ret);
+		lock_leave(&a->lock);
+		free(req);
+		goto out;
+	}
+	now = clock_us();
+	p = &a->slots[id & (a->nslots - 1)];
+	p->id = id;
+	p->req = req;
+	p->len = len + 4;
+	p->deadline_us = timeout ? now + (uint64_t)timeout * 1000 : 0;
+	p->every_us = (uint32_t)resend * 1000;
+	p->resend_us = resend ? now + p->every_us : 0;
+	++a->npending;
+	++a->sent;
+	lock_leave(&a->lock);
+	TRACE(TR_SEND, sockobj->sock, 0, (uint32_t)len);
+	*reqid = id;
+	ret = 0;
+out:
+	objtable_put(a->sockref);
+	objtable_put(aref);
+
+	return ret;
+}
+
+/*
+ * wait up to timeout ms for the next completion; the reply goes into h
+ * and *status is 0, or -ETIMEDOUT if the request was given up on;
+ * -EAGAIN if nothing completed in time
+ */
+EXPORT int lvnanomsg_async_wait(objref aref, int timeout, UHandle h,
+				uint32_t *reqid, int *status)
+{
+	int ret;
+	struct nn_pollfd pfd;
+	async_obj *a;
+	acomp *c;
+
+	if (!(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	atomic_inc(&a->waiting);
+	pfd.fd = a->q_rx;
+	pfd.events = NN_POLLIN;
+	pfd.revents = 0;
+	ret = nn_poll(&pfd, 1, timeout);
+	if (ret <= 0) {
+		ret = (ret < 0) ? RET0(ret) : -EAGAIN;
+		goto out;
+	}
+	if (nn_recv(a->q_rx, &c, sizeof(c), NN_DONTWAIT) != sizeof(c)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	if (!c) {
+		ret = -EBADF;	/* woken by a destroy */
+		goto out;
+	}
+	ret = 0;
+	if (DSSetHandleSize(h, c->len + 4) != mgNoErr) {
+		ret = -ENOMEM;
+	} else {
+		*(u32*)*h = c->len;
+		if (c->len)
+			memcpy(*h + 4, c->body, c->len);
+	}
+	*reqid = c->id;
+	*status = c->status;
+	if (c->body)
+		nn_freemsg(c->body);
+	free(c);
+out:
+	atomic_dec(&a->waiting);
+	objtable_put(aref);
+
+	return ret;
+}
+
+/* post completions as user events from now on; NULL goes back to async_wait */
+EXPORT int lvnanomsg_async_event(objref aref, LVUserEventRef *evt)
+{
+	async_obj *a;
+
+	if (!(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	lock_enter(&a->lock);
+	a->hasevent = evt ? 1 : 0;
+	a->event = evt ? *evt : 0;
+	lock_leave(&a->lock);
+	objtable_put(aref);
+
+	return 0;
+}
+
+/* forget a request; a reply still on its way is counted as stray */
+EXPORT int lvnanomsg_async_cancel(objref aref, uint32_t reqid)
+{
+	apending *p;
+	async_obj *a;
+
+	if (!(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	lock_enter(&a->lock);
+	if (!(p = async_find(a, reqid))) {
+		lock_leave(&a->lock);
+		objtable_put(aref);
+		return -ENOENT;
+	}
+	async_drop(a, p);
+	lock_leave(&a->lock);
+	objtable_put(aref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_async_stats(objref aref, int *pending, uint64_t *sent,
+				 uint64_t *resent, uint64_t *replied,
+				 uint64_t *timedout, uint64_t *stray)
+{
+	async_obj *a;
+
+	if (!(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	lock_enter(&a->lock);
+	if (pending)
+		*pending = a->npending;
+	if (sent)
+		*sent = a->sent;
+	if (resent)
+		*resent = a->resent;
+	if (replied)
+		*replied = a->replied;
+	if (timedout)
+		*timedout = a->timedout;
+	if (stray)
+		*stray = a->stray;
+	lock_leave(&a->lock);
+	objtable_put(aref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_async_destroy(objref aref)
+{
+	acomp *none = NULL;
+	async_obj *a;
+
+	if (!(a = objtable_get(aref, OBJ_ASYNC)))
+		return -EINVAL;
+	if (objtable_remove(aref) < 0) {
+		objtable_put(aref);
+		return -EINVAL;
+	}
+	/* kick callers out of their waits, as often as it takes them to leave */
+	while (atomic_get(&a->waiting)) {
+		nn_send(a->q_tx, &none, sizeof(none), NN_DONTWAIT);
+		thread_sleep(1);
+	}
+	objtable_put(aref);	/* async_free, once no call holds it */
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_get_monitor_event(objref *pinstdata, objref sockref,
+					int *intval, UHandle strval)
+{
+	UHandle buffer;
+	int ret, evtnum;
+	int id = 0, flags = 0;
+	uint32_t len;
+	sock_obj *sockobj;
+
+	/* we use a fake buffer so we can use lvnanomsg_recv and have protected abort semantics */
+	CHECK_SOCK(sockobj, sockref);
+	buffer = sock_newhandle(sockobj, 4);
+	objtable_put(sockref);	/* the receives look it up themselves */
+	if (!buffer)
+		return -ENOBUFS;
+	DEBUGMSG("MONITOR %p blocking for recv", (void*)sockref);
+	ret = lvnanomsg_recv(pinstdata, sockref, buffer, &flags);
+	DEBUGMSG( "  MONITOR got ret %d", ret );
+	/* if it failed, give up */
+	if ( ret < 0 ) {
+		sock_puthandle(sockref, buffer);
+		return ret;
+	}
+
+	/* make sure it went as expected (ensure multi-part message, check payload size) */
+	len = **(uint32_t**)buffer;
+	if (!(flags & 1) || (len != 6)) {
+		DEBUGMSG("  UNEXPECTED MON package flag %i got %u bytes", flags, len);
+		sock_puthandle(sockref, buffer);
+		return -ECRIT;
+	}
+
+	/* reinterpret the payload */
+	evtnum = *(uint16_t*)(*(char**)buffer + 4);	/* first 2 bytes are event type */
+	*intval = *(int32_t*)(*(char**)buffer + 6);	/* next 4 bytes are int value */
+	/* get the event type */
+	ret = evtnum;
+	while ( ret >>= 1 ) ++id;
+	sock_puthandle(sockref, buffer);
+
+	/* second frame is the address */
+	flags = 0;
+	ret = lvnanomsg_recv(pinstdata, sockref, strval, &flags);
+	/* pop a debug message */
+	DEBUGMSG("  SOCKET monitor got message, %i (%i)", evtnum, id);
+
+	/* return the event type */
+	return id + 1;
+}
+
+/*
+ * RECEIVER SERVICE
+ * a small fixed pool of event-loop threads, each multiplexing many sockets
+ * with nn_poll and posting every message it receives as a LabVIEW user
+ * event; loops are woken through an inproc PAIR whenever their set of
+ * sockets changes, so (un)registering never waits for traffic
+ *
+ * a socket can instead have its messages coalesced: whatever arrives
+ * within a window (max count, max bytes, max latency) is posted as one
+ * event carrying an array of strings, built in reusable staging handles
+ *
+ * or, bypassing the LabVIEW event queue altogether, have them written to
+ * a fixed-size lock-free ring that a timed loop drains with ring_read
+ */
+#define RECEIVER_MAX_LOOPS	16
+#define RECEIVER_DEF_LOOPS	2
+#define RECEIVER_BURST		64	/* messages per socket per wakeup */
+
+typedef struct {
+	LVUserEventRef event;
+	UHandle arr;		/* 1D array of strings, reused between posts */
+	int n, nalloc;		/* strings staged, and element handles owned */
+	size_t bytes;
+	uint64_t first_us;	/* arrival of the oldest staged message */
+} rxstage;
+
+typedef struct {
+	objref sockref;
+	int sock;
+	LVUserEventRef event;
+	/* coalescing window, maxcount <= 1 posts each message on its own */
+	int maxcount, maxbytes;
+	uint64_t maxlatency_us;
+	rxstage *stage;		/* touched by the loop thread only */
+	ringbuf *ring;		/* write here instead of posting, if set */
+} rxreg;
+
+typedef struct {
+	ringbuf *rb;
+	objref sockref;		/* socket feeding it */
+	objref ref;
+} ring_obj;
+
+static void ring_free(ring_obj *ring)
+{
+	ringbuf_free(ring->rb);
+	free(ring);
+}
+
+struct rxloop {
+	int id;
+	thread_t thread;
+	lock_t lock;		/* protects regs and dropped */
+	rxreg *regs;
+	int nregs, maxregs;
+	bonzai *dropped;	/* stages of unregistered sockets, to flush */
+	atomic_t dirty;		/* regs changed since the thread last looked */
+	atomic_t epoch;		/* bumped each time the thread takes a new set */
+	volatile int running;
+	int wake_rx, wake_tx;
+	UHandle single;		/* reused for uncoalesced posts */
+	/* statistics, written by the loop thread only */
+	uint64_t wakeups, messages, posts, busy_us;
+};
+
+static rxloop *rxloops[RECEIVER_MAX_LOOPS];
+static int nrxloops = 0;
+static lock_t rxlock;		/* serialises service-level operations */
+
+static void rxloop_wake(rxloop *loop)
+{
+	/* a full wake queue already guarantees a wakeup */
+	nn_send(loop->wake_tx, "", 0, NN_DONTWAIT);
+}
+
+static rxstage* rxstage_create(LVUserEventRef event)
+{
+	rxstage *st = calloc(sizeof(rxstage), 1);
+
+	if (!st)
+		return NULL;
+	if (!(st->arr = DSNewHClr(8))) {
+		free(st);
+		return NULL;
+	}
+	st->event = event;
+	return st;
+}
+
+static void rxstage_free(rxstage *st)
+{
+	int i;
+	UHandle *elem;
+
+	if (!st)
+		return;
+	elem = (UHandle*)LVALIGN(*st->arr + 4);
+	for (i = 0; i < st->nalloc; ++i) {
+		if (elem[i])
+			DSDisposeHandle(elem[i]);
+	}
+	DSDisposeHandle(st->arr);
+	free(st);
+}
+
+static int rxstage_add(rxstage *st, const void *msg, int len, uint64_t now)
+{
+	int i, nmax;
+	UHandle *elem;
+
+	/* grow the array of element handles; existing ones are kept */
+	if (st->n >= st->nalloc) {
+		nmax = st->nalloc ? 2 * st->nalloc : 16;
+		if (DSSetHandleSize(st->arr, 8 + nmax * sizeof(UHandle)) != mgNoErr)
+			return -1;
+		elem = (UHandle*)LVALIGN(*st->arr + 4);
+		for (i = st->nalloc; i < nmax; ++i)
+			elem[i] = NULL;
+		st->nalloc = nmax;
+	}
+	elem = (UHandle*)LVALIGN(*st->arr + 4);
+	if (!elem[st->n])
+		elem[st->n] = DSNewHandle(len + 4);
+	else if (DSSetHandleSize(elem[st->n], len + 4) != mgNoErr)
+		return -1;
+	if (!elem[st->n])
+		return -1;
+	*(u32*)*elem[st->n] = len;
+	memcpy(*elem[st->n] + 4, msg, len);
+	if (st->n++ == 0)
+		st->first_us = now;
+	st->bytes += len;
+	return 0;
+}
+
+static void rxstage_post(rxloop *loop, rxstage *st)
+{
+	if (!st || !st->n)
+		return;
+	/* LabVIEW copies the event data, so the staging handles stay ours */
+	*(u32*)*st->arr = st->n;
+	PostLVUserEvent(st->event, &st->arr);
+	++loop->posts;
+	st->n = 0;
+	st->bytes = 0;
+}
+
+static int rxloop_drain(rxloop *loop, rxreg *reg, uint64_t now)
+{
+	int k, ret;
+	void *msg;
+	rxstage *st = reg->stage;
+	/* still valid: a socket is only closed once the loop has dropped it */
+	sock_obj *sockobj = objtable_get(reg->sockref, OBJ_SOCK);
+
+	for (k = 0; k < RECEIVER_BURST; ++k) {
+		ret = nn_recv(reg->sock, &msg, NN_MSG, NN_DONTWAIT);
+		if (ret < 0)
+			break;
+		if (sockobj) {
+			ret = sock_inflate(sockobj, &msg, ret);
+			if ((ret = sock_unframe(sockobj, &msg, ret)) == DELTA_SKIP) {
+				nn_freemsg(msg);
+				continue;
+			}
+		}
+		if (reg->ring)
+			ringbuf_write(reg->ring, msg, ret);	/* drops are counted */
+		else if (reg->maxcount > 1) {
+			if (rxstage_add(st, msg, ret, now) < 0)
+				rxstage_post(loop, st);	/* out of memory; flush what we have */
+			else if ((st->n >= reg->maxcount) || ((reg->maxbytes > 0)
+				 && (st->bytes >= (size_t)reg->maxbytes)))
+				rxstage_post(loop, st);
+		} else if (DSSetHandleSize(loop->single, ret + 4) == mgNoErr) {
+			*(u32*)*loop->single = ret;
+			memcpy(*loop->single + 4, msg, ret);
+			PostLVUserEvent(reg->event, &loop->single);
+			++loop->posts;
+		}
+		nn_freemsg(msg);
+	}
+	if (sockobj)
+		objtable_put(reg->sockref);
+	if (k)
+		TRACE(TR_RXLOOP, reg->sock, k, 0);
+	return k;
+}
+
+/* post every window that has run out, and return the ms until the next one does */
+static int rxloop_expire(rxloop *loop, rxreg *regs, int n, uint64_t now)
+{
+	int i, ms, timeout = -1;
+	uint64_t deadline;
+
+	for (i = 0; i < n; ++i) {
+		if (!regs[i].stage->n)
+			continue;
+		deadline = regs[i].stage->first_us + regs[i].maxlatency_us;
+		if ((regs[i].maxcount <= 1) || (now >= deadline)) {
+			rxstage_post(loop, regs[i].stage);
+			continue;
+		}
+		ms = (int)((deadline - now + 999) / 1000);
+		if ((timeout < 0) || (ms < timeout))
+			timeout = ms;
+	}
+	return timeout;
+}
+
+static THREAD_PROC(rxloop_thread, param)
+{
+	rxloop *loop = param;
+	struct nn_pollfd *items = NULL, *tmp;
+	rxreg *regs = NULL, *rtmp;
+	int i, n = 0, ret, timeout = -1;
+	uint64_t t0;
+	void *msg;
+
+	DEBUGMSG("RXLOOP %i started", loop->id);
+	while (loop->running) {
+		if (atomic_get(&loop->dirty)) {
+			/* take a private copy of the registrations */
+			lock_enter(&loop->lock);
+			atomic_set(&loop->dirty, 0);
+			tmp = realloc(items, (loop->nregs + 1) * sizeof(struct nn_pollfd));
+			rtmp = realloc(regs, (loop->nregs + 1) * sizeof(rxreg));
+			if (tmp)
+				items = tmp;
+			if (rtmp)
+				regs = rtmp;
+			if (tmp && rtmp) {
+				n = loop->nregs;
+				memcpy(regs, loop->regs, n * sizeof(rxreg));
+			} else
+				n = 0;	/* out of memory; only listen for wakes */
+			/* from here on, unregistered sockets are no longer touched */
+			atomic_inc(&loop->epoch);
+			/* whatever they had staged still goes out */
+			for (i = 0; i < loop->dropped->n; ++i) {
+				rxstage_post(loop, loop->dropped->elem[i]);
+				rxstage_free(loop->dropped->elem[i]);
+			}
+			loop->dropped->n = 0;
+			lock_leave(&loop->lock);
+			if (!items)
+				break;
+			items[0].fd = loop->wake_rx;
+			items[0].events = NN_POLLIN;
+			for (i = 0; i < n; ++i) {
+				items[i + 1].fd = regs[i].sock;
+				items[i + 1].events = NN_POLLIN;
+			}
+			/* a window may have been closed by the new settings */
+			timeout = rxloop_expire(loop, regs, n, clock_us());
+		}
+
+		ret = nn_poll(items, n + 1, timeout);
+		if (ret < 0) {
+			if (nn_errno() == ETERM)
+				break;
+			thread_sleep(1);	/* don't spin on a persistent error */
+			continue;
+		}
+		++loop->wakeups;
+		t0 = clock_us();
+		if (items[0].revents & NN_POLLIN) {
+			while (nn_recv(loop->wake_rx, &msg, NN_MSG, NN_DONTWAIT) >= 0)
+				nn_freemsg(msg);
+		}
+		for (i = 0; i < n; ++i) {
+			if (items[i + 1].revents & NN_POLLIN)
+				loop->messages += rxloop_drain(loop, &regs[i], t0);
+		}
+		timeout = rxloop_expire(loop, regs, n, clock_us());
+		loop->busy_us += clock_us() - t0;
+	}
+	DEBUGMSG("RXLOOP %i stopped", loop->id);
+	/* flush and release what the remaining registrations had staged */
+	lock_enter(&loop->lock);
+	for (i = 0; i < loop->nregs; ++i) {
+		rxstage_post(loop, loop->regs[i].stage);
+		rxstage_free(loop->regs[i].stage);
+		loop->regs[i].stage = NULL;
+	}
+	for (i = 0; i < loop->dropped->n; ++i) {
+		rxstage_post(loop, loop->dropped->elem[i]);
+		rxstage_free(loop->dropped->elem[i]);
+	}
+	loop->dropped->n = 0;
+	lock_leave(&loop->lock);
+	free(items);
+	free(regs);
+	/* unblock anybody waiting for the epoch to move */
+	loop->running = 0;
+	atomic_inc(&loop->epoch);
+
+	THREAD_RETURN;
+}
+
+static void rxloop_free(rxloop *loop)
+{
+	if (loop->wake_tx >= 0)
+		nn_close(loop->wake_tx);
+	if (loop->wake_rx >= 0)
+		nn_close(loop->wake_rx);
+	if (loop->single)
+		DSDisposeHandle(loop->single);
+	bonzai_free(loop->dropped);
+	lock_destroy(&loop->lock);
+	free(loop->regs);
+	free(loop);
+}
+
+static rxloop* rxloop_create(int id)
+{
+	char addr[64];
+	rxloop *loop = calloc(sizeof(rxloop), 1);
+
+	if (!loop)
+		return NULL;
+	loop->id = id;
+	lock_init(&loop->lock);
+	loop->dirty = 1;
+	loop->running = 1;
+	loop->dropped = bonzai_init(NULL);
+	loop->single = DSNewHClr(4);
+	/* private wakeup channel */
+	sprintf(addr, "inproc://lvnanomsg-rxloop-%p", (void*)loop);
+	loop->wake_rx = nn_socket(AF_SP, NN_PAIR);
+	loop->wake_tx = nn_socket(AF_SP, NN_PAIR);
+	if (!loop->single || (loop->wake_rx < 0) || (loop->wake_tx < 0)
+	    || (nn_bind(loop->wake_rx, addr) < 0)
+	    || (nn_connect(loop->wake_tx, addr) < 0)
+	    || (thread_create(&loop->thread, rxloop_thread, loop) != 0)) {
+		rxloop_free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+/* start the loops if needed; call with rxlock held */
+static int rx_start(int nloops)
+{
+	int i;
+
+	if (nrxloops > 0)
+		return 0;
+	if (nloops <= 0)
+		nloops = RECEIVER_DEF_LOOPS;
+	if (nloops > RECEIVER_MAX_LOOPS)
+		nloops = RECEIVER_MAX_LOOPS;
+	for (i = 0; i < nloops; ++i) {
+		if (!(rxloops[i] = rxloop_create(i)))
+			break;
+		++nrxloops;
+	}
+	DEBUGMSG("RECEIVER started %i loops", nrxloops);
+	return (nrxloops > 0) ? 0 : -ENOMEM;
+}
+
+/* find the registration of a socket on its loop; call with loop->lock held */
+static rxreg* rxloop_find(rxloop *loop, objref sockref)
+{
+	int i;
+
+	for (i = 0; i < loop->nregs; ++i) {
+		if (loop->regs[i].sockref == sockref)
+			return &loop->regs[i];
+	}
+	return NULL;
+}
+
+static void rx_unregister(sock_obj *sockobj)
+{
+	int epoch;
+	rxloop *loop;
+	rxreg *reg;
+
+	lock_enter(&rxlock);
+	if (!(loop = sockobj->rxloop)) {
+		lock_leave(&rxlock);
+		return;
+	}
+	lock_enter(&loop->lock);
+	if ((reg = rxloop_find(loop, sockobj->ref))) {
+		/* the loop thread flushes and frees the stage */
+		bonzai_grow(loop->dropped, reg->stage);
+		*reg = loop->regs[--loop->nregs];
+	}
+	epoch = atomic_get(&loop->epoch);
+	atomic_set(&loop->dirty, 1);
+	rxloop_wake(loop);
+	lock_leave(&loop->lock);
+	/* the socket may only be closed once the thread has let go of it */
+	while (loop->running && (atomic_get(&loop->epoch) == epoch))
+		thread_sleep(1);
+	sockobj->rxloop = NULL;
+	lock_leave(&rxlock);
+	DEBUGMSG("RECEIVER dropped %d from loop %i", sockobj->sock, loop->id);
+}
+
+static int rx_register(sock_obj *sockobj, LVUserEventRef event, ringbuf *ring)
+{
+	int i, ret;
+	rxloop *loop;
+	rxreg *regs;
+	rxstage *st;
+
+	/* re-registering just swaps the event */
+	rx_unregister(sockobj);
+	lock_enter(&rxlock);
+	if ((ret = rx_start(0)) < 0) {
+		lock_leave(&rxlock);
+		return ret;
+	}
+	if (!(st = rxstage_create(event))) {
+		lock_leave(&rxlock);
+		return -ENOMEM;
+	}
+	/* least loaded loop */
+	loop = rxloops[0];
+	for (i = 1; i < nrxloops; ++i) {
+		if (rxloops[i]->nregs < loop->nregs)
+			loop = rxloops[i];
+	}
+	lock_enter(&loop->lock);
+	if (loop->nregs >= loop->maxregs) {
+		regs = realloc(loop->regs, (loop->maxregs + 16) * sizeof(rxreg));
+		if (!regs) {
+			lock_leave(&loop->lock);
+			lock_leave(&rxlock);
+			rxstage_free(st);
+			return -ENOMEM;
+		}
+		loop->regs = regs;
+		loop->maxregs += 16;
+	}
+	memset(&loop->regs[loop->nregs], 0, sizeof(rxreg));
+	loop->regs[loop->nregs].sockref = sockobj->ref;
+	loop->regs[loop->nregs].sock = sockobj->sock;
+	loop->regs[loop->nregs].event = event;
+	loop->regs[loop->nregs].stage = st;
+	loop->regs[loop->nregs].ring = ring;
+	++loop->nregs;
+	atomic_set(&loop->dirty, 1);
+	rxloop_wake(loop);
+	lock_leave(&loop->lock);
+	sockobj->rxloop = loop;
+	lock_leave(&rxlock);
+	DEBUGMSG("RECEIVER added %d to loop %i", sockobj->sock, loop->id);
+
+	return 0;
+}
+
+/* stop and join every loop; registered sockets are simply forgotten */
+static void rx_stop(void)
+{
+	int i, j;
+	rxloop *loop;
+	sock_obj *sockobj;
+
+	lock_enter(&rxlock);
+	for (i = 0; i < nrxloops; ++i) {
+		loop = rxloops[i];
+		loop->running = 0;
+		rxloop_wake(loop);
+		thread_join(loop->thread);
+		for (j = 0; j < loop->nregs; ++j) {
+			if ((sockobj = objtable_get(loop->regs[j].sockref, OBJ_SOCK))) {
+				sockobj->rxloop = NULL;
+				objtable_put(loop->regs[j].sockref);
+			}
+		}
+		rxloop_free(loop);
+		rxloops[i] = NULL;
+	}
+	nrxloops = 0;
+	lock_leave(&rxlock);
+}
+
+/* optionally size the pool before the first registration */
+EXPORT int lvnanomsg_receiver_start(int nloops)
+{
+	int ret;
+
+	lock_enter(&rxlock);
+	ret = rx_start(nloops);
+	lock_leave(&rxlock);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_receiver_register(LVUserEventRef *evt, objref sockref)
+{
+	int ret;
+	sock_obj *sockobj;
+
+	if (!evt)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	ret = rx_register(sockobj, *evt, NULL);
+	objtable_put(sockref);
+
+	return ret;
+}
+
+EXPORT int lvnanomsg_start_receiver(LVUserEventRef *evt, objref sockref)
+{
+	/* historical name; sockets no longer get a thread each */
+	return lvnanomsg_receiver_register(evt, sockref);
+}
+
+/*
+ * coalesce a registered socket's messages into events carrying an array
+ * of strings; a window closes after maxcount messages, maxbytes bytes
+ * (if > 0) or maxlatency ms after its first message, whichever is first
+ * (0 ms posts whatever one wakeup drained); maxcount <= 1 turns it off
+ */
+EXPORT int lvnanomsg_receiver_coalesce(objref sockref, int maxcount,
+				       int maxbytes, int maxlatency)
+{
+	sock_obj *sockobj;
+	rxloop *loop;
+	rxreg *reg;
+
+	if (maxlatency < 0)
+		return -EINVAL;
+	CHECK_SOCK(sockobj, sockref);
+	lock_enter(&rxlock);
+	if (!(loop = sockobj->rxloop)) {
+		lock_leave(&rxlock);
+		objtable_put(sockref);
+		return -EINVAL;		/* not registered */
+	}
+	lock_enter(&loop->lock);
+	if ((reg = rxloop_find(loop, sockref))) {
+		reg->maxcount = maxcount;
+		reg->maxbytes = maxbytes;
+		reg->maxlatency_us = (uint64_t)maxlatency * 1000;
+		atomic_set(&loop->dirty, 1);
+		rxloop_wake(loop);
+	}
+	lock_leave(&loop->lock);
+	lock_leave(&rxlock);
+	objtable_put(sockref);
+
+	return 0;
+}
+
+/*
+ * have the receiver write a socket's messages into a new ring of at least
+ * size bytes; there must be a single reader of the ring at any one time
+ */
+EXPORT int lvnanomsg_receiver_register_ring(objref sockref, uint32_t size,
+					    objref *ringref)
+{
+	int ret = 0;
+	sock_obj *sockobj;
+	ring_obj *ring;
+
+	*ringref = 0;
+	CHECK_SOCK(sockobj, sockref);
+	ring = calloc(sizeof(ring_obj), 1);
+	if (!ring) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (!(ring->rb = ringbuf_init(size))) {
+		free(ring);
+		ret = -ENOMEM;
+		goto out;
+	}
+	ring->sockref = sockref;
+	if (!(ring->ref = objtable_add(ring, OBJ_RING))) {
+		ring_free(ring);
+		ret = -EMFILE;
+		goto out;
+	}
+	if ((ret = rx_register(sockobj, 0, ring->rb)) < 0) {
+		objtable_remove(ring->ref);	/* and ring_free */
+		goto out;
+	}
+	*ringref = ring->ref;
+out:
+	objtable_put(sockref);
+
+	return ret;
+}
+
+/*
+ * copy as many whole records as fit into buf, their lengths into lens;
+ * never blocks, and fails with EMSGSIZE if even the first will not fit
+ */
+EXPORT int lvnanomsg_ring_read(objref ringref, char *buf, int buflen,
+			       int32_t *lens, int maxrecs, int *nrecs)
+{
+	int n = 0, pos = 0;
+	const void *x;
+	uint32_t len;
+	ring_obj *ring;
+
+	*nrecs = 0;
+	if (!(ring = objtable_get(ringref, OBJ_RING)))
+		return -EINVAL;
+	while ((n < maxrecs) && ringbuf_peek(ring->rb, &x, &len)) {
+		if (len > (uint32_t)(buflen - pos)) {
+			if (n == 0) {
+				objtable_put(ringref);
+				return -EMSGSIZE;
+			}
+			break;
+		}
+		memcpy(buf + pos, x, len);
+		ringbuf_pop(ring->rb);
+		lens[n++] = len;
+		pos += len;
+	}
+	*nrecs = n;
+	objtable_put(ringref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_ring_stats(objref ringref, uint64_t *written,
+				uint64_t *dropped, uint64_t *dropbytes,
+				uint32_t *used, uint32_t *highwater, uint32_t *size)
+{
+	ring_obj *ring;
+
+	if (!(ring = objtable_get(ringref, OBJ_RING)))
+		return -EINVAL;
+	if (written)
+		*written = ring->rb->written;
+	if (dropped)
+		*dropped = ring->rb->dropped;
+	if (dropbytes)
+		*dropbytes = ring->rb->dropbytes;
+	if (used)
+		*used = ringbuf_used(ring->rb);
+	if (highwater)
+		*highwater = ring->rb->highwater;
+	if (size)
+		*size = ring->rb->size;
+	objtable_put(ringref);
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_ring_destroy(objref ringref)
+{
+	ring_obj *ring;
+	sock_obj *sockobj;
+	rxloop *loop;
+	rxreg *reg;
+	int feeding = 0;
+
+	if (!(ring = objtable_get(ringref, OBJ_RING)))
+		return -EINVAL;
+	if (objtable_remove(ringref) < 0) {
+		objtable_put(ringref);
+		return -EINVAL;
 	}
+	/* make sure the loop thread has stopped writing to it */
+	if ((sockobj = objtable_get(ring->sockref, OBJ_SOCK))) {
+		lock_enter(&rxlock);
+		if ((loop = sockobj->rxloop)) {
+			lock_enter(&loop->lock);
+			reg = rxloop_find(loop, ring->sockref);
+			feeding = reg && (reg->ring == ring->rb);
+			lock_leave(&loop->lock);
+		}
+		lock_leave(&rxlock);
+		if (feeding)
+			rx_unregister(sockobj);
+		objtable_put(ring->sockref);
+	}
+	objtable_put(ringref);	/* ring_free, once no reader holds it */
+
+	return 0;
+}
+
+EXPORT int lvnanomsg_receiver_unregister(objref sockref)
+{
+	sock_obj *sockobj;
+
+	CHECK_SOCK(sockobj, sockref);
+	rx_unregister(sockobj);
+	objtable_put(sockref);
+
+	return 0;
+}
 
-	return RET0(ret);
+EXPORT int lvnanomsg_receiver_stop(void)
+{
+	rx_stop();
+	return 0;
 }
 
-EXPORT int lvnanomsg_recv_timeout(sock_obj **pinstdata, sock_obj *sockobj,
-				  UHandle h, int *flags, long timeout)
+/* per-loop counters; posts vs messages gives the coalescing ratio */
+EXPORT int lvnanomsg_receiver_stats(int id, int *nsockets, uint64_t *wakeups,
+				    uint64_t *messages, uint64_t *posts,
+				    uint64_t *busy_us)
 {
-	int ret = 0, evt = NN_POLLIN;	/* poll for input */
-	bonzai *polltree = NULL;
+	rxloop *loop;
 
-	CHECK_SOCK(sockobj);
-	ret = lvnanomsg_poll(&polltree, &sockobj, &evt, 1, timeout, NULL);
-	if (ret < 0)
-		return RET0(ret);	/* failed */
-	else if (ret == 0)
-		return -EAGAIN;		/* timed out */
+	lock_enter(&rxlock);
+	if ((id < 0) || (id >= nrxloops)) {
+		lock_leave(&rxlock);
+		return -EINVAL;
+	}
+	loop = rxloops[id];
+	if (nsockets)
+		*nsockets = loop->nregs;
+	if (wakeups)
+		*wakeups = loop->wakeups;
+	if (messages)
+		*messages = loop->messages;
+	if (posts)
+		*posts = loop->posts;
+	if (busy_us)
+		*busy_us = loop->busy_us;
+	lock_leave(&rxlock);
+
+	return nrxloops;
+}
+
+/*
+ * POLLER
+ * a persistent set of sockets to wait on, so that the per-call work of
+ * lvnanomsg_poll (allocating, resolving every reference) is done once at
+ * registration; on linux the sockets' NN_RCVFD/NN_SNDFD descriptors sit
+ * in an epoll set and a wait costs O(ready), elsewhere the set is handed
+ * to nn_poll as it stands
+ *
+ * an abort closes the registered sockets just as lvnanomsg_poll_abort
+ * does, and kicks the waiter through a private inproc PAIR
+ */
+
+typedef struct {
+	objref sockref;
+	int events;		/* NN_POLLIN and/or NN_POLLOUT */
+	int fd[2];		/* NN_RCVFD, NN_SNDFD once looked up */
+} pollent;
+
+typedef struct {
+	lock_t lock;		/* guards the entries */
+	pollent *ents;
+	int n, nalloc;
+	int wake_rx, wake_tx;
+	atomic_t waiting, aborted;
+#if POLLER_EPOLL
+	int epfd;
+	struct epoll_event *evs;
+#else
+	struct nn_pollfd *items;
+	objref *itemrefs;
+#endif
+	int nscratch;
+	objref ref;
+} poller_obj;
 
-	else 
-		return lvnanomsg_recv(pinstdata, sockobj, h, flags);
+static void poller_free(poller_obj *p)
+{
+	if (p->wake_rx >= 0)
+		nn_close(p->wake_rx);
+	if (p->wake_tx >= 0)
+		nn_close(p->wake_tx);
+#if POLLER_EPOLL
+	if (p->epfd >= 0)
+		close(p->epfd);
+	free(p->evs);
+#else
+	free(p->items);
+	free(p->itemrefs);
+#endif
+	lock_destroy(&p->lock);
+	free(p->ents);
+	free(p);
 }
 
+static pollent* poller_find(poller_obj *p, objref sockref)
+{
+	int i;
+
+	for (i = 0; i < p->n; ++i) {
+		if (p->ents[i].sockref == sockref)
+			return &p->ents[i];
+	}
+	return NULL;
+}
 
-EXPORT int lvnanomsg_recv_abort(sock_obj** pinstdata)
+/* make room for a wait reporting up to n events; call with lock held */
+static int poller_scratch(poller_obj *p, int n)
 {
-	/*
-	 * ABORT semantics are somewhat confusing with NANOMSG:
- 	 * 1. we want to stop this socket blocking, so we need to use nn_term()
-	 * 2. we need to stop nn_term() blocking since we called it from the GUI thread (THIS thread)
-	 * 3. therefore we need to close all sockets associated with the context
-	 * 4. we cannot close THIS socket because it's still being used in the OTHER thread (by the blocking call)
-	 * 5. therefore we close all sockets but the blocking one and use the blocking thread to close that socket.
-	 * GOT ALL THAT??
-	 */
-	sock_obj *sockobj = *pinstdata;
-	/* only worry about blocking calls */
-	if (!sockobj || !(sockobj->flags & FLAG_BLOCKING))
+#if POLLER_EPOLL
+	struct epoll_event *evs;
+
+	if (n <= p->nscratch)
 		return 0;
-	
-	*pinstdata = NULL;
-	/* we need to term the context to get the blocking call to return */
-	DEBUGMSG("INTERRUPT send/recv on %p", sockobj->sock);
-	/* we rely on the function unblocking and succeeding */
-	lvnanomsg_ctx_destroy(NULL, sockobj->ctx, 1);
-	DEBUGMSG("  INTERRUPT done");
+	if (!(evs = realloc(p->evs, n * sizeof(struct epoll_event))))
+		return -ENOMEM;
+	p->evs = evs;
+#else
+	struct nn_pollfd *items;
+	objref *refs;
 
+	if (n <= p->nscratch)
+		return 0;
+	if (!(items = realloc(p->items, n * sizeof(struct nn_pollfd))))
+		return -ENOMEM;
+	p->items = items;
+	if (!(refs = realloc(p->itemrefs, n * sizeof(objref))))
+		return -ENOMEM;
+	p->itemrefs = refs;
+#endif
+	p->nscratch = n;
 	return 0;
 }
 
-EXPORT int lvnanomsg_recv_multi(sock_obj **pinstdata, sock_obj *sockobj,
-				char** h, int *flags)
+#if POLLER_EPOLL
+static int poller_getfd(int sock, int opt)
 {
-	int ret = 0, n;
-	UHandle ptr;
-	bonzai *list;
-	CRITCHECK;
-	list = bonzai_init(NULL);
+	int fd;
+	size_t sz = sizeof(fd);
 
-	/* clear input handle */
-	if (acquire_mutex(sockobj->mutex) != 0)
-		return -ECRIT;
-	do {
-		/* get the next message part */
-		ptr = DSNewHClr( 4 );
-		if (!ptr) {
-			/* shit, out of memory */
-			ret = -ENOBUFS;
-			break;
-		}
+	if (nn_getsockopt(sock, NN_SOL_SOCKET, opt, &fd, &sz) < 0)
+		return -nn_errno();
+	return fd;
+}
 
-		ret = lvnanomsg_recv(pinstdata, sockobj, ptr, flags);
+static int poller_watch(poller_obj *p, int fd, uint64_t data, int add)
+{
+	struct epoll_event ev;
 
-		/* add it to the stack */
-		if (ret >= 0)
-			bonzai_grow(list, (void*)ptr);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;	/* both descriptors signal by becoming readable */
+	ev.data.u64 = data;
+	if (epoll_ctl(p->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+#endif
 
+/* bring the wait set in line with the events wanted for an entry */
+static int poller_ctl(poller_obj *p, pollent *e, int sock, int events)
+{
+#if POLLER_EPOLL
+	static const int opts[2] = { NN_RCVFD, NN_SNDFD };
+	static const int bits[2] = { NN_POLLIN, NN_POLLOUT };
+	int d, ret;
+
+	for (d = 0; d < 2; ++d) {
+		if ((events & bits[d]) == (e->events & bits[d]))
+			continue;
+		if ((e->fd[d] < 0) && ((e->fd[d] = poller_getfd(sock, opts[d])) < 0)) {
+			ret = e->fd[d];
+			e->fd[d] = -1;
+			return ret;
+		}
+		/* the low bit of the tag says which direction became ready */
+		ret = poller_watch(p, e->fd[d], ((uint64_t)e->sockref << 1) | d,
+				   events & bits[d]);
 		if (ret < 0)
-			break;;
-	} while (1);
-	release_mutex(sockobj->mutex);
-
-	/* turn stack into compatible array of handles */
-	n = list->n;
-	DSSetHandleSize(h, 8 + n * sizeof(void*));
-	memcpy(LVALIGN(*h + 4), list->elem, n * sizeof(void*));
-	*(u32*)*h = n;
-	bonzai_free(list);
-
-	return ret;
+			return ret;
+		e->events ^= bits[d];
+	}
+#else
+	e->events = events;
+#endif
+	return 0;
 }
 
-EXPORT int lvnanomsg_recv_multi_timeout(sock_obj **pinstdata, sock_obj *sockobj,
-					char** h, int *flags, long timeout)
+/* wait and fill in up to max (sockref, revents) pairs; returns the count */
+static int poller_collect(poller_obj *p, objref *sockrefs, int *revents,
+			  int max, long timeout)
 {
-	int ret = 0, evt = NN_POLLIN;	/* poll for input */
-	bonzai *polltree = NULL;
-	CHECK_SOCK(sockobj);
-	DSSetHSzClr(h, 4);		/* in case it fails */
+	int i, n, ret, k = 0;
+	objref ref;
+	void *msg;
+
+#if POLLER_EPOLL
+	int j;
 
-	ret = lvnanomsg_poll(&polltree, &sockobj, &evt, 1, timeout, NULL);
+	lock_enter(&p->lock);
+	ret = poller_scratch(p, max + 1);
+	lock_leave(&p->lock);
 	if (ret < 0)
-		return RET0( ret );	/* failed */
-	if (ret == 0)
-		return -EAGAIN;		/* timed out */
+		return ret;
+	n = epoll_wait(p->epfd, p->evs, max + 1, (int)timeout);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -errno;
+	for (i = 0; i < n; ++i) {
+		ref = (objref)(p->evs[i].data.u64 >> 1);
+		if (!ref) {
+			while (nn_recv(p->wake_rx, &msg, NN_MSG, NN_DONTWAIT) >= 0)
+				nn_freemsg(msg);
+			continue;
+		}
+		/* both directions of one socket make a single entry */
+		for (j = 0; (j < k) && (sockrefs[j] != ref); ++j)
+			;
+		if (j == k) {
+			if ((k >= max) || !objtable_get(ref, OBJ_SOCK))
+				continue;	/* closed meanwhile */
+			objtable_put(ref);
+			sockrefs[k] = ref;
+			revents[k++] = 0;
+		}
+		revents[j] |= (p->evs[i].data.u64 & 1) ? NN_POLLOUT : NN_POLLIN;
+	}
+#else
+	sock_obj *sockobj;
 
-	return lvnanomsg_recv_multi(pinstdata, sockobj, h, flags);
+	/* snapshot the set so that it may change during the wait */
+	lock_enter(&p->lock);
+	if ((ret = poller_scratch(p, p->n + 1)) < 0) {
+		lock_leave(&p->lock);
+		return ret;
+	}
+	p->items[0].fd = p->wake_rx;
+	p->items[0].events = NN_POLLIN;
+	p->itemrefs[0] = 0;
+	for (i = 0, n = 1; i < p->n; ++i) {
+		if (!p->ents[i].events
+		    || !(sockobj = objtable_get(p->ents[i].sockref, OBJ_SOCK)))
+			continue;
+		p->items[n].fd = sockobj->sock;
+		objtable_put(p->ents[i].sockref);
+		p->items[n].events = p->ents[i].events;
+		p->itemrefs[n++] = p->ents[i].sockref;
+	}
+	lock_leave(&p->lock);
+	ret = nn_poll(p->items, n, timeout);
+	if (ret < 0)
+		return (nn_errno() == ETERM) ? -ETERM : -nn_errno();
+	if (p->items[0].revents) {
+		while (nn_recv(p->wake_rx, &msg, NN_MSG, NN_DONTWAIT) >= 0)
+			nn_freemsg(msg);
+	}
+	for (i = 1; (i < n) && (k < max); ++i) {
+		if (!p->items[i].revents)
+			continue;
+		ref = p->itemrefs[i];
+		sockrefs[k] = ref;
+		revents[k++] = p->items[i].revents;
+	}
+#endif
+	return k;
 }
 
-EXPORT int lvnanomsg_sendmsg(sock_obj *sockobj, char** h, int *flags)
+EXPORT int lvnanomsg_poller_create(objref *pollref)
 {
-	struct nn_msghdr hdr;
-	struct nn_iovec *iovec = NULL;
-	char ***ptr = (char***)LVALIGN(*h + 4);
-	int ret = 0, n;
-	int size = *(u32*)*h;
-	
-	CHECK_SOCK(sockobj);
+	char addr[64];
+	poller_obj *p;
+#if POLLER_EPOLL
+	int fd;
+#endif
 
-	iovec = (struct nn_iovec *)malloc(sizeof(struct nn_iovec) * size);
-	if (!iovec)
+	*pollref = 0;
+	p = calloc(sizeof(poller_obj), 1);
+	if (!p)
+		return -ENOMEM;
+	lock_init(&p->lock);
+	sprintf(addr, "inproc://lvnanomsg-poller-%p", (void*)p);
+	p->wake_rx = nn_socket(AF_SP, NN_PAIR);
+	p->wake_tx = nn_socket(AF_SP, NN_PAIR);
+#if POLLER_EPOLL
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ((p->epfd < 0) || (p->wake_rx < 0) || (p->wake_tx < 0)
+	    || (nn_bind(p->wake_rx, addr) < 0)
+	    || (nn_connect(p->wake_tx, addr) < 0)
+	    || ((fd = poller_getfd(p->wake_rx, NN_RCVFD)) < 0)
+	    || (poller_watch(p, fd, 0, 1) < 0)) {
+#else
+	if ((p->wake_rx < 0) || (p->wake_tx < 0)
+	    || (nn_bind(p->wake_rx, addr) < 0)
+	    || (nn_connect(p->wake_tx, addr) < 0)) {
+#endif
+		poller_free(p);
 		return -ENOMEM;
-	memset(&hdr, 0, sizeof(hdr));
-	hdr.msg_iov = iovec;
-	hdr.msg_iovlen = size;
-
-	if (acquire_mutex(sockobj->mutex) != 0)
-		return -ECRIT;
-	for (n = size; n > 0; ++ptr, --n) {
-		UHandle htmp = (UHandle)*ptr;
-		if (h) {
-			const int l = *(u32*)*htmp;
-			void *msg = nn_allocmsg(l, 0);
-
-			if (msg == NULL)
-				return  -ENOBUFS;
-			
-			memcpy(msg, *htmp + 4, l);
-			iovec->iov_base = msg;
-			iovec->iov_len = l;
-		}
-		iovec++;
 	}
-	release_mutex(sockobj->mutex);
-
-	ret = nn_sendmsg(sockobj->sock, &hdr, flags ? *flags : 0);
-	free(hdr.msg_iov);
+	if (!(p->ref = objtable_add(p, OBJ_POLLER))) {
+		poller_free(p);
+		return -EMFILE;
+	}
+	*pollref = p->ref;
+	DEBUGMSG("POLLER created %p", p);
 
-	return RET0(ret);
+	return 0;
 }
 
-EXPORT int lvnanomsg_send(sock_obj *sockobj, const UHandle h, int *flags)
+EXPORT int lvnanomsg_poller_add(objref pollref, objref sockref, int events)
 {
-	int ret = 0;
-	void *msg;
-
-	CHECK_SOCK(sockobj);
+	int ret;
+	poller_obj *p;
+	pollent *e;
+	sock_obj *sockobj;
 
-	if (acquire_mutex(sockobj->mutex) != 0)
-		return -ECRIT;
-	if (h) {
-		const int l = *(u32*)*h;
-		msg = nn_allocmsg(l, 0);
-		if (msg == NULL) {
-			/* oh shit we're out of memory */
-			return -ENOBUFS;
+	if (!(p = objtable_get(pollref, OBJ_POLLER)))
+		return -EINVAL;
+	if (!(sockobj = sock_get(sockref))) {
+		objtable_put(pollref);
+		return -ENOTSOCK;
+	}
+	lock_enter(&p->lock);
+	if (poller_find(p, sockref)) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if (p->n >= p->nalloc) {
+		e = realloc(p->ents, (p->nalloc + 16) * sizeof(pollent));
+		if (!e) {
+			ret = -ENOMEM;
+			goto out;
 		}
-		memcpy(msg, *h + 4, l);
+		p->ents = e;
+		p->nalloc += 16;
 	}
-	ret = nn_send(sockobj->sock, &msg, NN_MSG, flags ? *flags : 0);
-	release_mutex(sockobj->mutex);
-	if (flags)
-		*flags = 0; /* unused */
+	e = &p->ents[p->n];
+	e->sockref = sockref;
+	e->events = 0;
+	e->fd[0] = e->fd[1] = -1;
+	if ((ret = poller_ctl(p, e, sockobj->sock, events)) < 0)
+		poller_ctl(p, e, sockobj->sock, 0);	/* undo half an add */
+	else
+		++p->n;
+out:
+	lock_leave(&p->lock);
+	objtable_put(sockref);
+	objtable_put(pollref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_send_multi(sock_obj *sockobj, char** h, int *flags)
+EXPORT int lvnanomsg_poller_modify(objref pollref, objref sockref, int events)
 {
-	int ret = 0, n;
-	char ***ptr = (char***)LVALIGN(*h + 4);
-	CHECK_SOCK(sockobj);
+	int ret;
+	poller_obj *p;
+	pollent *e;
+	sock_obj *sockobj;
 
-	for (n = *(u32*)*h; n > 0; ++ptr, --n) {
-		/* mutex locking is inside here */
-		ret = lvnanomsg_send(sockobj, (UHandle)*ptr, flags);
-		if (ret < 0)
-			break;
+	if (!(p = objtable_get(pollref, OBJ_POLLER)))
+		return -EINVAL;
+	if (!(sockobj = sock_get(sockref))) {
+		objtable_put(pollref);
+		return -ENOTSOCK;
 	}
+	lock_enter(&p->lock);
+	if ((e = poller_find(p, sockref)))
+		ret = poller_ctl(p, e, sockobj->sock, events);
+	else
+		ret = -ENOENT;
+	lock_leave(&p->lock);
+	objtable_put(sockref);
+	objtable_put(pollref);
 
 	return ret;
 }
 
-EXPORT int lvnanomsg_device(sock_obj *sockobj1, sock_obj *sockobj2)
+EXPORT int lvnanomsg_poller_remove(objref pollref, objref sockref)
 {
-	int ret;
-	int s1 = sockobj1->sock;
-	int s2 = sockobj2->sock;
+	poller_obj *p;
+	pollent *e;
+	sock_obj *sockobj;
 
-	ret = nn_device(s1, s2);
+	if (!(p = objtable_get(pollref, OBJ_POLLER)))
+		return -EINVAL;
+	lock_enter(&p->lock);
+	if (!(e = poller_find(p, sockref))) {
+		lock_leave(&p->lock);
+		objtable_put(pollref);
+		return -ENOENT;
+	}
+	/*
+	 * a closed socket has already left the epoll set along with its
+	 * descriptors, whose numbers may since belong to another socket
+	 */
+	if ((sockobj = objtable_get(sockref, OBJ_SOCK))) {
+		poller_ctl(p, e, sockobj->sock, 0);
+		objtable_put(sockref);
+	}
+	*e = p->ents[--p->n];
+	lock_leave(&p->lock);
+	objtable_put(pollref);
 
-	return RET0(ret);
+	return 0;
 }
 
-EXPORT int lvnanomsg_get_monitor_event(sock_obj** pinstdata, sock_obj *s,
-					int *intval, UHandle strval)
+/*
+ * wait for any registered socket to become ready and report up to
+ * maxevents of them; sockets closed meanwhile are quietly skipped
+ */
+EXPORT int lvnanomsg_poller_wait(objref *pinstdata, objref pollref,
+				 objref *sockrefs, int *revents, int maxevents,
+				 long timeout, int *nevents)
 {
-	UHandle buffer;
-	int ret, evtnum;
-	int id = 0, flags = 0;
-	uint32_t len;
-
-	/* we use a fake buffer so we can use lvnanomsg_recv and have protected abort semantics */
-	buffer = DSNewHClr(4);
-	DEBUGMSG("MONITOR %p blocking for recv", s->sock);
-	ret = lvnanomsg_recv(pinstdata, s, buffer, &flags);
-	DEBUGMSG( "  MONITOR got ret %d", ret );
-	/* if it failed, give up */
-	if ( ret < 0 )
-		return ret;
+	int ret;
+	poller_obj *p;
 
-	/* make sure it went as expected (ensure multi-part message, check payload size) */
-	len = **(uint32_t**)buffer;
-	if (!(flags & 1) || (len != 6)) {
-		DEBUGMSG("  UNEXPECTED MON package flag %i got %u bytes", flags, len);
-		DSDisposeHandle(buffer);
-		return -ECRIT;
+	*nevents = 0;
+	if ((maxevents <= 0) || !(p = objtable_get(pollref, OBJ_POLLER)))
+		return -EINVAL;
+	if (!atomic_cas(&p->waiting, 0, 1)) {
+		objtable_put(pollref);
+		return -EINPROGRESS;
 	}
+	/* store the reference in the instance in case of abort */
+	if (pinstdata)
+		*pinstdata = pollref;
 
-	/* reinterpret the payload */
-	evtnum = *(uint16_t*)(*(char**)buffer + 4);	/* first 2 bytes are event type */
-	*intval = *(int32_t*)(*(char**)buffer + 6);	/* next 4 bytes are int value */
-	/* get the event type */
-	ret = evtnum;
-	while ( ret >>= 1 ) ++id;
-	DSDisposeHandle(buffer);
+	ret = poller_collect(p, sockrefs, revents, maxevents, timeout);
+	if (atomic_get(&p->aborted)) {
+		atomic_set(&p->aborted, 0);
+		ret = -ETERM;
+		DEBUGMSG("POLLER %p aborted", p);
+	}
 
-	/* second frame is the address */
-	flags = 0;
-	ret = lvnanomsg_recv(pinstdata, s, strval, &flags);
-	/* pop a debug message */
-	DEBUGMSG("  SOCKET monitor got message, %i (%i), %s", evtnum, id, evt->data.connected.addr);
+	if (pinstdata)
+		*pinstdata = 0;
+	atomic_set(&p->waiting, 0);
+	objtable_put(pollref);
+	if (ret < 0)
+		return ret;
+	*nevents = ret;
 
-	/* return the event type */
-	return id + 1;
+	return ret;
 }
 
-typedef struct {
-	sock_obj *sockobj;
-	LVUserEventRef *event;
-} ReceiverData;
-
-#ifdef _WIN32
-DWORD WINAPI lvnanomsg_receiver_thread(LPVOID param)
-#else
-void* lvnanomsg_receiver_thread(void* param)
-#endif
+EXPORT int lvnanomsg_poller_abort(objref *pinstdata)
 {
-	int ret, err, flags = 0;
-	ReceiverData *data = (ReceiverData*)param;
-	struct nn_pollfd poller;
+	int i;
+	objref pollref = pinstdata ? *pinstdata : 0;
+	poller_obj *p;
+	sock_obj *sockobj;
 
-	poller.fd = data->sockobj->sock;
-	poller.events = NN_POLLIN;
-	
-	while ((ret = nn_poll(&poller, 1, -1)) > 0) {
-		if (poller.revents & NN_POLLIN) {
-			/* call RECV_MULTI to get all messages */
-			UHandle buffer = DSNewHClr(4);
-			// data->sockobj->flags &= ~FLAG_BLOCKING;	/* unmask as blocking */
-			ret = lvnanomsg_recv(NULL, data->sockobj, buffer, &flags);
-			// data->sockobj->flags |= FLAG_BLOCKING;	/* mask as blocking */
-			DEBUGMSG("  Poller recv ret %i", ret);
-			if (ret < 0)
-				continue; // ? TODO
-			/* post as LV event */
-			err = PostLVUserEvent(*data->event, &buffer);
-			DEBUGMSG("  Poller post event ret %i", err);
-		}
+	if (!(p = objtable_get(pollref, OBJ_POLLER)))
+		return 0;
+	DEBUGMSG("INTERRUPT POLLER %p, %i items", p, p->n);
+	atomic_set(&p->aborted, 1);
+	/* as for a poll, the sockets waited on are closed */
+	lock_enter(&p->lock);
+	for (i = 0; i < p->n; ++i) {
+		sockobj = objtable_get(p->ents[i].sockref, OBJ_SOCK);
+		if (!sockobj)
+			continue;
+		if (!(sockobj->ctx->flags & FLAG_INTERRUPT))
+			lvnanomsg_close(sockobj->ref, 1);
+		objtable_put(p->ents[i].sockref);
 	}
+	lock_leave(&p->lock);
+	nn_send(p->wake_tx, "", 0, NN_DONTWAIT);
+	objtable_put(pollref);
 
 	return 0;
 }
 
-EXPORT int lvnanomsg_start_receiver(LVUserEventRef *evt, sock_obj *sockobj)
+EXPORT int lvnanomsg_poller_destroy(objref pollref)
 {
-#ifdef _WIN32
-	HANDLE thread;
-#else
-	pthread_t thread;
-#endif
-
-	ReceiverData *data = calloc(sizeof(ReceiverData), 1);
-	data->event = evt;
-	data->sockobj = sockobj;
+	poller_obj *p;
 
-#ifdef _WIN32
-	thread = CreateThread(NULL, 0, lvnanomsg_receiver_thread, data, 0, NULL);
-	/* did the function call succeed? */
-	if (thread == NULL)
-		return -CRITERR;
-	/* is the thread currently running? */
-	if (WaitForSingleObject(thread,0) != WAIT_TIMEOUT)
-		return -EINVAL;
-	/* TerminateThread */
-#else
-	int tid = pthread_create(&thread, NULL, lvnanomsg_receiver_thread, data);
-	if (tid != 0)
+	if (!(p = objtable_get(pollref, OBJ_POLLER)))
 		return -EINVAL;
-	/* pthread_cancel with pthread_cleanup_push */
-#endif
+	if (objtable_remove(pollref) < 0) {
+		objtable_put(pollref);
+		return -EINVAL;	/* somebody else got there first */
+	}
+	/* kick out a wait in progress, which holds on to p until it is out */
+	nn_send(p->wake_tx, "", 0, NN_DONTWAIT);
+	objtable_put(pollref);	/* poller_free, once no call holds it */
 
-	/* success */
 	return 0;
 }
 
@@ -935,16 +5566,38 @@ void __attribute__ ((destructor)) lvnanomsg_unloadlib(void);
 
 void lvnanomsg_loadlib()
 {
+	trace_init();
 	DEBUGMSG("ATTACH library");
 	allinst = bonzai_init(NULL);
-	validobj = bonzai_init(NULL);
+	objtable_init();
+	/* what each type's last objtable_put frees it with */
+	objtable_settype(OBJ_CTX, (objtable_dtor)ctx_free);
+	objtable_settype(OBJ_SOCK, (objtable_dtor)sock_free);
+	objtable_settype(OBJ_LEASE, (objtable_dtor)lease_free);
+	objtable_settype(OBJ_RING, (objtable_dtor)ring_free);
+	objtable_settype(OBJ_DEVICE, (objtable_dtor)device_free);
+	objtable_settype(OBJ_DISPATCHER, (objtable_dtor)dispatch_free);
+	objtable_settype(OBJ_REQUEST, (objtable_dtor)dreq_free);
+	objtable_settype(OBJ_ASYNC, (objtable_dtor)async_free);
+	objtable_settype(OBJ_POLLER, (objtable_dtor)poller_free);
+	lock_init(&rxlock);
+	lock_init(&pacelock);
+	lock_init(&devlock);
+	devices = bonzai_init(NULL);
 }
 
 void lvnanomsg_unloadlib()
 {
 	DEBUGMSG("DETACH library");
+#ifndef _WIN32
+	/* joining threads under the Win32 loader lock would deadlock */
+	rx_stop();
+	pace_stop();
+	device_stopall();
+#endif
 	bonzai_free(allinst);
-	bonzai_free(validobj);
+	objtable_free();
+	trace_free();
 }
 
 #ifdef _WIN32
@@ -1046,108 +5699,155 @@ EXPORT void lvnanomsg_version(int *major, int *minor, int *patch)
 	nn_version(major, minor, patch);	
 }
 
-/* DIRECT WRAPPERS */
+/*
+ * TRACING
+ * switch the binary trace (see debug.h) on or off at any time; a dump
+ * appends whatever was recorded since the previous one to a text file
+ */
+EXPORT int lvnanomsg_trace_level(int level)
+{
+	int old = trace_level;
+
+	if ((level < TRACE_OFF) || (level > TRACE_ALL))
+		return -EINVAL;
+	trace_level = level;
+
+	return old;
+}
+
+EXPORT int lvnanomsg_trace_dump(const char *path, int *nevents)
+{
+	int n;
+
+	if (nevents)
+		*nevents = 0;
+	if (!path || !*path)
+		return -EINVAL;
+	if ((n = trace_dump(path)) < 0)
+		return -EIO;
+	if (nevents)
+		*nevents = n;
+
+	return 0;
+}
+
+/* DIRECT WRAPPERS -- nanomsg calls are thread-safe, so these take no lock */
 
-EXPORT int lvnanomsg_setsockopt(sock_obj *s, int level, int opt,
+EXPORT int lvnanomsg_setsockopt(objref sockref, int level, int opt,
 				const void *val, size_t len)
 {
 	int ret;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
-	if (acquire_mutex(s->mutex) != 0) 
-		return -ECRIT;
+	CHECK_SOCK(s, sockref);
 	ret = nn_setsockopt(s->sock, level, opt, val, len);
-	release_mutex(s->mutex);
+	/* keep the timeout the timed receives restore in step */
+	if ((ret == 0) && (level == NN_SOL_SOCKET) && (opt == NN_RCVTIMEO)
+	    && (len >= sizeof(int)))
+		s->rcvtimeo = s->rcvtimeo_user = *(const int*)val;
+	ret = RET0(ret);
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_getsockopt(sock_obj *s, int level, int opt,
+EXPORT int lvnanomsg_getsockopt(objref sockref, int level, int opt,
 				void *val, size_t *len)
 {
 	int ret;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
-	if (acquire_mutex(s->mutex) != 0)
-		return -ECRIT;
-	ret = nn_getsockopt(s->sock, level, opt, val, len);
-	release_mutex(s->mutex);
+	CHECK_SOCK(s, sockref);
+	ret = RET0(nn_getsockopt(s->sock, level, opt, val, len));
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_bind(sock_obj *s, const char *addr)
+EXPORT int lvnanomsg_bind(objref sockref, const char *addr)
 {
 	int ret;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
-	if (acquire_mutex(s->mutex) != 0)
-		return -ECRIT;
+	CHECK_SOCK(s, sockref);
 	DEBUGMSG("BINDing %d to %s", s->sock, addr);
 	ret = nn_bind(s->sock, addr);
 	s->eid = ret;
-	release_mutex(s->mutex);
+	ret = RET0(ret);
+	TRACE(TR_BIND, s->sock, ret, 0);
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_connect(sock_obj *s, const char *addr)
+EXPORT int lvnanomsg_connect(objref sockref, const char *addr)
 {
 	int ret;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
-	if (acquire_mutex(s->mutex) != 0)
-		return -ECRIT;
+	CHECK_SOCK(s, sockref);
 	ret = nn_connect(s->sock, addr);
 	s->eid = ret;
-	release_mutex(s->mutex);
+	ret = RET0(ret);
+	TRACE(TR_CONNECT, s->sock, ret, 0);
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT int lvnanomsg_shutdown(sock_obj *s)
+EXPORT int lvnanomsg_shutdown(objref sockref)
 {
 	int ret;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
-	if (acquire_mutex(s->mutex) != 0)
-		return -ECRIT;
-	ret = nn_shutdown(s->sock, s->eid);
-	release_mutex(s->mutex);
+	CHECK_SOCK(s, sockref);
+	ret = RET0(nn_shutdown(s->sock, s->eid));
+	objtable_put(sockref);
 
-	return RET0(ret);
+	return ret;
 }
 
-EXPORT uint64_t lvnanomsg_get_statistic(sock_obj *s, int statistic, uint64_t *result)
+EXPORT uint64_t lvnanomsg_get_statistic(objref sockref, int statistic, uint64_t *result)
 {
 	int ret = 0;
 	uint64_t val;
+	sock_obj *s;
 
-	CHECK_SOCK(s);
+	CHECK_SOCK(s, sockref);
 	if (result)
 		*result = 0;
 
-	if (acquire_mutex(s->mutex) != 0)
-		return -ECRIT;
+	/* statistics kept by the wrapper rather than by nanomsg */
+	if ((statistic >= LVSTAT_BASE) && (statistic < LVSTAT_BASE + LVSTAT_COUNT)) {
+		if (result)
+			*result = s->lvstats[statistic - LVSTAT_BASE];
+		objtable_put(sockref);
+		return 0;
+	}
+
 	val = nn_get_statistic(s->sock, statistic);
-	release_mutex(s->mutex);
+	if (val == ((uint64_t)-1))
+		ret = RET0(-1);
+	objtable_put(sockref);
 
 	if (result)
 		*result = val;
-	if (val == ((uint64_t)-1))
-		ret = -1;
-		
-	return RET0(ret);
+
+	return ret;
 }
 
-EXPORT int lvnanomsg_ctx_check(ctx_obj *x)
+EXPORT int lvnanomsg_ctx_check(objref ref)
 {
-	CHECK_INTERNAL(x, x->ctx, EINVAL, 0);
+	ctx_obj *x;
+	CHECK_INTERNAL(x, ref, OBJ_CTX, x->ctx, EINVAL, 0);
+	objtable_put(ref);
 	return 0;
 }
 
-EXPORT int lvnanomsg_sock_check(sock_obj *x)
+EXPORT int lvnanomsg_sock_check(objref ref)
 {
-	CHECK_INTERNAL(x, x->sock, ENOTSOCK, 0);
+	sock_obj *x;
+	CHECK_INTERNAL(x, ref, OBJ_SOCK, x->sock, ENOTSOCK, 0);
+	objtable_put(ref);
 	return 0;
 }
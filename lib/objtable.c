@@ -0,0 +1,203 @@
+/*
+----------------------------------------------------------------------
+OBJTABLE :: generation-tagged handle table
+Objects handed out to LabVIEW are referenced by an opaque handle made
+of a slot index and a generation counter instead of a raw pointer.
+Looking up a handle is O(1) and lock-free; a handle becomes stale as
+soon as its object is removed, even if the slot is later reused.
+A lookup holds the object until it is put back, and a removed object
+is only passed to its type's destructor once the last hold is gone.
+----------------------------------------------------------------------
+*/
+
+#include "objtable.h"
+
+#include <stdlib.h>
+
+/* slots live in fixed pages which never move, so readers need no lock */
+static objslot *objpages[OBJTABLE_MAX_PAGES];
+static int objnpages = 0;
+static int objfree_head = -1, objfree_tail = -1;
+static int objcount = 0;
+static lock_t objlock;
+static objtable_dtor objdtors[OBJTABLE_MAX_TYPES];
+
+static objslot* objtable_slot(unsigned int i)
+{
+	objslot *page = objpages[i >> OBJTABLE_PAGE_BITS];
+	return page ? &page[i & (OBJTABLE_PAGE_SIZE - 1)] : NULL;
+}
+
+static void objtable_release(int i)
+{
+	/* freed slots go to the back of the list to delay their reuse */
+	objtable_slot(i)->next = -1;
+	if (objfree_tail >= 0)
+		objtable_slot(objfree_tail)->next = i;
+	else
+		objfree_head = i;
+	objfree_tail = i;
+}
+
+static int objtable_grow(void)
+{
+	int i, base;
+	objslot *page;
+
+	if (objnpages >= OBJTABLE_MAX_PAGES)
+		return -1;	/* table is full */
+	page = calloc(OBJTABLE_PAGE_SIZE, sizeof(objslot));
+	if (!page)
+		return -1;
+	base = objnpages << OBJTABLE_PAGE_BITS;
+	objpages[objnpages++] = page;
+	for (i = 0; i < OBJTABLE_PAGE_SIZE; ++i)
+		objtable_release(base + i);
+	return 0;
+}
+
+/*
+ * drop a hold on slot i; the last one of a removed object gives the
+ * slot back and the object to its destructor, and since lookups of a
+ * stale handle hold the slot for a moment too, only the first of them
+ * to see it idle does that
+ */
+static void objtable_drop(int i)
+{
+	objslot *slot = objtable_slot(i);
+	void *obj = NULL;
+	objtable_dtor dtor = NULL;
+
+	if (atomic_dec(&slot->holds) != 0)
+		return;
+	lock_enter(&objlock);
+	if (!(atomic_get(&slot->gen) & 1) && slot->obj
+	    && (atomic_get(&slot->holds) == 0)) {
+		obj = slot->obj;
+		dtor = objdtors[slot->type];
+		slot->obj = NULL;
+		slot->type = 0;
+		objtable_release(i);
+	}
+	lock_leave(&objlock);
+	if (obj && dtor)
+		dtor(obj);
+}
+
+void objtable_init(void)
+{
+	lock_init(&objlock);
+	objnpages = objcount = 0;
+	objfree_head = objfree_tail = -1;
+}
+
+void objtable_free(void)
+{
+	int i;
+	for (i = 0; i < objnpages; ++i) {
+		free(objpages[i]);
+		objpages[i] = NULL;
+	}
+	objnpages = objcount = 0;
+	objfree_head = objfree_tail = -1;
+	lock_destroy(&objlock);
+}
+
+/* what frees the objects of a type once they are removed and let go of */
+void objtable_settype(int type, objtable_dtor dtor)
+{
+	if ((type > 0) && (type < OBJTABLE_MAX_TYPES))
+		objdtors[type] = dtor;
+}
+
+objref objtable_add(void *obj, int type)
+{
+	objslot *slot;
+	int i, gen;
+
+	if (!obj || (type <= 0) || (type >= OBJTABLE_MAX_TYPES))
+		return 0;
+	lock_enter(&objlock);
+	if ((objfree_head < 0) && (objtable_grow() < 0)) {
+		lock_leave(&objlock);
+		return 0;
+	}
+	/* pop the oldest free slot */
+	i = objfree_head;
+	slot = objtable_slot(i);
+	objfree_head = slot->next;
+	if (objfree_head < 0)
+		objfree_tail = -1;
+	slot->next = -1;
+	slot->type = type;
+	slot->obj = obj;
+	/* the table's own hold; added, as stale lookups may be passing through */
+	atomic_inc(&slot->holds);
+	/* publish: generation becomes odd once the slot is filled in */
+	gen = atomic_inc(&slot->gen);
+	++objcount;
+	lock_leave(&objlock);
+
+	return ((objref)(gen & OBJREF_GEN_MASK) << OBJREF_INDEX_BITS) | i;
+}
+
+/* look up and hold an object; every successful lookup needs an objtable_put */
+void* objtable_get(objref ref, int type)
+{
+	objslot *slot;
+	void *obj;
+	int i = (int)(ref & OBJREF_INDEX_MASK);
+	objref gen = ref >> OBJREF_INDEX_BITS;
+
+	/* live references always carry an odd generation */
+	if (!(gen & 1) || (gen > OBJREF_GEN_MASK))
+		return NULL;
+	if (!(slot = objtable_slot(i)))
+		return NULL;
+	/* hold it first, so that once the generation matches it cannot go */
+	atomic_inc(&slot->holds);
+	obj = slot->obj;
+	if (((atomic_get(&slot->gen) & OBJREF_GEN_MASK) != gen)
+	    || (slot->type != type)) {
+		objtable_drop(i);
+		return NULL;
+	}
+	return obj;
+}
+
+/* let go of an object from objtable_get */
+void objtable_put(objref ref)
+{
+	objtable_drop((int)(ref & OBJREF_INDEX_MASK));
+}
+
+/*
+ * make a reference stale and drop the table's hold on its object, which
+ * goes to the destructor at once if nobody else holds it; returns -1 if
+ * it was stale already, so of racing removers only one gets to go on
+ */
+int objtable_remove(objref ref)
+{
+	objslot *slot;
+	int i = (int)(ref & OBJREF_INDEX_MASK);
+
+	lock_enter(&objlock);
+	slot = objtable_slot(i);
+	if (!slot || !(slot->gen & 1)
+	    || ((slot->gen & OBJREF_GEN_MASK) != (ref >> OBJREF_INDEX_BITS))) {
+		lock_leave(&objlock);
+		return -1;	/* already stale */
+	}
+	/* retire the generation first so concurrent lookups fail */
+	atomic_inc(&slot->gen);
+	--objcount;
+	lock_leave(&objlock);
+	objtable_drop(i);
+
+	return i;
+}
+
+int objtable_count(void)
+{
+	return objcount;
+}
@@ -0,0 +1,54 @@
+/*
+----------------------------------------------------------------------
+OBJTABLE :: generation-tagged handle table
+Objects handed out to LabVIEW are referenced by an opaque handle made
+of a slot index and a generation counter instead of a raw pointer.
+Looking up a handle is O(1) and lock-free; a handle becomes stale as
+soon as its object is removed, even if the slot is later reused.
+A lookup holds the object until it is put back, and a removed object
+is only passed to its type's destructor once the last hold is gone.
+----------------------------------------------------------------------
+*/
+
+#ifndef OBJTABLE__H
+#define OBJTABLE__H
+
+#include "sync.h"
+
+/* a reference as seen by LabVIEW (pointer-sized integer, 0 is never valid) */
+typedef uintptr_t objref;
+
+#define OBJREF_INDEX_BITS	16
+#define OBJREF_INDEX_MASK	((1 << OBJREF_INDEX_BITS) - 1)
+#define OBJREF_GEN_MASK		0xFFFF
+
+#define OBJTABLE_PAGE_BITS	8
+#define OBJTABLE_PAGE_SIZE	(1 << OBJTABLE_PAGE_BITS)
+#define OBJTABLE_MAX_PAGES	(1 << (OBJREF_INDEX_BITS - OBJTABLE_PAGE_BITS))
+
+#define OBJTABLE_MAX_TYPES	16
+
+typedef struct {
+	atomic_t gen;	/* odd while the slot is in use */
+	atomic_t holds;	/* one for the table while live, one per lookup */
+	int type;
+	void *obj;
+	int next;	/* next slot on the free list */
+} objslot;
+
+typedef void (*objtable_dtor)(void *obj);
+
+void objtable_init(void);
+void objtable_free(void);
+void objtable_settype(int type, objtable_dtor dtor);
+objref objtable_add(void *obj, int type);
+void* objtable_get(objref ref, int type);
+void objtable_put(objref ref);
+int objtable_remove(objref ref);
+int objtable_count(void);
+
+#ifdef OBJTABLE_INLINE
+#include "objtable.c"
+#endif
+
+#endif
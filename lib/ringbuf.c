@@ -0,0 +1,110 @@
+/*
+----------------------------------------------------------------------
+RINGBUF :: lock-free single-producer/single-consumer record ring
+A fixed block of memory holding variable-length records, each one a
+32-bit length followed by its payload padded to 4 bytes. One thread
+may write while another reads without any lock; a record that does
+not fit is dropped and counted rather than waiting for space.
+----------------------------------------------------------------------
+*/
+
+#include "ringbuf.h"
+
+#include <stdlib.h>
+#include <memory.h>
+
+#define RINGBUF_ALIGN(x)	(((x) + 3) & ~(uint32_t)3)
+
+ringbuf* ringbuf_init(uint32_t size)
+{
+	ringbuf *r;
+	uint32_t n = 64;
+
+	/* round up to a power of two so positions can wrap freely */
+	while ((n < size) && (n < 0x40000000u))
+		n <<= 1;
+	r = calloc(sizeof(ringbuf), 1);
+	if (!r)
+		return NULL;
+	if (!(r->data = malloc(n))) {
+		free(r);
+		return NULL;
+	}
+	r->size = n;
+	r->mask = n - 1;
+	return r;
+}
+
+void ringbuf_free(ringbuf *r)
+{
+	if (!r)
+		return;
+	free(r->data);
+	free(r);
+}
+
+uint32_t ringbuf_used(ringbuf *r)
+{
+	return (uint32_t)atomic_get(&r->head) - (uint32_t)atomic_get(&r->tail);
+}
+
+int ringbuf_write(ringbuf *r, const void *x, uint32_t len)
+{
+	uint32_t head = (uint32_t)r->head;	/* only we move it */
+	uint32_t tail = (uint32_t)atomic_get(&r->tail);
+	uint32_t pos = head & r->mask;
+	uint32_t need = 4 + RINGBUF_ALIGN(len);
+	uint32_t skip = 0;
+
+	/* records never wrap; pad out the end of the block instead */
+	if (pos + need > r->size)
+		skip = r->size - pos;
+	if ((need + skip > r->size) || (head + skip + need - tail > r->size)) {
+		++r->dropped;
+		r->dropbytes += len;
+		return -1;
+	}
+	if (skip) {
+		*(uint32_t*)(r->data + pos) = RINGBUF_SKIP;
+		head += skip;
+		pos = 0;
+	}
+	*(uint32_t*)(r->data + pos) = len;
+	memcpy(r->data + pos + 4, x, len);
+	head += need;
+	/* publish; the release orders the payload before the new head */
+	atomic_set(&r->head, (int)head);
+	++r->written;
+	if (head - tail > r->highwater)
+		r->highwater = head - tail;
+	return 0;
+}
+
+int ringbuf_peek(ringbuf *r, const void **x, uint32_t *len)
+{
+	uint32_t tail = (uint32_t)r->tail;	/* only we move it */
+	uint32_t head = (uint32_t)atomic_get(&r->head);
+	uint32_t pos;
+
+	if (tail == head)
+		return 0;	/* empty */
+	pos = tail & r->mask;
+	if (*(uint32_t*)(r->data + pos) == RINGBUF_SKIP) {
+		/* the padding was published along with the record after it */
+		tail += r->size - pos;
+		atomic_set(&r->tail, (int)tail);
+		pos = 0;
+	}
+	*len = *(uint32_t*)(r->data + pos);
+	*x = r->data + pos + 4;
+	return 1;
+}
+
+void ringbuf_pop(ringbuf *r)
+{
+	uint32_t tail = (uint32_t)r->tail;
+	uint32_t len = *(uint32_t*)(r->data + (tail & r->mask));
+
+	/* only valid straight after a successful peek */
+	atomic_set(&r->tail, (int)(tail + 4 + RINGBUF_ALIGN(len)));
+}
@@ -0,0 +1,39 @@
+/*
+----------------------------------------------------------------------
+RINGBUF :: lock-free single-producer/single-consumer record ring
+A fixed block of memory holding variable-length records, each one a
+32-bit length followed by its payload padded to 4 bytes. One thread
+may write while another reads without any lock; a record that does
+not fit is dropped and counted rather than waiting for space.
+----------------------------------------------------------------------
+*/
+
+#ifndef RINGBUF__H
+#define RINGBUF__H
+
+#include "sync.h"
+
+#define RINGBUF_SKIP	0xFFFFFFFFu	/* rest of the block is padding */
+
+typedef struct {
+	char *data;
+	uint32_t size, mask;	/* size is a power of two */
+	atomic_t head;		/* write position, owned by the producer */
+	atomic_t tail;		/* read position, owned by the consumer */
+	/* producer-side statistics */
+	uint64_t written, dropped, dropbytes;
+	uint32_t highwater;
+} ringbuf;
+
+ringbuf* ringbuf_init(uint32_t size);
+void ringbuf_free(ringbuf *r);
+int ringbuf_write(ringbuf *r, const void *x, uint32_t len);
+int ringbuf_peek(ringbuf *r, const void **x, uint32_t *len);
+void ringbuf_pop(ringbuf *r);
+uint32_t ringbuf_used(ringbuf *r);
+
+#ifdef RINGBUF_INLINE
+#include "ringbuf.c"
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+/*
+----------------------------------------------------------------------
+SYNC :: portable locks, atomics, threads and clock
+Thin wrappers so the helper DLL can use the same names for a critical
+section, an atomic counter or a worker thread on both Win32 and POSIX
+targets. Expects <windows.h> or <pthread.h> to have been included.
+----------------------------------------------------------------------
+*/
+
+#include "sync.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+int thread_create(thread_t *t, thread_proc fn, void *arg)
+{
+#ifdef _WIN32
+	*t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+	return *t ? 0 : -1;
+#else
+	return pthread_create(t, NULL, fn, arg) ? -1 : 0;
+#endif
+}
+
+void thread_join(thread_t t)
+{
+#ifdef _WIN32
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+#else
+	pthread_join(t, NULL);
+#endif
+}
+
+void thread_sleep(int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+uint64_t clock_us(void)
+{
+	/* monotonic microseconds, for intervals only */
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+uint64_t clock_ns(void)
+{
+	/* as clock_us, for timing individual calls */
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,81 @@
+/*
+----------------------------------------------------------------------
+SYNC :: portable locks, atomics, threads and clock
+Thin wrappers so the helper DLL can use the same names for a critical
+section, an atomic counter or a worker thread on both Win32 and POSIX
+targets. Expects <windows.h> or <pthread.h> to have been included.
+----------------------------------------------------------------------
+*/
+
+#ifndef SYNC__H
+#define SYNC__H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION lock_t;
+
+#define lock_init(l)		InitializeCriticalSection(l)
+#define lock_destroy(l)		DeleteCriticalSection(l)
+#define lock_enter(l)		EnterCriticalSection(l)
+#define lock_leave(l)		LeaveCriticalSection(l)
+#define lock_try(l)		TryEnterCriticalSection(l)
+
+typedef volatile LONG atomic_t;
+
+#define atomic_get(p)		InterlockedCompareExchange((p), 0, 0)
+#define atomic_set(p,v)		InterlockedExchange((p), (v))
+#define atomic_inc(p)		InterlockedIncrement(p)
+#define atomic_dec(p)		InterlockedDecrement(p)
+#define atomic_cas(p,o,n)	(InterlockedCompareExchange((p), (n), (o)) == (o))
+#define atomic_or(p,v)		InterlockedOr((p), (v))
+#define atomic_and(p,v)		InterlockedAnd((p), (v))
+#define atomic_add64(p,v)	InterlockedExchangeAdd64((volatile LONGLONG*)(p), (v))
+
+typedef HANDLE thread_t;
+typedef LPTHREAD_START_ROUTINE thread_proc;
+
+#define THREAD_PROC(name,arg)	DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN		return 0
+#define THREAD_LOCAL		__declspec(thread)
+#else
+typedef pthread_mutex_t lock_t;
+
+#define lock_init(l)		pthread_mutex_init((l), NULL)
+#define lock_destroy(l)		pthread_mutex_destroy(l)
+#define lock_enter(l)		pthread_mutex_lock(l)
+#define lock_leave(l)		pthread_mutex_unlock(l)
+#define lock_try(l)		(pthread_mutex_trylock(l) == 0)
+
+typedef volatile int atomic_t;
+
+#define atomic_get(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_set(p,v)		__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_inc(p)		__atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_dec(p)		__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define atomic_cas(p,o,n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define atomic_or(p,v)		__atomic_fetch_or((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_and(p,v)		__atomic_fetch_and((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_add64(p,v)	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+typedef pthread_t thread_t;
+typedef void* (*thread_proc)(void*);
+
+#define THREAD_PROC(name,arg)	void* name(void *arg)
+#define THREAD_RETURN		return NULL
+#define THREAD_LOCAL		__thread
+#endif
+
+/* lock_try is nonzero if the lock was taken; atomic_or/and return the old value */
+
+int thread_create(thread_t *t, thread_proc fn, void *arg);
+void thread_join(thread_t t);
+void thread_sleep(int ms);
+uint64_t clock_us(void);
+uint64_t clock_ns(void);
+
+#ifdef SYNC_INLINE
+#include "sync.c"
+#endif
+
+#endif